@@ -0,0 +1,53 @@
+#include "fs_allocs.h"
+
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace {
+
+// Constant initialized, so no allocation nor guard on a thread's first use
+thread_local uint64_t allocCount = 0;
+thread_local uint64_t allocBytes = 0;
+
+}  // namespace
+
+bool allocCountingBuilt() {
+#ifdef FS_COUNT_ALLOCS
+    return true;
+#else
+    return false;
+#endif
+}
+
+AllocCounts threadAllocs() {
+    AllocCounts counts;
+    counts.allocs = allocCount;
+    counts.bytes = allocBytes;
+    return counts;
+}
+
+#ifdef FS_COUNT_ALLOCS
+
+/************************ replaced operators **********************/
+
+// The array, nothrow and sized forms of the standard library call these ones. Aligned forms
+// (for over-aligned types, which the FS doesn't use) keep their own allocator, uncounted.
+void* operator new(size_t size) {
+    allocCount++;
+    allocBytes += size;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FS_ALLOCS_H
+#define FS_ALLOCS_H
+
+#include <cstdint>
+
+using namespace std;
+
+/* Allocation counting, for allocations per op as a performance metric
+   Built with FS_COUNT_ALLOCS (cmake -DFS_COUNT_ALLOCS=ON), the global operator new is
+   replaced by one counting the calls and the bytes asked for in thread local counters, so a
+   thread tells what a call allocated by reading its counters before and after it. Built
+   without, nothing is replaced and the counters stay at 0.
+*/
+struct AllocCounts {
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+
+    AllocCounts operator-(const AllocCounts& other) const {
+        AllocCounts diff;
+        diff.allocs = allocs - other.allocs;
+        diff.bytes = bytes - other.bytes;
+        return diff;
+    }
+};
+
+// Whether operator new counts allocations in this build
+bool allocCountingBuilt();
+
+// Allocations of the calling thread so far
+AllocCounts threadAllocs();
+#endif
@@ -0,0 +1,64 @@
+#include "fs_allocs.h"
+
+#include <memory>
+#include <thread>
+
+#include "fs_impl.h"
+#include "gtest/gtest.h"
+
+/* Test allocation counting. Built without FS_COUNT_ALLOCS, the counters stay at 0. */
+namespace {
+
+// Keeps the compiler from eliding an allocation nothing reads
+void* volatile sink;
+
+// Tests a thread counts its own allocations and their bytes
+TEST(Allocs, TestThreadCounts) {
+    AllocCounts before = threadAllocs();
+    unique_ptr<char[]> block(new char[1000]);
+    sink = block.get();
+    AllocCounts counted = threadAllocs() - before;
+    if (!allocCountingBuilt()) {
+        EXPECT_EQ(0, counted.allocs);
+        EXPECT_EQ(0, threadAllocs().bytes);
+        return;
+    }
+    EXPECT_EQ(1, counted.allocs);
+    EXPECT_EQ(1000, counted.bytes);
+
+    // Another thread's allocations don't count here
+    before = threadAllocs();
+    AllocCounts other;
+    thread t([&other]() {
+        AllocCounts start = threadAllocs();
+        for (int i = 0; i < 10; i++) {
+            char* block = new char[64];
+            sink = block;
+            delete[] block;
+        }
+        other = threadAllocs() - start;
+    });
+    t.join();
+    EXPECT_EQ(10, other.allocs);
+    EXPECT_EQ(640, other.bytes);
+    // Only starting the thread allocated here
+    EXPECT_GT(10, (threadAllocs() - before).allocs);
+}
+
+// Tests FS ops are counted, e.g. cat copying the content it returns
+TEST(Allocs, TestOps) {
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    fs.touch("f");
+    fs.write("/f", string(4096, 'x'));
+    AllocCounts before = threadAllocs();
+    EXPECT_EQ(4096, fs.cat("/f").size());
+    AllocCounts counted = threadAllocs() - before;
+    if (allocCountingBuilt()) {
+        EXPECT_LE(1, counted.allocs);
+        EXPECT_LE(4096, counted.bytes);
+    } else {
+        EXPECT_EQ(0, counted.allocs);
+    }
+}
+}  // namespace
@@ -0,0 +1,302 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <random>
+
+#include "fs_allocs.h"
+#include "fs_generator.h"
+#include "fs_impl.h"
+
+using namespace std;
+
+namespace {
+
+// Build type fs_bench was built with (see gtest/CMakeLists.txt)
+#ifdef FS_BUILD_TYPE
+const char* const kBuildType = FS_BUILD_TYPE;
+#else
+const char* const kBuildType = "unknown";
+#endif
+
+struct Config {
+    int depth = 4;
+    int fanout = 8;
+    int nameLength = 8;
+    int fileSize = 64;
+    int ops = 10000;
+    // Nodes of a generated tree, or 0 for the uniform tree
+    uint64_t nodes = 0;
+    uint64_t seed = 1;
+    string only;
+    string out;
+};
+
+void usage() {
+    cout << "SYNOPSIS: fs_bench [--depth n] [--fanout n] [--name-length n] [--file-size bytes] [--ops n]"
+         << " [--nodes n] [--seed n] [--only op] [--out file]" << endl;
+    cout << "   Builds a tree of depth levels of fanout directories, each holding fanout files, then times ops" << endl;
+    cout << "   calls of each of cd, ls, find, cat, write, mkdir, touch, mv and rm (or only one) on it." << endl;
+    cout << "   With --nodes, generates a production shaped tree of that many nodes instead (see fs_generator.h)," << endl;
+    cout << "   with up to depth levels, up to fanout children per directory and a median file size." << endl;
+    cout << "   Prints JSON results to stdout, or to --out. Built with FS_COUNT_ALLOCS, results also have the" << endl;
+    cout << "   allocations and bytes allocated per op (see fs_allocs.h)." << endl;
+}
+
+// The i-th name of a directory's files or subdirectories, by prefix: unique, and
+// name-length characters long unless i needs more
+string nodeName(char prefix, uint64_t i, int length) {
+    string name(1, prefix);
+    do {
+        name += char('a' + i % 26);
+        i /= 26;
+    } while (i > 0);
+    if (int(name.size()) < length) name.append(length - name.size(), 'x');
+    return name;
+}
+
+// Latencies of one op, in ns, and what its calls allocated
+struct Result {
+    string op;
+    vector<uint64_t> latencies;
+    uint64_t totalNs = 0;
+    AllocCounts allocs;
+};
+
+// Time calls of run(i) for i in [0, count), and count their allocations if built to
+Result measure(const string& op, int count, const function<void(int)>& run) {
+    Result result;
+    result.op = op;
+    result.latencies.reserve(count);
+    AllocCounts before = threadAllocs();
+    for (int i = 0; i < count; i++) {
+        auto start = chrono::steady_clock::now();
+        run(i);
+        auto end = chrono::steady_clock::now();
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+        result.latencies.push_back(ns);
+        result.totalNs += ns;
+    }
+    result.allocs = threadAllocs() - before;
+    return result;
+}
+
+uint64_t percentile(const vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = min(sorted.size() - 1, size_t(p * sorted.size()));
+    return sorted[i];
+}
+
+void printJson(ostream& out, const Config& config, uint64_t nodeCount, vector<Result>& results) {
+    out << "{\n  \"config\": {\"depth\": " << config.depth << ", \"fanout\": " << config.fanout
+        << ", \"name_length\": " << config.nameLength << ", \"file_size\": " << config.fileSize
+        << ", \"ops\": " << config.ops << ", \"generated\": " << (config.nodes ? "true" : "false") << ", \"seed\": " << config.seed << ", \"nodes\": " << nodeCount
+        << ", \"count_allocs\": " << (allocCountingBuilt() ? "true" : "false")
+        << ", \"build_type\": \"" << kBuildType << "\"},\n"
+        << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        Result& result = results[i];
+        sort(result.latencies.begin(), result.latencies.end());
+        double seconds = result.totalNs / 1e9;
+        out << (i ? ",\n" : "\n") << "    {\"op\": \"" << result.op << "\", \"count\": " << result.latencies.size()
+            << ", \"ops_per_sec\": " << uint64_t(seconds > 0 ? result.latencies.size() / seconds : 0)
+            << ", \"ns_per_op\": " << (result.latencies.empty() ? 0 : result.totalNs / result.latencies.size())
+            << ", \"p50_ns\": " << percentile(result.latencies, 0.5)
+            << ", \"p99_ns\": " << percentile(result.latencies, 0.99)
+            << ", \"p999_ns\": " << percentile(result.latencies, 0.999);
+        if (allocCountingBuilt()) {
+            size_t count = max<size_t>(1, result.latencies.size());
+            out << ", \"allocs_per_op\": " << double(result.allocs.allocs) / count
+                << ", \"alloc_bytes_per_op\": " << double(result.allocs.bytes) / count;
+        }
+        out << "}";
+    }
+    out << "\n  ]\n}\n";
+}
+
+}  // namespace
+
+/* Microbenchmarks of the FileSystem operations
+   Builds a synthetic tree, then times every op on its own, one call at a time, on sessions
+   placed in random directories of the tree. Reports throughput and latency percentiles as
+   JSON, to compare a change against a baseline run with the same params. Built with
+   FS_COUNT_ALLOCS, also reports the allocations per op.
+*/
+int main(int argc, char** argv) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        string value = argv[++i];
+        if (option == "--depth") config.depth = max(1, atoi(value.c_str()));
+        else if (option == "--fanout") config.fanout = max(1, atoi(value.c_str()));
+        else if (option == "--name-length") config.nameLength = max(1, atoi(value.c_str()));
+        else if (option == "--file-size") config.fileSize = max(0, atoi(value.c_str()));
+        else if (option == "--ops") config.ops = max(1, atoi(value.c_str()));
+        else if (option == "--nodes") config.nodes = strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--seed") config.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--only") config.only = value;
+        else if (option == "--out") config.out = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    // Build the tree depth first, with one session walking down and back up: every
+    // directory gets fanout files, and fanout subdirectories above the last level
+    FileSystem fs;
+    string content(config.fileSize, 'c');
+    vector<string> dirs;
+    vector<string> files;
+    FileSystem::Session walker(fs);
+    function<void(int)> build = [&](int level) {
+        string here = fs.pwd(walker);
+        dirs.push_back(here);
+        for (int i = 0; i < config.fanout; i++) {
+            string name = nodeName('f', i, config.nameLength);
+            fs.touch(walker, name);
+            fs.write(walker, name, content);
+            files.push_back(here + name);
+        }
+        if (level == config.depth) return;
+        for (int i = 0; i < config.fanout; i++) {
+            string name = nodeName('d', i, config.nameLength);
+            fs.mkdir(walker, name);
+            fs.cd(walker, name);
+            build(level + 1);
+            fs.cd(walker, "../");
+        }
+    };
+    if (config.nodes == 0) {
+        build(0);
+    } else {
+        TreeShape shape;
+        shape.nodeCount = config.nodes;
+        shape.maxDepth = config.depth;
+        shape.maxFanout = config.fanout;
+        shape.medianFileSize = config.fileSize;
+        shape.seed = config.seed;
+        dirs.push_back("/");
+        generateTree(fs, shape, [&](const string& path, bool isDir) { (isDir ? dirs : files).push_back(path); });
+        if (files.empty()) {
+            cout << "No files generated" << endl;
+            return 1;
+        }
+    }
+    uint64_t nodeCount = dirs.size() + files.size();
+
+    // Sessions in random directories, with the path to them
+    mt19937_64 random(config.seed);
+    const int kSessions = 64;
+    vector<unique_ptr<FileSystem::Session>> sessions;
+    vector<string> sessionDirs;
+    for (int i = 0; i < kSessions; i++) {
+        sessionDirs.push_back(dirs[random() % dirs.size()]);
+        sessions.emplace_back(new FileSystem::Session(fs, false, i + 1));
+        for (const string& part : fs.split(sessionDirs.back().substr(1), '/')) {
+            if (!part.empty()) fs.cd(*sessions.back(), part);
+        }
+    }
+    auto session = [&](int i) -> FileSystem::Session& { return *sessions[i % kSessions]; };
+    // The args of every call are made before timing an op: only the op is measured, in time
+    // and in allocations. Random paths of each call, and names numbered by call.
+    auto randomPaths = [&](const vector<string>& paths) {
+        vector<const string*> picks(config.ops);
+        for (const string*& pick : picks) pick = &paths[random() % paths.size()];
+        return picks;
+    };
+    auto numbered = [&](const string& prefix) {
+        vector<string> names(config.ops);
+        for (int i = 0; i < config.ops; i++) names[i] = prefix + to_string(i);
+        return names;
+    };
+    // Name of a directory, and the first subdirectory of each directory that has one
+    string childName = "";
+    map<string, string> firstChild;
+    for (const string& dir : dirs) {
+        if (dir == "/") continue;
+        size_t start = dir.rfind('/', dir.size() - 2) + 1;
+        string name = dir.substr(start, dir.size() - 1 - start);
+        firstChild.emplace(dir.substr(0, start), name);
+        if (childName.empty()) childName = name;
+    }
+    string newName = nodeName('n', 0, config.nameLength);
+
+    vector<Result> results;
+    auto wanted = [&](const string& op) { return config.only.empty() || config.only == op; };
+    if (wanted("cd")) {
+        // Two calls per round trip of a session: down into a child and back up, or from a
+        // directory without subdirectories, up and back down
+        vector<pair<string, string>> trips;
+        for (const string& dir : sessionDirs) {
+            if (firstChild.count(dir)) {
+                trips.push_back({firstChild[dir], "../"});
+            } else if (dir == "/") {
+                trips.push_back({"../", "../"});
+            } else {
+                size_t start = dir.rfind('/', dir.size() - 2) + 1;
+                trips.push_back({"../", dir.substr(start, dir.size() - 1 - start)});
+            }
+        }
+        results.push_back(measure("cd", config.ops, [&](int i) {
+            const pair<string, string>& trip = trips[(i / 2) % kSessions];
+            fs.cd(session(i / 2), i % 2 ? trip.second : trip.first);
+        }));
+    }
+    if (wanted("ls")) {
+        vector<const string*> paths = randomPaths(dirs);
+        results.push_back(measure("ls", config.ops, [&](int i) { fs.ls(*paths[i]); }));
+    }
+    if (wanted("find")) {
+        results.push_back(measure("find", config.ops, [&](int i) { fs.find(session(i), childName); }));
+    }
+    if (wanted("cat")) {
+        vector<const string*> paths = randomPaths(files);
+        results.push_back(measure("cat", config.ops, [&](int i) { fs.cat(*paths[i]); }));
+    }
+    if (wanted("write")) {
+        vector<const string*> paths = randomPaths(files);
+        results.push_back(measure("write", config.ops, [&](int i) { fs.write(*paths[i], content); }));
+    }
+    if (wanted("mkdir")) {
+        vector<const string*> parents = randomPaths(dirs);
+        vector<string> paths = numbered(newName);
+        for (int i = 0; i < config.ops; i++) paths[i] = *parents[i] + paths[i];
+        results.push_back(measure("mkdir", config.ops, [&](int i) { fs.mkdir(paths[i]); }));
+    }
+    // touch, mv and rm work on the same new files, each in its session's directory
+    bool touched = wanted("touch") || wanted("mv") || wanted("rm");
+    vector<string> touchNames = touched ? numbered("t") : vector<string>();
+    vector<string> mvNames = wanted("mv") ? numbered("m") : vector<string>();
+    if (touched) {
+        Result result = measure("touch", config.ops, [&](int i) { fs.touch(session(i), touchNames[i]); });
+        if (wanted("touch")) results.push_back(result);
+    }
+    if (wanted("mv")) {
+        results.push_back(measure("mv", config.ops, [&](int i) { fs.mv(session(i), touchNames[i], mvNames[i]); }));
+    }
+    if (wanted("rm")) {
+        const vector<string>& names = wanted("mv") ? mvNames : touchNames;
+        results.push_back(measure("rm", config.ops, [&](int i) { fs.rm(session(i), names[i]); }));
+    }
+    if (results.empty()) {
+        usage();
+        return 1;
+    }
+
+    if (config.out.empty()) {
+        printJson(cout, config, nodeCount, results);
+    } else {
+        ofstream out(config.out);
+        printJson(out, config, nodeCount, results);
+        if (!out) {
+            cout << "Cannot write " << config.out << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
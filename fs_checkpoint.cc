@@ -0,0 +1,128 @@
+#include "fs_checkpoint.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+string checkpointName(uint64_t lsn) {
+    char name[64];
+    snprintf(name, sizeof(name), "checkpoint-%020llu.img", (unsigned long long) lsn);
+    return name;
+}
+
+// Lsns of the checkpoints in dir, in order
+vector<uint64_t> listCheckpoints(const string& dir) {
+    vector<uint64_t> checkpoints;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return checkpoints;
+    while (dirent* entry = readdir(d)) {
+        unsigned long long lsn;
+        if (sscanf(entry->d_name, "checkpoint-%20llu", &lsn) == 1 && entry->d_name == checkpointName(lsn)) {
+            checkpoints.push_back(lsn);
+        }
+    }
+    closedir(d);
+    sort(checkpoints.begin(), checkpoints.end());
+    return checkpoints;
+}
+
+void syncDir(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) < 0) {
+        int error = errno;
+        if (fd >= 0) close(fd);
+        throw runtime_error("Cannot sync " + path + ": " + strerror(error));
+    }
+    close(fd);
+}
+
+}  // namespace
+
+Checkpointer::Checkpointer(FileSystem& fs, WriteAheadLog& wal, const string& dir) : fs(fs), wal(wal), dir(dir) {
+    vector<uint64_t> checkpoints = listCheckpoints(dir);
+    lastLsn = checkpoints.empty() ? 0 : checkpoints.back();
+}
+
+Checkpointer::~Checkpointer() {
+    if (periodic.joinable()) {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        periodic.join();
+    }
+}
+
+// Write the image to a temporary file and rename it into place once it is on disk, so a
+// crash never leaves a partial checkpoint behind. Only then is what it covers deleted.
+uint64_t Checkpointer::checkpoint() {
+    lock_guard<mutex> guard(checkpointLock);
+    string tmpPath = dir + "/checkpoint.tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw runtime_error("Cannot create " + tmpPath + ": " + strerror(errno));
+    uint64_t lsn;
+    try {
+        lsn = fs.save(fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    if (fsync(fd) < 0) {
+        int error = errno;
+        close(fd);
+        throw runtime_error("Cannot sync " + tmpPath + ": " + strerror(error));
+    }
+    close(fd);
+    string path = dir + "/" + checkpointName(lsn);
+    if (rename(tmpPath.c_str(), path.c_str()) < 0) {
+        throw runtime_error("Cannot rename " + tmpPath + ": " + strerror(errno));
+    }
+    syncDir(dir);
+
+    for (uint64_t older : listCheckpoints(dir)) {
+        if (older < lsn) unlink((dir + "/" + checkpointName(older)).c_str());
+    }
+    wal.truncate(lsn);
+    lastLsn = lsn;
+    return lsn;
+}
+
+void Checkpointer::start(chrono::seconds interval) {
+    periodic = thread([this, interval]() {
+        unique_lock<mutex> guard(lock);
+        while (!wake.wait_for(guard, interval, [this]() { return stopping; })) {
+            guard.unlock();
+            bool changed;
+            {
+                lock_guard<mutex> checkpointGuard(checkpointLock);
+                changed = wal.lsn() != lastLsn;
+            }
+            try {
+                if (changed) checkpoint();
+            } catch (const exception& e) {
+                // The log still has everything: try again next time
+                cerr << "Checkpoint failed: " << e.what() << endl;
+            }
+            guard.lock();
+        }
+    });
+}
+
+uint64_t Checkpointer::recover(FileSystem& fs, const string& dir) {
+    vector<uint64_t> checkpoints = listCheckpoints(dir);
+    uint64_t lsn = 0;
+    if (!checkpoints.empty()) {
+        lsn = fs.load(dir + "/" + checkpointName(checkpoints.back()));
+    }
+    FileSystem::Session replay(fs);
+    return WriteAheadLog::read(dir, lsn, [&](const WalRecord& record) { fs.apply(replay, record); });
+}
@@ -0,0 +1,52 @@
+#ifndef FS_CHECKPOINT_H
+#define FS_CHECKPOINT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "fs_impl.h"
+#include "fs_wal.h"
+
+using namespace std;
+
+/* Checkpoints of a FileSystem logging to a write-ahead log
+   A checkpoint is an image of the tree (see fs_image.h) written to the log directory as
+   checkpoint-<lsn>.img. Once it is on disk, older checkpoints and the log segments it
+   covers are deleted: recovery maps the latest checkpoint and only replays the records
+   after it, and the log no longer grows without bound. The image is written by a forked
+   child (see FileSystem::save), so writers don't wait for it.
+*/
+class Checkpointer {
+    FileSystem& fs;
+    WriteAheadLog& wal;
+    string dir;
+    // Serializes checkpoints, and guards lastLsn
+    mutex checkpointLock;
+    // Lsn of the latest checkpoint
+    uint64_t lastLsn;
+
+    // Periodic checkpoints
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    thread periodic;
+  public:
+    // Checkpoint fs, which logs to wal in dir
+    Checkpointer(FileSystem& fs, WriteAheadLog& wal, const string& dir);
+    ~Checkpointer();
+    Checkpointer(const Checkpointer&) = delete;
+    Checkpointer& operator=(const Checkpointer&) = delete;
+
+    // Write a checkpoint now, and return its lsn
+    uint64_t checkpoint();
+    // Checkpoint in a background thread every interval, when anything was logged since the last one
+    void start(chrono::seconds interval);
+
+    // Rebuild fs (which must be empty) from the latest checkpoint in dir and the log after it.
+    // Return the lsn of the last record.
+    static uint64_t recover(FileSystem& fs, const string& dir);
+};
+#endif
@@ -0,0 +1,420 @@
+#include "fs_checkpoint.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+/* Test images of the tree, and recovering from a checkpoint and the log after it */
+namespace {
+
+vector<string> listDir(const string& dir) {
+    vector<string> names;
+    DIR* d = opendir(dir.c_str());
+    while (dirent* entry = d ? readdir(d) : nullptr) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    if (d) closedir(d);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+void removeDir(const string& dir) {
+    for (const string& name : listDir(dir)) unlink((dir + "/" + name).c_str());
+    rmdir(dir.c_str());
+}
+
+string tempDir() {
+    string path = "/tmp/fs_checkpoint_test." + to_string(getpid());
+    removeDir(path);
+    return path;
+}
+
+// Save fs to a file in dir, and return its path
+string saveImage(FileSystem& fs, const string& dir, const string& name = "image") {
+    mkdir(dir.c_str(), 0755);
+    string path = dir + "/" + name;
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    fs.save(fd);
+    close(fd);
+    return path;
+}
+
+// Tests an image loads back into the same tree, with paths usable by later ops
+TEST(Checkpoint, TestSaveLoad) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b/c");
+    fs.mkdir("/a/e");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", string("binary\0\n content", 16));
+    fs.touch("empty");
+    string path = saveImage(fs, dir);
+
+    FileSystem copy;
+    copy.mkdir("/old");
+    FileSystem::Session session(copy);
+    copy.cd(session, "old");
+    EXPECT_EQ(0, copy.load(path));
+    // Sessions move to root
+    EXPECT_EQ("/", copy.pwd(session));
+    EXPECT_EQ(vector<string>{"a"}, copy.ls("/"));
+    EXPECT_EQ((vector<string>{"b", "e", "empty", "f"}), copy.ls("/a"));
+    EXPECT_EQ(string("binary\0\n content", 16), copy.cat("/a/f"));
+    EXPECT_EQ("", copy.cat("/a/empty"));
+    EXPECT_EQ(vector<string>{"/a/b/c/"}, copy.find("c"));
+    copy.cd("a");
+    copy.cd("b");
+    EXPECT_EQ("/a/b/", copy.pwd());
+    removeDir(dir);
+}
+
+// Tests writes to a tree loaded from an image, and saving a tree partly still in its image
+TEST(Checkpoint, TestLoadedTree) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    fs.mkdir("/c/d");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", "image ");
+    fs.touch("g");
+    fs.write("g", "untouched");
+    string path = saveImage(fs, dir);
+
+    FileSystem loaded;
+    loaded.load(path);
+    loaded.cd("a");
+    loaded.write("f", "heap");
+    loaded.mkdir("b/new");
+    loaded.cp("g", "copied");
+    loaded.rm("g");
+    loaded.mv("f", "h");
+    // /c was never visited: its copy shares the image nodes
+    loaded.cp("/c", "/e", true);
+    loaded.cp("/e", "/e2", true);
+    EXPECT_EQ("image heap", loaded.cat("h"));
+    // /c was never visited: it's saved straight from the first image
+    string second = saveImage(loaded, dir, "second");
+
+    FileSystem copy;
+    copy.load(second);
+    EXPECT_EQ((vector<string>{"a", "c", "e", "e2"}), copy.ls("/"));
+    EXPECT_EQ((vector<string>{"b", "copied", "h"}), copy.ls("/a"));
+    EXPECT_EQ("untouched", copy.cat("/a/copied"));
+    EXPECT_EQ(vector<string>{"d"}, copy.ls("/e2"));
+    EXPECT_EQ(vector<string>{"new"}, copy.ls("/a/b"));
+    EXPECT_EQ(vector<string>{"d"}, copy.ls("/c"));
+    EXPECT_EQ("image heap", copy.cat("/a/h"));
+    // Hashes are saved with the nodes: unvisited parts of both trees compare as equal
+    EXPECT_TRUE(FileSystem::diff(loaded, copy).empty());
+    loaded.write("/a/h", "!");
+    EXPECT_EQ(vector<string>{"M /a/h"}, FileSystem::diff(copy, loaded));
+    removeDir(dir);
+}
+
+// Tests readers loading the same directories concurrently
+// Tests a loaded tree only takes memory for the nodes visited and the contents written
+TEST(Checkpoint, TestLoadedMemoryUsage) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", string(1000, 'x'));
+    string path = saveImage(fs, dir);
+
+    FileSystem loaded;
+    loaded.load(path);
+    MemoryUsage root = loaded.memoryUsage("/");
+    EXPECT_EQ(0, root.containers);
+    EXPECT_EQ("/a/", loaded.find("a")[0]);
+    EXPECT_EQ(string(1000, 'x'), loaded.cat("/a/f"));
+    MemoryUsage visited = loaded.memoryUsage("/");
+    EXPECT_EQ(4 * root.nodes, visited.nodes);
+    EXPECT_EQ(0, visited.contents);
+    loaded.write("/a/f", "!");
+    EXPECT_LT(1000, loaded.memoryUsage("/a").contents);
+    EXPECT_EQ(fs.memoryUsage("/").nodes, loaded.memoryUsage("/").nodes);
+    removeDir(dir);
+}
+
+// Tests du of a loaded tree answers from the image for directories not visited yet, and
+// saving keeps the sizes of both visited and unvisited parts
+TEST(Checkpoint, TestLoadedDu) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b/c");
+    fs.mkdir("/d");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", string(1000, 'x'));
+    string path = saveImage(fs, dir);
+
+    FileSystem loaded;
+    loaded.load(path);
+    MemoryUsage unvisited = loaded.memoryUsage("/");
+    DiskUsage root = loaded.du("/");
+    EXPECT_EQ(1, root.files);
+    EXPECT_EQ(4, root.dirs);
+    EXPECT_EQ(1000, root.bytes);
+    EXPECT_EQ(unvisited.nodes, loaded.memoryUsage("/").nodes);
+    EXPECT_EQ(1, loaded.du("/a/b").dirs);
+
+    loaded.write("/a/f", "!");
+    string second = saveImage(loaded, dir, "second");
+    FileSystem copy;
+    copy.load(second);
+    EXPECT_EQ(1001, copy.du("/").bytes);
+    EXPECT_EQ(4, copy.du("/").dirs);
+    EXPECT_EQ(1001, copy.du("/a").bytes);
+    removeDir(dir);
+}
+
+// Tests overlays of a tree loaded from an image, and saving an overlay: its unchanged
+// parts are written straight from the lower tree and the image
+TEST(Checkpoint, TestOverlayOfLoaded) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    fs.mkdir("/c/d");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", "image");
+    string path = saveImage(fs, dir);
+
+    FileSystem base;
+    base.load(path);
+    // Half loaded: /a is on the heap, /c still in the image
+    EXPECT_EQ((vector<string>{"b", "f"}), base.ls("/a"));
+    // Reads of an overlay go to the lower tree and the image in place, loading nothing
+    {
+        int64_t loaded = base.memoryUsage("/").total();
+        FileSystem reader(base);
+        int64_t fresh = reader.memoryUsage("/").total();
+        EXPECT_EQ(vector<string>{"/c/d/"}, reader.find("d"));
+        EXPECT_EQ(vector<string>{"d"}, reader.ls("/c"));
+        EXPECT_EQ("image", reader.cat("/c/../a/f"));
+        EXPECT_EQ(1, reader.du("/c").dirs);
+        EXPECT_EQ(0, reader.memoryUsage("/c/d").total());
+        EXPECT_EQ(fresh, reader.memoryUsage("/").total());
+        EXPECT_EQ(loaded, base.memoryUsage("/").total());
+    }
+    FileSystem first(base);
+    FileSystem second(base);
+    first.write("/a/f", " first");
+    first.cd("c");
+    first.rm("d");
+    second.mkdir("/c/d/e");
+    EXPECT_EQ("image first", first.cat("/a/f"));
+    EXPECT_EQ("image", second.cat("/a/f"));
+    EXPECT_TRUE(first.ls("/c").empty());
+    EXPECT_EQ(vector<string>{"e"}, second.ls("/c/d"));
+    EXPECT_EQ(vector<string>{"d"}, base.ls("/c"));
+    EXPECT_TRUE(base.ls("/c/d").empty());
+
+    FileSystem copy;
+    copy.load(saveImage(second, dir, "second"));
+    EXPECT_EQ((vector<string>{"b", "f"}), copy.ls("/a"));
+    EXPECT_EQ("image", copy.cat("/a/f"));
+    EXPECT_EQ(vector<string>{"e"}, copy.ls("/c/d"));
+    removeDir(dir);
+}
+
+TEST(Checkpoint, TestConcurrentLoad) {
+    string dir = tempDir();
+    FileSystem fs;
+    for (int i = 0; i < 50; i++) {
+        fs.mkdir("/d" + to_string(i) + "/sub");
+        fs.cd("d" + to_string(i));
+        fs.touch("f");
+        fs.write("f", to_string(i));
+        fs.cd("../");
+    }
+    string path = saveImage(fs, dir);
+
+    FileSystem loaded;
+    loaded.load(path);
+    vector<thread> readers;
+    for (int t = 0; t < 8; t++) {
+        readers.emplace_back([&loaded]() {
+            FileSystem::Session session(loaded);
+            for (int i = 0; i < 50; i++) {
+                string d = "/d" + to_string(i);
+                EXPECT_EQ((vector<string>{"f", "sub"}), loaded.ls(session, d));
+                EXPECT_EQ(to_string(i), loaded.cat(session, d + "/f"));
+            }
+            EXPECT_EQ(50, loaded.find(session, "sub").size());
+        });
+    }
+    for (thread& reader : readers) reader.join();
+    removeDir(dir);
+}
+
+// Tests a truncated or corrupt image is rejected and leaves the tree alone
+TEST(Checkpoint, TestCorruptImage) {
+    string dir = tempDir();
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    fs.touch("f");
+    string path = saveImage(fs, dir);
+    struct stat st;
+    stat(path.c_str(), &st);
+
+    FileSystem copy;
+    copy.mkdir("kept");
+    for (off_t size : {off_t(0), off_t(10), off_t(st.st_size - 1)}) {
+        EXPECT_EQ(0, truncate(path.c_str(), size));
+        EXPECT_THROW(copy.load(path), runtime_error);
+    }
+    EXPECT_THROW(copy.load(dir + "/missing"), runtime_error);
+    EXPECT_EQ(vector<string>{"kept"}, copy.ls("/"));
+
+    // Bad nodes are found when the image is opened, not when an op visits them
+    path = saveImage(fs, dir);
+    int fd = open(path.c_str(), O_WRONLY);
+    ImageNode bad = {0, 1, 1, 1000, 1};
+    EXPECT_EQ(sizeof(bad), pwrite(fd, &bad, sizeof(bad), TreeImage::kHeaderSize + sizeof(ImageNode)));
+    close(fd);
+    EXPECT_THROW(copy.load(path), runtime_error);
+
+    // So are names the FS can't create: root, a, f and b come before the names, a first
+    path = saveImage(fs, dir);
+    fd = open(path.c_str(), O_WRONLY);
+    EXPECT_EQ(1, pwrite(fd, "/", 1, TreeImage::kHeaderSize + 4 * sizeof(ImageNode)));
+    close(fd);
+    try {
+        copy.load(path);
+        FAIL() << "Expected exception because of a bad name";
+    }
+    catch(runtime_error const & err) {
+        EXPECT_EQ(err.what(), string("Corrupt image: bad name"));
+    }
+    EXPECT_EQ(vector<string>{"kept"}, copy.ls("/"));
+    removeDir(dir);
+}
+
+// Tests a deep tree round trips
+TEST(Checkpoint, TestDeepTree) {
+    string dir = tempDir();
+    FileSystem fs;
+    string path;
+    for (int i = 0; i < 5000; i++) path += "/d";
+    fs.mkdir(path);
+    FileSystem copy;
+    copy.load(saveImage(fs, dir));
+    EXPECT_EQ(vector<string>{"d"}, copy.ls(path.substr(0, path.size() - 2)));
+    removeDir(dir);
+}
+
+// Tests recovery from a checkpoint plus the log after it, and that checkpoints delete what they cover
+TEST(Checkpoint, TestRecover) {
+    string dir = tempDir();
+    {
+        FileSystem fs;
+        WriteAheadLog wal(dir, Durability::GroupCommit);
+        fs.attachLog(&wal);
+        Checkpointer checkpointer(fs, wal, dir);
+        fs.mkdir("/a/b");
+        fs.touch("f");
+        fs.write("f", "before ");
+        EXPECT_EQ(3, checkpointer.checkpoint());
+        fs.write("f", "first ");
+        fs.rm("a");
+        EXPECT_EQ(5, checkpointer.checkpoint());
+        EXPECT_EQ((vector<string>{"checkpoint-00000000000000000005.img", "wal-00000000000000000006.log"}), listDir(dir));
+        fs.mkdir("x");
+        fs.write("/f", "after");
+    }
+
+    FileSystem fs;
+    EXPECT_EQ(7, Checkpointer::recover(fs, dir));
+    EXPECT_EQ((vector<string>{"f", "x"}), fs.ls("/"));
+    EXPECT_EQ("before first after", fs.cat("f"));
+
+    // The log continues after recovery
+    {
+        WriteAheadLog wal(dir, Durability::PerOp, 7);
+        fs.attachLog(&wal);
+        fs.touch("g");
+        fs.attachLog(nullptr);
+    }
+    FileSystem again;
+    EXPECT_EQ(8, Checkpointer::recover(again, dir));
+    EXPECT_EQ((vector<string>{"f", "g", "x"}), again.ls("/"));
+    removeDir(dir);
+}
+
+// Tests writers don't wait for a large checkpoint to be written, and the checkpoint holds
+// the tree as of its lsn only
+TEST(Checkpoint, TestWriteDuringCheckpoint) {
+    string dir = tempDir();
+    FileSystem fs;
+    WriteAheadLog wal(dir, Durability::None);
+    fs.attachLog(&wal);
+    Checkpointer checkpointer(fs, wal, dir);
+    const size_t kFiles = 128, kFileSize = 1 << 20;
+    {
+        FileSystem::Builder builder(fs);
+        for (size_t i = 0; i < kFiles; i++) builder.addFile(builder.root(), "big" + to_string(i), string(kFileSize, 'x'));
+    }
+    fs.touch("f");
+
+    atomic<bool> done(false);
+    thread checkpoint([&]() {
+        EXPECT_EQ(1, checkpointer.checkpoint());
+        done = true;
+    });
+    // Write once the image is being written
+    string tmpPath = dir + "/checkpoint.tmp";
+    struct stat st;
+    while (stat(tmpPath.c_str(), &st) < 0 || st.st_size == 0) this_thread::yield();
+    fs.write("f", "during");
+    bool written = stat(tmpPath.c_str(), &st) == 0 && st.st_size < off_t(kFiles * kFileSize);
+    bool checkpointDone = done;
+    checkpoint.join();
+    EXPECT_TRUE(written);
+    EXPECT_FALSE(checkpointDone);
+
+    FileSystem image;
+    image.load(dir + "/checkpoint-00000000000000000001.img");
+    EXPECT_EQ("", image.cat("f"));
+    EXPECT_EQ(kFileSize, image.cat("big7").size());
+    FileSystem recovered;
+    EXPECT_EQ(2, Checkpointer::recover(recovered, dir));
+    EXPECT_EQ("during", recovered.cat("f"));
+    fs.attachLog(nullptr);
+    removeDir(dir);
+}
+
+// Tests periodic checkpoints run in the background while clients write
+TEST(Checkpoint, TestPeriodic) {
+    string dir = tempDir();
+    {
+        FileSystem fs;
+        WriteAheadLog wal(dir, Durability::None);
+        fs.attachLog(&wal);
+        Checkpointer checkpointer(fs, wal, dir);
+        checkpointer.start(chrono::seconds(1));
+        fs.touch("f");
+        for (int i = 0; i < 30; i++) {
+            fs.write("f", "x");
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+    }
+    vector<string> files = listDir(dir);
+    ASSERT_FALSE(files.empty());
+    EXPECT_EQ(0, files[0].find("checkpoint-"));
+    FileSystem fs;
+    EXPECT_EQ(31, Checkpointer::recover(fs, dir));
+    EXPECT_EQ(string(30, 'x'), fs.cat("f"));
+    removeDir(dir);
+}
+
+}  // namespace
@@ -0,0 +1,427 @@
+#include "fs_command.h"
+
+#include <fstream>
+
+#include "fs_image.h"
+#include "fs_protocol.h"
+#include "fs_slowlog.h"
+#include "fs_stats.h"
+
+using namespace std;
+
+namespace {
+
+/************************ handlers ********************************/
+
+// Handlers taking FS run on both trees, FileSystem and PersistentFileSystem
+
+// Host path a command of the session writes to (see FileSystem::Session::anyHostPath)
+string hostPath(FileSystem::Session& session, string_view path) {
+    if (session.isReadOnly()) throw invalid_argument("Read-only file system");
+    if (session.anyHostPath) return string(path);
+    if (session.hostDir.empty()) throw invalid_argument("Host files are not writable by clients: " + string(path));
+    if (!validName(path)) throw invalid_argument("Invalid path: " + string(path));
+    return session.hostDir + "/" + string(path);
+}
+
+// Persistent trees only run in the local prompt
+string hostPath(PersistentFileSystem::Session& session, string_view path) {
+    return string(path);
+}
+
+template <class FS>
+void runMkdir(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.mkdir(session, string(args[0]));
+}
+
+template <class FS>
+void runRm(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.rm(session, string(args[0]));
+}
+
+template <class FS>
+void runWrite(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.write(session, string(args[0]), string(args[1]));
+}
+
+template <class FS>
+void runMv(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.mv(session, string(args[0]), string(args[1]));
+}
+
+template <class FS>
+void runTouch(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.touch(session, string(args[0]));
+}
+
+// ls takes an optional param: args is empty without it
+template <class FS>
+void runLs(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    for (const string& file : fs.ls(session, args[0].empty() ? "." : string(args[0]))) {
+        out.add(file);
+    }
+}
+
+template <class FS>
+void runCd(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    fs.cd(session, string(args[0]));
+}
+
+template <class FS>
+void runPwd(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    out.add(fs.pwd(session));
+}
+
+template <class FS>
+void runFind(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    for (const string& file : fs.find(session, string(args[0]))) {
+        out.add(file);
+    }
+}
+
+template <class FS>
+void runCat(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    out.add(fs.cat(session, string(args[0])));
+}
+
+// cp source dest, or cp -r source dest
+template <class FS>
+void runCp(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    if (args[2].empty()) fs.cp(session, string(args[0]), string(args[1]), false);
+    else if (args[0] == "-r") fs.cp(session, string(args[1]), string(args[2]), true);
+    else throw invalid_argument(string(findCommand("cp")->synopsis));
+}
+
+// With a host path, start a snapshot to it; without, print the status of the running or last one
+void runSnapshot(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out) {
+    if (args[0].empty()) out.add(fs.snapshotStatus());
+    else fs.snapshot(hostPath(session, args[0]));
+}
+
+// snapshot on a persistent tree: retain the current version and print its number. Images are
+// FileSystem's.
+void runVersion(PersistentFileSystem& fs, PersistentFileSystem::Session& session, const string_view* args,
+                CommandOutput& out) {
+    if (!args[0].empty()) throw invalid_argument("Not supported on a persistent tree: snapshot [image_path]");
+    out.add("version " + to_string(fs.retain()));
+}
+
+uint64_t parseVersion(string_view arg) {
+    if (arg.empty() || arg.size() > 18 || arg.find_first_not_of("0123456789") != string_view::npos) {
+        throw invalid_argument(string(findCommand("diff")->synopsis));
+    }
+    return stoull(string(arg));
+}
+
+// diff from to: paths changed between two versions retained by snapshot
+void runDiff(PersistentFileSystem& fs, PersistentFileSystem::Session& session, const string_view* args,
+             CommandOutput& out) {
+    for (const string& line : fs.diff(parseVersion(args[0]), parseVersion(args[1]))) {
+        out.add(line);
+    }
+}
+
+void runDiffUnsupported(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out) {
+    throw invalid_argument("Only on a persistent tree (fs_service --persistent): diff");
+}
+
+// memory, du and quota need FileSystem's usage counters
+void runUnsupported(PersistentFileSystem& fs, PersistentFileSystem::Session& session, const string_view* args,
+                    CommandOutput& out) {
+    throw invalid_argument("Not supported on a persistent tree");
+}
+
+// Counters and latencies of the FS operations of the whole process, one line per op
+template <class FS>
+void runStats(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    for (const string& line : snapshotStats().format()) {
+        out.add(line);
+    }
+}
+
+// Bytes the subtree at path (or the working directory) takes, by what holds them
+void runMemory(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out) {
+    MemoryUsage usage = fs.memoryUsage(session, args[0].empty() ? "." : string(args[0]));
+    out.add("nodes=" + to_string(usage.nodes) + " names=" + to_string(usage.names) + " containers="
+            + to_string(usage.containers) + " contents=" + to_string(usage.contents) + " total=" + to_string(usage.total()));
+}
+
+// Files, directories and content bytes under path (or the working directory)
+void runDu(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out) {
+    DiskUsage usage = fs.du(session, args[0].empty() ? "." : string(args[0]));
+    out.add("files=" + to_string(usage.files) + " dirs=" + to_string(usage.dirs) + " bytes=" + to_string(usage.bytes));
+}
+
+// A quota limit: a decimal count, 0 for none
+int64_t parseLimit(string_view arg) {
+    if (arg.empty() || arg.size() > 18 || arg.find_first_not_of("0123456789") != string_view::npos) {
+        throw invalid_argument(string(findCommand("quota")->synopsis));
+    }
+    return stoll(string(arg));
+}
+
+// quota path: limits and usage of the directory; quota path max_bytes max_inodes: set them
+void runQuota(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out) {
+    string path(args[0]);
+    if (args[1].empty()) {
+        QuotaLimits limits = fs.quota(session, path);
+        DiskUsage usage = fs.du(session, path);
+        out.add("max_bytes=" + to_string(limits.maxBytes) + " bytes=" + to_string(usage.bytes) + " max_inodes="
+                + to_string(limits.maxInodes) + " inodes=" + to_string(usage.files + usage.dirs));
+    } else if (!args[2].empty()) {
+        QuotaLimits limits;
+        limits.maxBytes = parseLimit(args[1]);
+        limits.maxInodes = parseLimit(args[2]);
+        fs.setQuota(session, path, limits);
+    } else {
+        throw invalid_argument(string(findCommand("quota")->synopsis));
+    }
+}
+
+// spans on|off: start or stop recording spans; spans clear: forget the ones recorded; spans dump
+// path: write them to a host file as a Chrome trace; spans: whether they're on, and their count
+template <class FS>
+void runSpans(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    if (args[0].empty()) {
+        out.add(string(spansEnabled() ? "on" : "off") + " spans=" + to_string(spanCount()));
+    } else if (args[1].empty() && (args[0] == "on" || args[0] == "off")) {
+        enableSpans(args[0] == "on");
+    } else if (args[1].empty() && args[0] == "clear") {
+        clearSpans();
+    } else if (!args[1].empty() && args[0] == "dump") {
+        string path = hostPath(session, args[1]);
+        ofstream file(path);
+        size_t count = dumpSpans(file);
+        file.close();
+        if (!file) throw invalid_argument("Cannot write " + path);
+        out.add(to_string(count) + " spans written to " + path);
+    } else {
+        throw invalid_argument(string(findCommand("spans")->synopsis));
+    }
+}
+
+// slowlog: the threshold and the ops logged, oldest first; slowlog threshold us: log ops taking
+// at least us microseconds, none with 0; slowlog clear: forget the ops logged
+template <class FS>
+void runSlowlog(FS& fs, typename FS::Session& session, const string_view* args, CommandOutput& out) {
+    if (args[0].empty()) {
+        out.add("threshold_us=" + to_string(slowThreshold() / 1000) + " logged=" + to_string(slowOpCount()));
+        for (const SlowOp& op : slowOps()) {
+            out.add(op.format());
+        }
+    } else if (args[1].empty() && args[0] == "clear") {
+        clearSlowOps();
+    } else if (args[0] == "threshold" && !args[1].empty() && args[1].size() <= 12
+               && args[1].find_first_not_of("0123456789") == string_view::npos) {
+        setSlowThreshold(stoull(string(args[1])) * 1000);
+    } else {
+        throw invalid_argument(string(findCommand("slowlog")->synopsis));
+    }
+}
+
+/************************ command table ***************************/
+
+constexpr Command kCommands[] = {
+    {"mkdir", uint8_t(fsproto::Op::Mkdir), 1, 1, runMkdir<FileSystem>, runMkdir<PersistentFileSystem>,
+     "SYNOPSIS: mkdir [directory_name]"},
+    {"rm", uint8_t(fsproto::Op::Rm), 1, 1, runRm<FileSystem>, runRm<PersistentFileSystem>,
+     "SYNOPSIS: rm [file/dir_name]"},
+    {"write", uint8_t(fsproto::Op::Write), 2, 2, runWrite<FileSystem>, runWrite<PersistentFileSystem>,
+     "SYNOPSIS: write [file_name] [file_content]"},
+    {"mv", uint8_t(fsproto::Op::Mv), 2, 2, runMv<FileSystem>, runMv<PersistentFileSystem>,
+     "SYNOPSIS: mv [source_file_name] [dest_file_name]"},
+    {"cp", uint8_t(fsproto::Op::Cp), 2, 3, runCp<FileSystem>, runCp<PersistentFileSystem>,
+     "SYNOPSIS: cp [-r] [source_path] [dest_path]"},
+    {"touch", uint8_t(fsproto::Op::Touch), 1, 1, runTouch<FileSystem>, runTouch<PersistentFileSystem>,
+     "SYNOPSIS: touch [file_name]"},
+    {"ls", uint8_t(fsproto::Op::Ls), 0, 1, runLs<FileSystem>, runLs<PersistentFileSystem>,
+     "SYNOPSIS: \n"
+     "   ls: list current working directory contents \n"
+     "   ls [file/dir_name]: list for specified param "},
+    {"cd", uint8_t(fsproto::Op::Cd), 1, 1, runCd<FileSystem>, runCd<PersistentFileSystem>,
+     "SYNOPSIS: cd [directory_name]"},
+    {"pwd", uint8_t(fsproto::Op::Pwd), 0, 0, runPwd<FileSystem>, runPwd<PersistentFileSystem>,
+     "SYNOPSIS: pwd – return working directory name"},
+    {"find", uint8_t(fsproto::Op::Find), 1, 1, runFind<FileSystem>, runFind<PersistentFileSystem>,
+     "SYNOPSIS: find [file/dir_name]"},
+    {"cat", uint8_t(fsproto::Op::Cat), 1, 1, runCat<FileSystem>, runCat<PersistentFileSystem>,
+     "SYNOPSIS: cat [file_name]"},
+    {"snapshot", uint8_t(fsproto::Op::Snapshot), 0, 1, runSnapshot, runVersion,
+     "SYNOPSIS: \n"
+     "   snapshot [image_path]: write an image of the FS to a host file in the background \n"
+     "   snapshot: status of the running or last snapshot \n"
+     "   snapshot on a persistent tree: retain the current version, and print its number "},
+    {"stats", uint8_t(fsproto::Op::Stats), 0, 0, runStats<FileSystem>, runStats<PersistentFileSystem>,
+     "SYNOPSIS: stats – calls, errors by cause and latency percentiles of every FS operation"},
+    {"memory", uint8_t(fsproto::Op::Memory), 0, 1, runMemory, runUnsupported,
+     "SYNOPSIS: \n"
+     "   memory: bytes the working directory and its subtree take, by what holds them \n"
+     "   memory [file/dir_name]: for specified param "},
+    {"du", uint8_t(fsproto::Op::Du), 0, 1, runDu, runUnsupported,
+     "SYNOPSIS: \n"
+     "   du: files, directories and content bytes under the working directory \n"
+     "   du [file/dir_name]: for specified param "},
+    {"quota", uint8_t(fsproto::Op::Quota), 1, 3, runQuota, runUnsupported,
+     "SYNOPSIS: \n"
+     "   quota [dir_name]: byte and inode limits of the directory (0 for none), and its usage \n"
+     "   quota [dir_name] [max_bytes] [max_inodes]: set them, 0 0 to remove the quota "},
+    {"spans", uint8_t(fsproto::Op::Spans), 0, 2, runSpans<FileSystem>, runSpans<PersistentFileSystem>,
+     "SYNOPSIS: \n"
+     "   spans on|off: start or stop recording the phases of every request \n"
+     "   spans dump [trace_path]: write the spans recorded to a host file, for chrome://tracing or Perfetto \n"
+     "   spans clear: forget the spans recorded \n"
+     "   spans: whether spans are on, and how many are kept "},
+    {"slowlog", uint8_t(fsproto::Op::Slowlog), 0, 2, runSlowlog<FileSystem>, runSlowlog<PersistentFileSystem>,
+     "SYNOPSIS: \n"
+     "   slowlog: the threshold, and the last ops slower than it with their path, session and work \n"
+     "   slowlog threshold [microseconds]: log the ops taking at least that long, 0 for none \n"
+     "   slowlog clear: forget the ops logged "},
+    {"diff", uint8_t(fsproto::Op::Diff), 2, 2, runDiffUnsupported, runDiff,
+     "SYNOPSIS: diff [from_version] [to_version] – paths changed between two versions of a persistent tree"},
+};
+constexpr int kCommandCount = sizeof(kCommands) / sizeof(kCommands[0]);
+
+// Perfect hash of the names: a seeded FNV-1a hash, with the first seed for which no two
+// names fall in the same slot. Both the seed and the slots are computed at compile time.
+constexpr uint32_t kSlotCount = 64;
+static_assert(2 * kCommandCount <= kSlotCount, "Too many commands for the hash table");
+
+constexpr uint32_t nameHash(string_view name, uint32_t seed) {
+    uint32_t hash = seed;
+    for (char c : name) hash = (hash ^ uint8_t(c)) * 16777619u;
+    // Low bits of the product only depend on low bits of the seed: mix the high bits in
+    return hash ^ (hash >> 16);
+}
+
+constexpr uint32_t findSeed() {
+    for (uint32_t seed = 2166136261u; ; seed++) {
+        bool used[kSlotCount] = {};
+        bool collision = false;
+        for (const Command& command : kCommands) {
+            uint32_t slot = nameHash(command.name, seed) % kSlotCount;
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return seed;
+    }
+}
+constexpr uint32_t kSeed = findSeed();
+
+// Index in kCommands of the command of each hash slot (or of each opcode), or -1
+struct CommandIndex {
+    int8_t bySlot[kSlotCount];
+    int8_t byOp[256];
+};
+
+constexpr CommandIndex buildIndex() {
+    CommandIndex index = {};
+    for (int8_t& i : index.bySlot) i = -1;
+    for (int8_t& i : index.byOp) i = -1;
+    for (int i = 0; i < kCommandCount; i++) {
+        index.bySlot[nameHash(kCommands[i].name, kSeed) % kSlotCount] = i;
+        index.byOp[kCommands[i].op] = i;
+    }
+    return index;
+}
+constexpr CommandIndex kIndex = buildIndex();
+
+class StreamOutput : public CommandOutput {
+    ostream& out;
+  public:
+    explicit StreamOutput(ostream& out) : out(out) {}
+    void add(const string& line) override { out << line << '\n'; }
+};
+
+void runOn(const Command& command, FileSystem& fs, FileSystem::Session& session, const string_view* args,
+           CommandOutput& out) {
+    command.run(fs, session, args, out);
+}
+
+void runOn(const Command& command, PersistentFileSystem& fs, PersistentFileSystem::Session& session,
+           const string_view* args, CommandOutput& out) {
+    command.runPersistent(fs, session, args, out);
+}
+
+// Run the command named by tokens[0] with the params after it (count tokens in all, of which
+// the first kMaxTokens are stored) on the session, and print the result.
+// Errors from the FS and wrong usages are printed to out, so a bad command never ends the caller's loop.
+// Return false for those. Output isn't flushed: callers flush when they need to.
+template <class FS>
+bool runTokens(FS& fs, typename FS::Session& session, const string_view* tokens, int count, ostream& out,
+               Span& parse) {
+    const Command* command = findCommand(tokens[0]);
+    if (!command) {
+        out << "command not found: " << tokens[0] << '\n';
+        return false;
+    }
+    // Names in the table are string literals
+    RequestSpan::labelCurrent(command->name.data());
+    int argc = count - 1;
+    if (argc < command->minArgs || argc > command->maxArgs) {
+        out << command->synopsis << '\n';
+        return false;
+    }
+    parse.end();
+    StreamOutput output(out);
+    try {
+        runOn(*command, fs, session, tokens + 1, output);
+    } catch (const invalid_argument& e) {
+        out << e.what() << '\n';
+        return false;
+    }
+    return true;
+}
+
+// Parse the command line into its name and params, and run it
+template <class FS>
+bool runLine(FS& fs, typename FS::Session& session, string_view input, ostream& out) {
+    Span parse(SpanPhase::Parse);
+    // Optional params not given stay empty
+    string_view tokens[kMaxTokens];
+    int count = tokenize(input, tokens, kMaxTokens);
+    if (count == 0) return true;
+    return runTokens(fs, session, tokens, count, out, parse);
+}
+
+}  // namespace
+
+const Command* findCommand(string_view name) {
+    int i = kIndex.bySlot[nameHash(name, kSeed) % kSlotCount];
+    if (i < 0 || kCommands[i].name != name) return nullptr;
+    return &kCommands[i];
+}
+
+const Command* findCommand(uint8_t op) {
+    int i = kIndex.byOp[op];
+    return i < 0 ? nullptr : &kCommands[i];
+}
+
+int tokenize(string_view line, string_view* tokens, int max) {
+    int count = 0;
+    size_t start = 0;
+    while (start < line.size()) {
+        size_t end = line.find(' ', start);
+        if (end == string_view::npos) end = line.size();
+        if (count < max) tokens[count] = line.substr(start, end - start);
+        count++;
+        start = end + 1;
+    }
+    return count;
+}
+
+bool runCommand(FileSystem& fs, FileSystem::Session& session, string_view input, ostream& out) {
+    return runLine(fs, session, input, out);
+}
+
+bool runCommand(PersistentFileSystem& fs, PersistentFileSystem::Session& session, string_view input, ostream& out) {
+    return runLine(fs, session, input, out);
+}
+
+bool runCommand(FileSystem& fs, FileSystem::Session& session, string_view name, const vector<string>& args,
+                ostream& out) {
+    Span parse(SpanPhase::Parse);
+    string_view tokens[kMaxTokens];
+    tokens[0] = name;
+    for (size_t i = 0; i < args.size() && i + 1 < kMaxTokens; i++) tokens[i + 1] = args[i];
+    return runTokens(fs, session, tokens, args.size() + 1, out, parse);
+}
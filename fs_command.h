@@ -0,0 +1,62 @@
+#ifndef FS_COMMAND_H
+#define FS_COMMAND_H
+
+#include <cstdint>
+#include <string_view>
+
+#include "fs_impl.h"
+#include "fs_persistent.h"
+
+using namespace std;
+
+/* Commands of the FS, shared by the interactive prompt and all server front ends
+   Commands are found in a table by a compile time perfect hash of their name (or by their
+   binary protocol opcode), which gives the number of params they take and their handler.
+   Parsing a command line doesn't allocate: params are string_views into the line.
+   Tree commands also run on a PersistentFileSystem, where snapshot retains a numbered version
+   and diff compares two of them.
+*/
+
+// Where a command prints its result: lines of the prompt, or items of a binary response
+class CommandOutput {
+  public:
+    virtual ~CommandOutput() {}
+    virtual void add(const string& line) = 0;
+};
+
+struct Command {
+    string_view name;
+    // Opcode of the command in the binary protocol (fs_protocol.h)
+    uint8_t op;
+    // Number of params taken
+    uint8_t minArgs;
+    uint8_t maxArgs;
+    // Run the command with its params. FS errors are thrown as invalid_argument.
+    void (*run)(FileSystem& fs, FileSystem::Session& session, const string_view* args, CommandOutput& out);
+    // Same on a persistent tree
+    void (*runPersistent)(PersistentFileSystem& fs, PersistentFileSystem::Session& session, const string_view* args,
+                          CommandOutput& out);
+    // Printed on wrong usage
+    string_view synopsis;
+};
+
+// Max number of words of a command line: the name and its params
+const int kMaxTokens = 4;
+
+// Return the command with that name or opcode, or nullptr
+const Command* findCommand(string_view name);
+const Command* findCommand(uint8_t op);
+
+// Split the line on single spaces into tokens, like FileSystem::split(line, ' '). Store up to
+// max tokens and return the number of tokens in the line, which may be more than max.
+int tokenize(string_view line, string_view* tokens, int max);
+
+// Run one command line (e.g. "mkdir /a/b") on the session and print its output or error to out.
+// Return false if the command failed.
+bool runCommand(FileSystem& fs, FileSystem::Session& session, string_view input, ostream& out);
+bool runCommand(PersistentFileSystem& fs, PersistentFileSystem::Session& session, string_view input, ostream& out);
+// Same for a command given as its name and params, e.g. as decoded from a binary request:
+// params are taken whole, whatever bytes (spaces, newlines) they hold
+bool runCommand(FileSystem& fs, FileSystem::Session& session, string_view name, const vector<string>& args,
+                ostream& out);
+#endif
@@ -0,0 +1,119 @@
+#include "fs_command.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+
+/* Test the text command interpreter */
+namespace {
+
+// Tests output of commands, and that failing commands are reported to the caller
+TEST(Command, TestRunCommand) {
+    FileSystem fs;
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /a/b", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "cd a", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "pwd", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "", out));
+    EXPECT_EQ("/a/\n", out.str());
+
+    out.str("");
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "cd c", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "touch", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "format c:", out));
+    EXPECT_EQ("Directory not found: c\nSYNOPSIS: touch [file_name]\ncommand not found: format\n", out.str());
+
+    // Two spaces give an empty path
+    out.str("");
+    for (string line : {"cat  ", "mkdir  ", "write  x"}) {
+        EXPECT_FALSE(runCommand(fs, fs.defaultSession(), line, out)) << line;
+    }
+    EXPECT_EQ("Invalid path: \nInvalid path: \nInvalid path: \n", out.str());
+}
+
+// Tests setting and printing quotas, and their usage errors
+TEST(Command, TestQuota) {
+    FileSystem fs;
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /a/b", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "quota /a 100 5", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "quota /a", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "du", out));
+    EXPECT_EQ("max_bytes=100 bytes=0 max_inodes=5 inodes=1\nfiles=0 dirs=2 bytes=0\n", out.str());
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "quota /a 100", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "quota /a -1 5", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "quota /a/c 1 1", out));
+}
+
+// Tests splitting lines the same way as FileSystem::split
+TEST(Command, TestTokenize) {
+    FileSystem fs;
+    string_view tokens[kMaxTokens];
+    for (string line : {"", "pwd", "ls ", "write f  x", " cd a", "mv a b c d"}) {
+        vector<string> expected = fs.split(line, ' ');
+        int count = tokenize(line, tokens, kMaxTokens);
+        EXPECT_EQ(expected.size(), count) << line;
+        for (int i = 0; i < min(count, kMaxTokens); i++) EXPECT_EQ(expected[i], tokens[i]) << line;
+    }
+}
+
+// Tests where sessions write host files: anywhere locally, only by name in their directory for
+// remote clients, and nowhere when read-only
+TEST(Command, TestHostFiles) {
+    FileSystem fs;
+    string dir = "/tmp/fs_command_test." + to_string(getpid());
+    mkdir(dir.c_str(), 0755);
+    ostringstream out;
+
+    FileSystem::Session readOnly(fs, true);
+    EXPECT_FALSE(runCommand(fs, readOnly, "snapshot " + dir + "/image", out));
+    EXPECT_FALSE(runCommand(fs, readOnly, "spans dump " + dir + "/spans.json", out));
+    EXPECT_EQ("Read-only file system\nRead-only file system\n", out.str());
+
+    out.str("");
+    FileSystem::Session client(fs, false, 1);
+    client.anyHostPath = false;
+    EXPECT_FALSE(runCommand(fs, client, "spans dump " + dir + "/spans.json", out));
+    EXPECT_FALSE(runCommand(fs, client, "snapshot image", out));
+    EXPECT_EQ("Host files are not writable by clients: " + dir + "/spans.json\n"
+              "Host files are not writable by clients: image\n", out.str());
+
+    out.str("");
+    client.hostDir = dir;
+    for (string path : {dir + "/spans.json", string("../spans.json"), string(".."), string("a/b")}) {
+        EXPECT_FALSE(runCommand(fs, client, "spans dump " + path, out)) << path;
+    }
+    EXPECT_TRUE(runCommand(fs, client, "spans dump spans.json", out));
+    EXPECT_TRUE(runCommand(fs, client, "snapshot image", out));
+    for (int i = 0; i < 500 && fs.snapshotStatus().find(" running") != string::npos; i++) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    EXPECT_EQ(0, fs.snapshotStatus().find("Snapshot " + dir + "/image done"));
+    struct stat st;
+    EXPECT_EQ(0, stat((dir + "/spans.json").c_str(), &st));
+    EXPECT_EQ(0, stat((dir + "/image").c_str(), &st));
+
+    unlink((dir + "/spans.json").c_str());
+    unlink((dir + "/image").c_str());
+    rmdir(dir.c_str());
+}
+
+// Tests every command is found by its name and opcode, and nothing else is
+TEST(Command, TestFindCommand) {
+    for (string name : {"mkdir", "rm", "write", "mv", "cp", "touch", "ls", "cd", "pwd", "find", "cat", "snapshot", "stats", "memory", "du", "quota", "spans", "slowlog"}) {
+        const Command* command = findCommand(name);
+        ASSERT_NE(nullptr, command) << name;
+        EXPECT_EQ(name, command->name);
+        EXPECT_EQ(command, findCommand(command->op));
+    }
+    EXPECT_EQ(nullptr, findCommand(string_view("")));
+    EXPECT_EQ(nullptr, findCommand(string_view("mkdirs")));
+    EXPECT_EQ(nullptr, findCommand(string_view("CAT")));
+    EXPECT_EQ(nullptr, findCommand(uint8_t(0)));
+}
+
+}  // namespace
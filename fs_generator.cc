@@ -0,0 +1,164 @@
+#include "fs_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "fs_util.h"
+
+using namespace std;
+
+namespace {
+
+// Names found all over real trees, most common first
+const vector<string> kCommonDirs = {
+    "src", "lib", "test", "docs", "include", "build", "config", "data", "assets", "utils",
+    "images", "bin", "logs", "tmp", "scripts", "cache", "vendor", "api", "models", "common",
+    "internal", "tests", "examples", "static", "templates", "fixtures", "dist", "tools", "core",
+};
+const vector<string> kCommonFiles = {
+    "README.md", "index.html", "Makefile", "main.cc", "LICENSE", "package.json", "index.js",
+    "styles.css", "setup.py", "CHANGELOG", "Dockerfile", ".gitignore", "__init__.py",
+    "config.json", "index.ts", "CMakeLists.txt", "go.mod", "requirements.txt",
+};
+const char* const kExtensions[] = {".txt", ".json", ".log", ".cc", ".h", ".md", ".png", ".csv"};
+
+// Samples ranks 1..n with P(k) proportional to 1/k^skew
+class Zipf {
+    vector<double> cdf;
+    double average = 0;
+  public:
+    Zipf(uint64_t n, double skew) {
+        double sum = 0;
+        for (uint64_t k = 1; k <= n; k++) {
+            sum += 1 / pow(double(k), skew);
+            cdf.push_back(sum);
+        }
+        for (uint64_t k = 1; k <= n; k++) average += k / pow(double(k), skew) / sum;
+        for (double& p : cdf) p /= sum;
+    }
+    double mean() const { return average; }
+    uint64_t operator()(mt19937_64& random) {
+        double u = uniform_real_distribution<double>(0, 1)(random);
+        return min<uint64_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1) + 1;
+    }
+};
+
+// Base 36 digits of i
+string base36(uint64_t i) {
+    string digits;
+    do {
+        digits += "0123456789abcdefghijklmnopqrstuvwxyz"[i % 36];
+        i /= 36;
+    } while (i > 0);
+    return digits;
+}
+
+// Share of directories among the children of the dirs directories of a level, levels levels
+// above the last one, for the levels left to hold nodes nodes: the least b with
+// mean * dirs * (1 + b + ... + b^levels) >= 2 * nodes, over mean. The margin covers the
+// variance of the fanout; breadth first, the last level is just left sparse. Computed
+// again at every level, so the variance of one level doesn't add up over the next ones.
+double levelDirShare(double mean, uint64_t dirs, int levels, uint64_t nodes) {
+    double wanted = 2.0 * nodes;
+    auto levelsHold = [&](double b) {
+        double total = 0;
+        double level = mean * dirs;
+        for (int i = 0; i <= levels && total < wanted; i++, level *= b) total += level;
+        return total >= wanted;
+    };
+    double low = 0;
+    double high = mean;
+    for (int i = 0; i < 60; i++) {
+        double middle = (low + high) / 2;
+        if (levelsHold(middle)) high = middle;
+        else low = middle;
+    }
+    return high / mean;
+}
+
+}  // namespace
+
+uint64_t generateTree(FileSystem& fs, const TreeShape& shape, const function<void(const string&, bool)>& visit) {
+    mt19937_64 random(shape.seed);
+    uniform_real_distribution<double> uniform(0, 1);
+    Zipf fanout(max<uint32_t>(1, shape.maxFanout), shape.fanoutSkew);
+    Zipf commonDir(kCommonDirs.size(), 1.0);
+    Zipf commonFile(kCommonFiles.size(), 1.0);
+    lognormal_distribution<double> fileSize(log(double(max<uint64_t>(1, shape.medianFileSize))), shape.fileSizeSigma);
+    // File contents come from a pool of slices of one buffer of random text, shared the way
+    // cp shares them, so the memory of a big tree goes to its nodes rather than to copies
+    string text(shape.maxFileSize, '\0');
+    for (char& c : text) c = 'a' + random() % 26;
+    const int kContents = 4096;
+    vector<pair<shared_ptr<string>, uint64_t>> contents;
+    for (int i = 0; i < kContents; i++) {
+        uint64_t size = min<uint64_t>(shape.maxFileSize, uint64_t(fileSize(random)));
+        shared_ptr<string> content;
+        if (size > 0) content = make_shared<string>(text.substr(random() % (text.size() - size + 1), size));
+        contents.push_back({content, content ? contentHash(content->data(), content->size()) : 0});
+    }
+
+    FileSystem::Builder builder(fs);
+    // Directories to fill, breadth first, with their depth and path
+    struct Pending {
+        FileSystem::Builder::Dir dir;
+        int depth;
+        string path;
+    };
+    queue<Pending> q;
+    q.push({builder.root(), 0, "/"});
+    uint64_t created = 0;
+    uint64_t uniqueNames = 0;
+    int depth = -1;
+    double dirShare = 0;
+    while (!q.empty() && created < shape.nodeCount) {
+        if (q.front().depth != depth) {
+            // A new level starts, with the whole level in the queue
+            depth = q.front().depth;
+            dirShare = levelDirShare(fanout.mean(), q.size(), shape.maxDepth - depth, shape.nodeCount - created);
+            dirShare = min(1.0, max(1 - shape.fileRatio, dirShare));
+        }
+        Pending parent = move(q.front());
+        q.pop();
+        uint64_t count = min(fanout(random), shape.nodeCount - created);
+        bool canNest = parent.depth < shape.maxDepth;
+        bool nested = false;
+        // Common names taken in this directory already
+        vector<bool> usedDirs(kCommonDirs.size());
+        vector<bool> usedFiles(kCommonFiles.size());
+        for (uint64_t i = 0; i < count; i++) {
+            // The last directory left to fill gets a subdirectory, so the tree keeps growing
+            bool last = i + 1 == count && q.empty() && !nested && created + 1 < shape.nodeCount;
+            bool isDir = canNest && (uniform(random) < dirShare || last);
+            string name;
+            if (uniform(random) < shape.nameReuse) {
+                const vector<string>& names = isDir ? kCommonDirs : kCommonFiles;
+                vector<bool>& used = isDir ? usedDirs : usedFiles;
+                uint64_t rank = (isDir ? commonDir : commonFile)(random) - 1;
+                if (!used[rank]) name = names[rank];
+                used[rank] = true;
+            }
+            if (name.empty()) {
+                // Common names have no '-'
+                name = (isDir ? "d-" : "f-") + base36(uniqueNames++);
+                if (!isDir) name += kExtensions[random() % (sizeof(kExtensions) / sizeof(kExtensions[0]))];
+            }
+            if (isDir) {
+                FileSystem::Builder::Dir dir = builder.addDir(parent.dir, name);
+                q.push({dir, parent.depth + 1, parent.path + name + "/"});
+                nested = true;
+            } else {
+                const pair<shared_ptr<string>, uint64_t>& content = contents[random() % kContents];
+                builder.addFile(parent.dir, name, content.first, content.second);
+            }
+            if (visit) visit(parent.path + name + (isDir ? "/" : ""), isDir);
+            created++;
+        }
+    }
+    builder.finish();
+    return created;
+}
@@ -0,0 +1,47 @@
+#ifndef FS_GENERATOR_H
+#define FS_GENERATOR_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "fs_impl.h"
+
+using namespace std;
+
+/* Synthetic trees shaped like production ones, for benchmarks and stress tests
+   A tree is grown breadth first from a seed: the number of children of every directory
+   follows a Zipf distribution (most directories are small, a few are huge), file sizes a
+   log-normal one, and part of the names come from a pool of common names (src, README.md,
+   ...), the way the same names recur all over real trees. The same shape and seed always
+   give the same tree. Nodes are added with FileSystem::Builder and files share contents
+   from a pool, so generating 10^7 nodes takes seconds; the limit is the memory of the
+   nodes themselves.
+*/
+struct TreeShape {
+    // Nodes to create besides root
+    uint64_t nodeCount = 100000;
+    // Levels of directories below root. Directories of the last level only hold files.
+    int maxDepth = 8;
+    // Children of a directory: Zipf distributed between 1 and maxFanout, with this exponent
+    uint32_t maxFanout = 1000;
+    double fanoutSkew = 1.2;
+    // Share of files among the children of a directory. Lowered when the tree needs more
+    // directories to reach nodeCount within maxDepth levels.
+    double fileRatio = 0.85;
+    // File sizes: log-normal around the median, with the sigma of the log, capped at maxFileSize
+    uint64_t medianFileSize = 1024;
+    double fileSizeSigma = 1.5;
+    uint64_t maxFileSize = 1 << 20;
+    // Share of names taken from the pool of common names
+    double nameReuse = 0.3;
+    uint64_t seed = 1;
+};
+
+// Add a tree of that shape to fs, which nobody else uses meanwhile, and call visit (if any)
+// with the absolute path of every node created (with a '/' after directories).
+// Return the number of nodes created, which is less than nodeCount only if the last level
+// of directories fills up first. The nodes aren't logged.
+uint64_t generateTree(FileSystem& fs, const TreeShape& shape,
+                      const function<void(const string& path, bool isDir)>& visit = nullptr);
+#endif
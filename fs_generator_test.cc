@@ -0,0 +1,89 @@
+#include "fs_generator.h"
+
+#include "gtest/gtest.h"
+
+/* Test generating synthetic trees, and the bulk build path under it */
+namespace {
+
+// Tests the same shape and seed give the same tree, and another seed another tree
+TEST(Generator, TestDeterministic) {
+    TreeShape shape;
+    shape.nodeCount = 5000;
+    FileSystem one;
+    FileSystem two;
+    EXPECT_EQ(5000, generateTree(one, shape));
+    EXPECT_EQ(5000, generateTree(two, shape));
+    EXPECT_TRUE(FileSystem::diff(one, two).empty());
+
+    shape.seed = 2;
+    FileSystem other;
+    generateTree(other, shape);
+    EXPECT_FALSE(FileSystem::diff(one, other).empty());
+}
+
+// Tests the tree has the shape asked for, and works like any other tree
+TEST(Generator, TestShape) {
+    TreeShape shape;
+    shape.nodeCount = 20000;
+    shape.maxDepth = 4;
+    shape.maxFanout = 200;
+    shape.maxFileSize = 4096;
+    FileSystem fs;
+    vector<string> dirs;
+    vector<string> files;
+    EXPECT_EQ(20000, generateTree(fs, shape, [&](const string& path, bool isDir) {
+        (isDir ? dirs : files).push_back(path);
+    }));
+    EXPECT_EQ(20000, dirs.size() + files.size());
+    EXPECT_GT(files.size(), dirs.size());
+    for (const string& dir : dirs) {
+        EXPECT_LE(count(dir.begin(), dir.end(), '/'), shape.maxDepth + 1);
+        EXPECT_LE(fs.ls(dir).size(), shape.maxFanout + 1);
+    }
+    size_t reused = 0;
+    for (const string& file : files) {
+        EXPECT_LE(fs.cat(file).size(), shape.maxFileSize);
+        if (file.find('-') == string::npos) reused++;
+    }
+    EXPECT_GT(reused, 0);
+
+    fs.mkdir(dirs.back() + "new");
+    fs.write(files.back(), "appended");
+    EXPECT_EQ("appended", fs.cat(files.back()).substr(fs.cat(files.back()).size() - 8));
+
+    // Levels too few and small to hold nodeCount nodes fill up first
+    FileSystem small;
+    shape.maxDepth = 1;
+    shape.maxFanout = 10;
+    EXPECT_GT(20000, generateTree(small, shape));
+}
+
+// Tests a tree built in bulk hashes the same as one built by ops
+TEST(Generator, TestBuilder) {
+    FileSystem bulk;
+    {
+        FileSystem::Builder builder(bulk);
+        FileSystem::Builder::Dir a = builder.addDir(builder.root(), "a");
+        builder.addDir(a, "b");
+        builder.addFile(a, "f", "content");
+        builder.addFile(builder.root(), "empty", "");
+        EXPECT_THROW(builder.addFile(a, "b", ""), invalid_argument);
+        EXPECT_THROW(builder.addDir(a, "x/y"), invalid_argument);
+    }
+    FileSystem ops;
+    ops.mkdir("/a/b");
+    ops.touch("empty");
+    ops.cd("a");
+    ops.touch("f");
+    ops.write("f", "content");
+    EXPECT_TRUE(FileSystem::diff(bulk, ops).empty());
+    EXPECT_EQ(ops.memoryUsage("/").nodes, bulk.memoryUsage("/").nodes);
+    EXPECT_EQ(ops.memoryUsage("/").containers, bulk.memoryUsage("/").containers);
+    EXPECT_EQ(bulk.memoryUsage("/a").nodes, 3 * bulk.memoryUsage("/a/b").nodes);
+    EXPECT_EQ(ops.du("/").files, bulk.du("/").files);
+    EXPECT_EQ(ops.du("/").dirs, bulk.du("/").dirs);
+    EXPECT_EQ(7, bulk.du("/").bytes);
+    EXPECT_EQ("content", bulk.cat("/a/f"));
+    EXPECT_EQ((vector<string>{"a", "empty"}), bulk.ls("/"));
+}
+}  // namespace
@@ -0,0 +1,172 @@
+#include "fs_image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <stdexcept>
+
+#include "fs_util.h"
+
+using namespace std;
+
+const char TreeImage::kMagic[8] = {'F', 'S', 'I', 'M', 'G', '4', '\n', '\0'};
+
+namespace {
+
+// Buffered bytes are written out past this size
+const size_t kWriteChunk = 1 << 20;
+
+runtime_error corrupt(const string& what) { return runtime_error("Corrupt image: " + what); }
+
+}  // namespace
+
+shared_ptr<TreeImage> TreeImage::open(const string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error("Cannot open image " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int error = errno;
+        close(fd);
+        throw runtime_error("Cannot stat image " + path + ": " + strerror(error));
+    }
+    if (size_t(st.st_size) < kHeaderSize + sizeof(ImageNode)) {
+        close(fd);
+        throw corrupt(path + " is too small");
+    }
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) throw runtime_error("Cannot map image " + path + ": " + strerror(errno));
+
+    shared_ptr<TreeImage> image(new TreeImage());
+    image->base = (const char*) mapped;
+    image->mappedSize = st.st_size;
+    const char* header = image->base;
+    if (memcmp(header, kMagic, sizeof(kMagic)) != 0) throw corrupt(path + " has no image magic");
+    image->lsn = getU64(header + 8);
+    image->nodeCount = getU64(header + 16);
+    uint64_t dataOffset = getU64(header + 24);
+    image->dataSize = getU64(header + 32);
+    uint64_t tableSize = (st.st_size - kHeaderSize) / sizeof(ImageNode);
+    if (image->nodeCount == 0 || image->nodeCount > tableSize
+            || dataOffset != kHeaderSize + image->nodeCount * sizeof(ImageNode)
+            || image->dataSize != st.st_size - dataOffset) {
+        throw corrupt(path + " has a bad header");
+    }
+    image->nodes = (const ImageNode*) (image->base + kHeaderSize);
+    image->data = image->base + dataOffset;
+    if (!image->root()->isDir) throw corrupt(path + " has no root directory");
+    image->verify();
+    return image;
+}
+
+// Check every node in one pass over the table: the children of the directories tile the table
+// in breadth first order, so every node but root has exactly one parent, and siblings have
+// valid names, sorted and distinct.
+void TreeImage::verify() const {
+    uint64_t nextChild = 1;
+    for (uint64_t i = 0; i < nodeCount; i++) {
+        const ImageNode* node = nodes + i;
+        if (!node->isDir) {
+            content(node);
+            continue;
+        }
+        if (node->first != nextChild) throw corrupt("children out of order");
+        const ImageNode* first = children(node);
+        string_view previous;
+        for (uint64_t j = 0; j < node->size; j++) {
+            string_view childName = name(first + j);
+            if (!validName(childName) || (j > 0 && childName <= previous)) throw corrupt("bad name");
+            previous = childName;
+        }
+        nextChild += node->size;
+    }
+    if (nextChild != nodeCount) throw corrupt("nodes out of the tree");
+}
+
+bool validName(string_view name) {
+    return !name.empty() && name.find('/') == string_view::npos && name != "..";
+}
+
+TreeImage::~TreeImage() {
+    munmap((void*) base, mappedSize);
+}
+
+const ImageNode* TreeImage::children(const ImageNode* dir) const {
+    // Children always come after their parent in breadth first order, which rules out cycles
+    if (dir->first <= uint64_t(dir - nodes) || dir->first > nodeCount || dir->size > nodeCount - dir->first) {
+        throw corrupt("children out of range");
+    }
+    return nodes + dir->first;
+}
+
+string_view TreeImage::name(const ImageNode* node) const {
+    if (node->name > dataSize || node->nameSize > dataSize - node->name) throw corrupt("name out of range");
+    return string_view(data + node->name, node->nameSize);
+}
+
+string_view TreeImage::content(const ImageNode* file) const {
+    if (file->first > dataSize || file->size > dataSize - file->first) throw corrupt("content out of range");
+    return string_view(data + file->first, file->size);
+}
+
+ImageWriter::ImageWriter(int fd, uint64_t nodeCount)
+        : fd(fd), nodeCount(nodeCount), dataOffset(TreeImage::kHeaderSize + nodeCount * sizeof(ImageNode)) {
+}
+
+uint64_t ImageWriter::addName(string_view name) {
+    uint64_t offset = dataWritten + dataBuf.size();
+    dataBuf.append(name.data(), name.size());
+    return offset;
+}
+
+void ImageWriter::addDir(string_view name, uint64_t childCount, uint64_t hash, uint64_t files, uint64_t dirs,
+                         uint64_t bytes) {
+    ImageNode node = {addName(name), uint32_t(name.size()), 1, nextChild, childCount, hash, files, dirs, bytes};
+    nextChild += childCount;
+    nodeBuf.append((const char*) &node, sizeof(node));
+    added++;
+    if (nodeBuf.size() >= kWriteChunk) flush(nodeBuf, TreeImage::kHeaderSize, nodesWritten);
+    if (dataBuf.size() >= kWriteChunk) flush(dataBuf, dataOffset, dataWritten);
+}
+
+void ImageWriter::addFile(string_view name, string_view content, uint64_t hash) {
+    uint64_t nameOffset = addName(name);
+    ImageNode node = {nameOffset, uint32_t(name.size()), 0, nameOffset + name.size(), content.size(), hash,
+                      1, 0, content.size()};
+    dataBuf.append(content.data(), content.size());
+    nodeBuf.append((const char*) &node, sizeof(node));
+    added++;
+    if (nodeBuf.size() >= kWriteChunk) flush(nodeBuf, TreeImage::kHeaderSize, nodesWritten);
+    if (dataBuf.size() >= kWriteChunk) flush(dataBuf, dataOffset, dataWritten);
+}
+
+// Write buf at offset + written in the file, and move it into written
+void ImageWriter::flush(string& buf, uint64_t offset, uint64_t& written) {
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = pwrite(fd, buf.data() + done, buf.size() - done, offset + written + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw runtime_error(string("Cannot write image: ") + strerror(errno));
+        done += n;
+    }
+    written += buf.size();
+    buf.clear();
+}
+
+void ImageWriter::finish(uint64_t lsn) {
+    if (added != nodeCount || nextChild != nodeCount) throw runtime_error("Image nodes don't match the node count");
+    flush(nodeBuf, TreeImage::kHeaderSize, nodesWritten);
+    flush(dataBuf, dataOffset, dataWritten);
+    string header(TreeImage::kMagic, sizeof(TreeImage::kMagic));
+    putU64(header, lsn);
+    putU64(header, nodeCount);
+    putU64(header, dataOffset);
+    putU64(header, dataWritten);
+    header.resize(TreeImage::kHeaderSize, '\0');
+    uint64_t written = 0;
+    flush(header, 0, written);
+}
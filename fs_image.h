@@ -0,0 +1,104 @@
+#ifndef FS_IMAGE_H
+#define FS_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace std;
+
+/* Position independent image of a tree, read in place through mmap
+   Opening an image maps it and checks its header and its node table (the shape of the tree,
+   the names and the ranges), not the contents: nodes are read where they lie in the file, so
+   a FileSystem can serve a tree of any size right after startup and only copies the
+   directories it visits (and the files it writes) to the heap. A corrupt image fails to
+   open, rather than an op visiting its bad part later.
+
+   Layout (little endian, as the host):
+   - 64 byte header: the 8 byte magic "FSIMG4\n\0", u64 lsn, u64 node count, u64 offset and
+     u64 size of the data area.
+   - Node table right after the header: ImageNode records in breadth first order, root
+     first. The children of a directory are contiguous and sorted by name.
+   - Data area: names and file contents, referenced by offsets into it.
+   Nothing holds a pointer, so the image works wherever it's mapped.
+*/
+
+// A node of the table. For a directory, first/size are the index range of its children in
+// the table; for a file, the offset and size of its content in the data area. The hash is
+// the node's Merkle hash in the tree that was saved (see FileSystem::File::hash), and
+// files/dirs/bytes count the files, directories and content bytes of its subtree, the node
+// included, so directories not visited yet can be sized without reading their subtree.
+struct ImageNode {
+    uint64_t name;
+    uint32_t nameSize;
+    uint32_t isDir;
+    uint64_t first;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t files;
+    uint64_t dirs;
+    uint64_t bytes;
+};
+static_assert(sizeof(ImageNode) == 64, "ImageNode is an on-disk record");
+
+// Whether name can name a node in a directory: not empty, without '/', and not "..". The FS
+// only creates nodes with such names, and images only hold such names.
+bool validName(string_view name);
+
+class TreeImage {
+    const char* base;
+    size_t mappedSize;
+    uint64_t lsn;
+    uint64_t nodeCount;
+    const ImageNode* nodes;
+    const char* data;
+    uint64_t dataSize;
+
+    TreeImage() = default;
+    void verify() const;
+  public:
+    static const char kMagic[8];
+    static const size_t kHeaderSize = 64;
+
+    // Map the image at path, and check its node table. Throw runtime_error if it isn't a valid image.
+    static shared_ptr<TreeImage> open(const string& path);
+    ~TreeImage();
+    TreeImage(const TreeImage&) = delete;
+    TreeImage& operator=(const TreeImage&) = delete;
+
+    uint64_t getLsn() const { return lsn; }
+    const ImageNode* root() const { return nodes; }
+    // Checked accessors: throw runtime_error if the node points outside the image
+    const ImageNode* children(const ImageNode* dir) const;
+    string_view name(const ImageNode* node) const;
+    string_view content(const ImageNode* file) const;
+};
+
+// Writes an image to a file, nodes in breadth first order. The node count must be known up
+// front, so the data area can start right after the node table.
+class ImageWriter {
+    int fd;
+    uint64_t nodeCount;
+    uint64_t dataOffset;
+    // Nodes added so far, and index of the first child of the next directory added
+    uint64_t added = 0;
+    uint64_t nextChild = 1;
+    // Buffered bytes of the node table and the data area
+    string nodeBuf;
+    string dataBuf;
+    uint64_t nodesWritten = 0;
+    uint64_t dataWritten = 0;
+
+    uint64_t addName(string_view name);
+    void flush(string& buf, uint64_t offset, uint64_t& written);
+  public:
+    ImageWriter(int fd, uint64_t nodeCount);
+    // Add the next node. The root comes first, with an empty name. A directory comes with the
+    // totals of its subtree (see ImageNode).
+    void addDir(string_view name, uint64_t childCount, uint64_t hash, uint64_t files, uint64_t dirs, uint64_t bytes);
+    void addFile(string_view name, string_view content, uint64_t hash);
+    // Write the header once all nodes are added. Throw runtime_error on a write error.
+    void finish(uint64_t lsn);
+};
+#endif
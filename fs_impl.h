@@ -1,54 +1,387 @@
 #ifndef FS_IMPL_H
 #define FS_IMPL_H
 
+#include <atomic>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <queue>
+#include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <vector>
 
+#include "fs_image.h"
+#include "fs_snapshot.h"
+#include "fs_wal.h"
+
 using namespace std;
 
+// Bytes of memory a subtree of the FS takes on the heap, by what holds them. Allocator
+// overhead isn't counted, nor nodes and contents still in a mapped image or a lower tree.
+struct MemoryUsage {
+    // Node structs
+    int64_t nodes = 0;
+    // Absolute paths of the nodes, beyond the string structs in the nodes
+    int64_t names = 0;
+    // Entries of the children maps, with the keys
+    int64_t containers = 0;
+    // File contents, with the block holding each one. A content shared by copies of a file
+    // (cp, overlays) counts in each copy, as each takes its own once written.
+    int64_t contents = 0;
+
+    int64_t total() const { return nodes + names + containers + contents; }
+    MemoryUsage& operator+=(const MemoryUsage& other) {
+        nodes += other.nodes;
+        names += other.names;
+        containers += other.containers;
+        contents += other.contents;
+        return *this;
+    }
+    MemoryUsage operator-(const MemoryUsage& other) const {
+        MemoryUsage difference = *this;
+        difference.nodes -= other.nodes;
+        difference.names -= other.names;
+        difference.containers -= other.containers;
+        difference.contents -= other.contents;
+        return difference;
+    }
+};
+
+// Files, directories and content bytes of a subtree
+struct DiskUsage {
+    int64_t files = 0;
+    int64_t dirs = 0;
+    int64_t bytes = 0;
+
+    DiskUsage& operator+=(const DiskUsage& other) {
+        files += other.files;
+        dirs += other.dirs;
+        bytes += other.bytes;
+        return *this;
+    }
+    DiskUsage operator-(const DiskUsage& other) const {
+        DiskUsage difference = *this;
+        difference.files -= other.files;
+        difference.dirs -= other.dirs;
+        difference.bytes -= other.bytes;
+        return difference;
+    }
+};
+
+// Limits of a directory's subtree, counted like du: content bytes, and files and directories
+// under it. 0 means no limit.
+struct QuotaLimits {
+    int64_t maxBytes = 0;
+    int64_t maxInodes = 0;
+};
+
 /* Implementation of an in memory linux style file system
+   One FileSystem holds the tree, which is shared by any number of sessions. Per-user state
+   (the working directory) lives in a Session, so concurrent users don't fight over cd.
+   A FileSystem can also be an overlay: a writable layer over a lower FileSystem, which it
+   starts out identical to and shares everything with until it changes.
 */
 class FileSystem {
+    // MemoryUsage of a subtree, which loadChildren adds to under the shared tree lock
+    struct SubtreeUsage {
+        atomic<int64_t> nodes{0};
+        atomic<int64_t> names{0};
+        atomic<int64_t> containers{0};
+        atomic<int64_t> contents{0};
+
+        MemoryUsage load() const {
+            MemoryUsage usage;
+            usage.nodes = nodes.load(memory_order_relaxed);
+            usage.names = names.load(memory_order_relaxed);
+            usage.containers = containers.load(memory_order_relaxed);
+            usage.contents = contents.load(memory_order_relaxed);
+            return usage;
+        }
+        void add(const MemoryUsage& delta) {
+            nodes.fetch_add(delta.nodes, memory_order_relaxed);
+            names.fetch_add(delta.names, memory_order_relaxed);
+            containers.fetch_add(delta.containers, memory_order_relaxed);
+            contents.fetch_add(delta.contents, memory_order_relaxed);
+        }
+        void store(const MemoryUsage& usage) { add(usage - load()); }
+    };
+
+    struct Quota;
+
     struct File {
         map<string, File*> children;
         File* parent;
         bool isDir;
+        // Sessions whose working directory this is: removing a subtree looks for sessions to
+        // move up only where there are some
+        atomic<uint32_t> sessionsHere{0};
         // The absolute path from root
         string name;
-        // If the node is a file, this field holds the file content.
-        string content;
+        // If the node is a file, this field holds the file content (null if empty). Copies
+        // of a file share it until one of them is written.
+        shared_ptr<string> content;
+        // Node of the mapped image this one was loaded from, while part of it still lives
+        // there: the children of a directory not visited yet, or the content of a file not
+        // written yet. Null once copied to the heap.
+        atomic<const ImageNode*> backing{nullptr};
+        // Directory of the lower FileSystem this one overlays, while its children weren't
+        // visited yet. Null once copied up.
+        atomic<File*> lower{nullptr};
+        // Merkle hash: contentHash() of a file's content, or for a directory the sum of
+        // entryHash() of its children. Kept up to date by every write, so equal hashes mean
+        // equal subtrees.
+        uint64_t hash = 0;
+        // Memory of the node and its subtree, kept up to date along the parent chain like hash
+        SubtreeUsage usage;
+        // Files, directories and content bytes of the subtree, the node included. Set when the
+        // node is created (from the image or lower node for loaded ones), then kept up to date
+        // by write functions along the parent chain.
+        DiskUsage diskUsage;
+        // For a directory, the quota of the closest of itself and its ancestors having one, if
+        // any: write functions only check those, not every ancestor. Null for files.
+        Quota* quota = nullptr;
+    };
+
+    // Quota set on a directory, owned by it
+    struct Quota {
+        File* dir;
+        // Quota of the closest ancestor of dir having one, if any
+        Quota* up;
+        QuotaLimits limits;
     };
 
+    // A node as readers see it: a node of this tree, or one they read in place, of the lower
+    // tree of an overlay or only in the mapped image
+    struct NodeRef {
+        File* file;
+        const ImageNode* imageNode;
+        // file is a node of this tree, with its own name and memory usage
+        bool own;
+        bool isDir() const { return file ? file->isDir : imageNode->isDir; }
+        uint64_t hash() const { return file ? file->hash : imageNode->hash; }
+        DiskUsage diskUsage() const {
+            if (file) return file->diskUsage;
+            DiskUsage usage;
+            usage.files = imageNode->files;
+            usage.dirs = imageNode->dirs;
+            usage.bytes = imageNode->bytes;
+            return usage;
+        }
+    };
+
+  public:
+    // State of one user of the FS. A session must not outlive its FileSystem.
+    class Session {
+        friend class FileSystem;
+        FileSystem& fs;
+        // Always points into the tree: rm moves it up to the closest ancestor that survives.
+        atomic<File*> currDir;
+        // Write functions fail on the session, e.g. for clients of a replica
+        const bool readOnly;
+      public:
+        // Id of the session in stats and the slow log, e.g. of the server connection, 0 if none
+        const uint64_t id;
+        // Host files its commands may write (snapshot images, span dumps): any path for a local
+        // user. Front ends serving remote clients clear anyHostPath, and then only names in
+        // hostDir are written, none without one. Read-only sessions write none.
+        bool anyHostPath = true;
+        string hostDir;
+        explicit Session(FileSystem& fs, bool readOnly = false, uint64_t id = 0);
+        bool isReadOnly() const { return readOnly; }
+        ~Session();
+        Session(const Session&) = delete;
+        Session& operator=(const Session&) = delete;
+    };
+
+  private:
     File* root;
-    File* currDir;
+    // Read functions hold the tree lock shared, write functions hold it exclusively.
+    mutable shared_mutex treeLock;
+    // Guards the set of live sessions, so rm can relocate the ones inside a removed subtree.
+    mutex sessionsLock;
+    set<Session*> sessions;
+    // Session of the single user functions (the ones without a Session param).
+    unique_ptr<Session> ownSession;
+    // Log of the mutations, if any
+    WriteAheadLog* wal = nullptr;
+    // Image the tree (or the lower tree) was loaded from, if any
+    shared_ptr<TreeImage> image;
+    // The image is the lower tree's: readers don't load its directories either
+    bool sharedImage = false;
+    // Lock of copying children from the image or the lower tree, which readers do under the
+    // shared tree lock. Held across the forks writing images, so they see no half done copy.
+    mutex loadLock;
+    BackgroundSnapshot background;
+
+    // Declared by write functions before taking the tree lock: once the lock is released,
+    // waits for the logged mutation to be durable.
+    struct LogCommit {
+        WriteAheadLog* wal;
+        uint64_t lsn = 0;
+        ~LogCommit() { if (lsn) wal->commit(lsn); }
+    };
+    // Log a mutation while holding the tree lock. Return its lsn, 0 without a log.
+    uint64_t log(WalOp op, Session& session, const string& arg1, const string& arg2 = "");
+
+    // Take the tree lock shared (readers) or exclusively (writers), as a lock span
+    shared_lock<shared_mutex> readLock();
+    unique_lock<shared_mutex> writeLock();
+    // Throw invalid_argument if the session may not write
+    static void checkWritable(Session& session);
+    void removeNode(File* node);
+    // Point the working directory of session at dir, counting it in sessionsHere
+    static void setCurrDir(Session& session, File* dir);
+    File* findDir(const string& path);
+    // Every access to the children or the content of a node goes through these
+    void loadChildren(File* dir);
+    File* listingOf(File* dir, const ImageNode*& node);
+    string_view contentOf(File* file);
+    string_view contentOf(const NodeRef& file);
+    // Call visit(name, child) for the children of a directory, in name order. Readers go
+    // through these: they load directories of this tree's own image only, and read the rest
+    // in place.
+    File* readListing(const NodeRef& dir, const ImageNode*& node);
+    template <class Visit> void forChildren(const NodeRef& dir, Visit&& visit);
+    bool childOf(const NodeRef& dir, const string& name, NodeRef& child);
+    void ownContent(File* file);
+    // Hash a child adds to its directory's hash
+    static uint64_t entryHash(string_view name, bool isDir, uint64_t hash);
+    // Remove the entries summing to removed from the hash of dir, add those summing to
+    // added, and update the hashes of its ancestors. O(depth).
+    void updateHash(File* dir, uint64_t removed, uint64_t added);
+    // Memory of the node itself, with its entry in its parent's children
+    static MemoryUsage ownUsage(const File* node);
+    // Add delta to the usage of node and of its ancestors. O(depth).
+    static void addUsage(File* node, const MemoryUsage& delta);
+    // Add delta to the disk usage of node and of its ancestors. O(depth).
+    static void addDiskUsage(File* node, const DiskUsage& delta);
+    // Throw invalid_argument if adding bytes and inodes under dir would exceed a quota of dir
+    // or of its ancestors. O(quotas above dir).
+    static void checkQuota(File* dir, int64_t bytes, int64_t inodes);
+    // Same, for one quota only
+    static void checkQuota(Quota* quota, int64_t bytes, int64_t inodes);
+    // Point the directories under dir whose closest quota is from to to instead
+    static void retargetQuota(File* dir, Quota* from, Quota* to);
+    // Node at path, or null if it doesn't exist
+    File* lookup(Session& session, const string& path);
+    // Same for readers, walking the path split in subdirs: false if it doesn't exist
+    bool resolve(Session& session, const vector<string>& subdirs, const string& path, NodeRef& node);
+    // Write an image of the tree as of lsn. Callers keep the tree from changing meanwhile.
+    void writeImage(int fd, uint64_t lsn, BackgroundSnapshot::Progress* progress = nullptr);
+
   public:
     FileSystem() {
         root = new File();
         root->isDir = true;
+        root->parent = nullptr;
         // The working directory begins at '/'.
         root->name = "/";
-        currDir = root;
+        root->usage.store(ownUsage(root));
+        root->diskUsage.dirs = 1;
+        ownSession.reset(new Session(*this));
     }
+    // Overlay over lower. Reads go to the lower nodes in place. A directory is copied up on the
+    // first write below it (or cd into it), as a listing of nodes pointing at the lower ones;
+    // file contents stay shared until written. The lower FileSystem must outlive the overlay
+    // and not change while it exists.
+    explicit FileSystem(FileSystem& lower);
+    ~FileSystem();
+    FileSystem(const FileSystem&) = delete;
+    FileSystem& operator=(const FileSystem&) = delete;
+
     // Read functions: implementation of those functions does not mutate nodes
-    void cd(string path);
-    string pwd();
-    vector<string> ls(string path);
-    vector<string> find(string filename);
-    string cat(string path);
+    void cd(Session& session, string path);
+    string pwd(Session& session);
+    vector<string> ls(Session& session, string path);
+    vector<string> find(Session& session, string filename);
+    string cat(Session& session, string path);
+    // Memory the subtree at path takes, "." for the working directory. O(path), whatever the
+    // size of the subtree.
+    MemoryUsage memoryUsage(Session& session, string path);
+    // Files, directories and content bytes under path, "." for the working directory; a
+    // directory doesn't count itself. O(path), whatever the size of the subtree.
+    DiskUsage du(Session& session, string path);
 
     // Write functions: implementation of those functions mutates nodes
-    void mkdir(string path);
-    void rm(string path);
-    void touch(string path);
-    void write(string path, string content);
-    void mv(string from, string to);
+    void mkdir(Session& session, string path);
+    void rm(Session& session, string path);
+    void touch(Session& session, string path);
+    void write(Session& session, string path, string content);
+    void mv(Session& session, string from, string to);
+    void cp(Session& session, string from, string to, bool recursive);
+    // Set the quota of the directory at path, or remove it with limits of 0. Usage above the
+    // new limits stays, but may only shrink.
+    void setQuota(Session& session, string path, QuotaLimits limits);
+    // Quota of the directory at path itself: 0 limits if it has none
+    QuotaLimits quota(Session& session, string path);
+
+    // Single user functions: same as above, on the FS's own session
+    Session& defaultSession() { return *ownSession; }
+    void cd(string path) { cd(*ownSession, path); }
+    string pwd() { return pwd(*ownSession); }
+    vector<string> ls(string path) { return ls(*ownSession, path); }
+    vector<string> find(string filename) { return find(*ownSession, filename); }
+    string cat(string path) { return cat(*ownSession, path); }
+    MemoryUsage memoryUsage(string path) { return memoryUsage(*ownSession, path); }
+    DiskUsage du(string path) { return du(*ownSession, path); }
+    void mkdir(string path) { mkdir(*ownSession, path); }
+    void rm(string path) { rm(*ownSession, path); }
+    void touch(string path) { touch(*ownSession, path); }
+    void write(string path, string content) { write(*ownSession, path, content); }
+    void mv(string from, string to) { mv(*ownSession, from, to); }
+    void cp(string from, string to, bool recursive = false) { cp(*ownSession, from, to, recursive); }
+    void setQuota(string path, QuotaLimits limits) { setQuota(*ownSession, path, limits); }
+    QuotaLimits quota(string path) { return quota(*ownSession, path); }
+
+    // Log every mutation to wal from now on. The log must outlive the FS's use.
+    void attachLog(WriteAheadLog* wal) { this->wal = wal; }
+    // Replay a record of the log on the session
+    void apply(Session& session, const WalRecord& record);
+
+    // Checkpoint functions: write an image of the tree (see fs_image.h) from a forked child,
+    // and replace the tree with one. With rotate, records after the image go to a new log
+    // segment, so the ones it covers can be deleted.
+    uint64_t save(int fd, bool rotate = true);
+    uint64_t load(const string& path);
+
+    // Snapshot functions: write an image of the tree to path from a forked child, while this
+    // process keeps serving (see fs_snapshot.h), and describe the running or last snapshot
+    void snapshot(const string& path);
+    string snapshotStatus() { return background.status(); }
+
+    // Bulk building: adds nodes straight to the tree, without a lock per node, logging or path
+    // lookups, for generators filling a tree before it's used (see fs_generator.h). Holds the
+    // tree lock exclusively until finish(), which computes the hashes of the whole tree.
+    class Builder {
+        FileSystem& fs;
+        unique_lock<shared_mutex> lock;
+      public:
+        using Dir = File*;
+        explicit Builder(FileSystem& fs) : fs(fs), lock(fs.treeLock) {}
+        ~Builder() { finish(); }
+        Builder(const Builder&) = delete;
+        Builder& operator=(const Builder&) = delete;
+
+        Dir root() { return fs.root; }
+        // Both throw invalid_argument if parent has a child with that name already
+        Dir addDir(Dir parent, const string& name);
+        void addFile(Dir parent, const string& name, string content);
+        // A file sharing content (null if empty) with other files until written, like cp.
+        // hash must be contentHash() of the content.
+        void addFile(Dir parent, const string& name, shared_ptr<string> content, uint64_t hash);
+        void finish();
+    };
+
+    // Paths added ("+ path"), removed ("- path") and changed ("M path") from one tree to the
+    // other, sorted by path, with a '/' after directories. Subtrees with equal hashes are
+    // skipped, so the cost is in the changes, not in the size of the trees.
+    static vector<string> diff(FileSystem& from, FileSystem& to);
 
     // Util functions
-    vector<string> split(string s, char delim);
+    static vector<string> split(string s, char delim);
 };
 #endif
@@ -1,5 +1,7 @@
 #include "fs_impl.h"
 
+#include <thread>
+
 #include "gtest/gtest.h"
 
 /* Test fs_impl classes */
@@ -388,6 +390,469 @@ TEST(FileSystem, TestCatInvalid) {
     }
 }
 
+// Tests nodes can't get names an image couldn't hold: empty, with '/', or ".."
+TEST(FileSystem, TestInvalidNames) {
+    FileSystem fs;
+    fs.mkdir("/a");
+    fs.touch("f");
+    for (string name : {"a/b", "..", "/g"}) {
+        EXPECT_THROW(fs.touch(name), invalid_argument) << name;
+        EXPECT_THROW(fs.mv("f", name), invalid_argument) << name;
+    }
+    try {
+        fs.mkdir("x//y");
+        FAIL() << "Expected exception because of an empty name";
+    }
+    catch(invalid_argument const & err) {
+        EXPECT_EQ(err.what(), string("Invalid path: x//y"));
+    }
+    EXPECT_EQ(vector<string>({"a", "f"}), fs.ls("/"));
+    EXPECT_TRUE(fs.ls("/a").empty());
+    // ".." still walks up
+    fs.mkdir("a/../b");
+    EXPECT_EQ(vector<string>({"a", "b", "f"}), fs.ls("/"));
+}
+
+// Tests ops walking a path reject an empty one, e.g. a command line ending in two spaces
+TEST(FileSystem, TestEmptyPath) {
+    FileSystem fs;
+    fs.mkdir("/a");
+    fs.touch("f");
+    EXPECT_THROW(fs.mkdir(""), invalid_argument);
+    EXPECT_THROW(fs.write("", "x"), invalid_argument);
+    EXPECT_THROW(fs.ls(""), invalid_argument);
+    try {
+        fs.cat("");
+        FAIL() << "Expected exception because the path is empty";
+    }
+    catch(invalid_argument const & err) {
+        EXPECT_EQ(err.what(), string("Invalid path: "));
+    }
+    EXPECT_EQ(vector<string>({"a", "f"}), fs.ls("/"));
+}
+
+// Tests sessions sharing one tree: each session keeps its own working directory,
+// and all of them see changes made by the others.
+TEST(FileSystem, TestSessionsShareTree) {
+    FileSystem fs;
+    FileSystem::Session alice(fs);
+    FileSystem::Session bob(fs);
+    fs.mkdir(alice, "/a/b");
+    fs.mkdir(bob, "/d");
+
+    fs.cd(alice, "a");
+    fs.cd(bob, "d");
+    EXPECT_EQ("/a/", fs.pwd(alice));
+    EXPECT_EQ("/d/", fs.pwd(bob));
+    EXPECT_EQ("/", fs.pwd());
+
+    fs.touch(bob, "notes");
+    fs.write(alice, "/d/notes", "shared");
+    EXPECT_EQ("shared", fs.cat(bob, "notes"));
+
+    vector<string> dirs = fs.ls(alice, ".");
+    EXPECT_EQ(1, dirs.size());
+    EXPECT_EQ("b", dirs[0]);
+    dirs = fs.ls(bob, "/");
+    EXPECT_EQ(2, dirs.size());
+    EXPECT_EQ("a", dirs[0]);
+    EXPECT_EQ("d", dirs[1]);
+}
+
+// Tests removing a directory that is another session's working directory:
+// that session moves up to the closest remaining ancestor.
+TEST(FileSystem, TestRmSessionWorkingDir) {
+    FileSystem fs;
+    FileSystem::Session session(fs);
+    fs.mkdir("/a/b/c");
+    fs.cd(session, "a");
+    fs.cd(session, "b");
+    fs.cd(session, "c");
+    EXPECT_EQ("/a/b/c/", fs.pwd(session));
+
+    fs.cd("a");
+    fs.rm("b");
+    EXPECT_EQ("/a/", fs.pwd(session));
+    EXPECT_EQ("/a/", fs.pwd());
+
+    fs.cd(session, "../");
+    fs.rm(session, "a");
+    EXPECT_EQ("/", fs.pwd(session));
+    EXPECT_EQ("/", fs.pwd());
+
+    // Sessions are found where they are now, not in the directories they left, nor once gone
+    fs.mkdir("/x/y/z");
+    fs.cd(session, "x");
+    fs.cd(session, "y");
+    fs.cd(session, "z");
+    fs.cd(session, "../");
+    {
+        FileSystem::Session other(fs);
+        fs.cd(other, "x");
+    }
+    fs.cd("x");
+    fs.cd("y");
+    fs.rm("z");
+    EXPECT_EQ("/x/y/", fs.pwd(session));
+    fs.cd("../");
+    fs.cd("../");
+    fs.rm("x");
+    EXPECT_EQ("/", fs.pwd(session));
+    EXPECT_EQ("/", fs.pwd());
+}
+
+// Tests copying files and directories, and that copies are independent once written
+TEST(FileSystem, TestCp) {
+    FileSystem fs;
+    fs.mkdir("/src/sub");
+    fs.cd("src");
+    fs.touch("f");
+    fs.write("f", "shared");
+    fs.cd("sub");
+    fs.touch("g");
+    fs.cd("../");
+    fs.cd("../");
+
+    fs.cp("/src/f", "copy");
+    fs.cp("src", "/dst", true);
+    fs.mkdir("into");
+    fs.cp("src", "into", true);
+    fs.cp("src/f", "into");
+    EXPECT_EQ((vector<string>{"copy", "dst", "into", "src"}), fs.ls("/"));
+    EXPECT_EQ((vector<string>{"f", "sub"}), fs.ls("dst"));
+    EXPECT_EQ(vector<string>{"g"}, fs.ls("dst/sub"));
+    EXPECT_EQ((vector<string>{"f", "src"}), fs.ls("into"));
+    EXPECT_EQ((vector<string>{"/dst/sub/g", "/src/sub/g", "/into/src/sub/g"}), fs.find("g"));
+
+    fs.write("copy", " copy");
+    fs.write("dst/f", " dst");
+    EXPECT_EQ("shared copy", fs.cat("copy"));
+    EXPECT_EQ("shared dst", fs.cat("dst/f"));
+    EXPECT_EQ("shared", fs.cat("src/f"));
+    EXPECT_EQ("shared", fs.cat("into/src/f"));
+
+    // Over an existing file
+    fs.cp("copy", "into/f");
+    EXPECT_EQ("shared copy", fs.cat("into/f"));
+    fs.cd("dst");
+    EXPECT_EQ("/dst/", fs.pwd());
+    fs.cp("../copy", "f");
+    EXPECT_EQ("shared copy", fs.cat("f"));
+    fs.cd("../");
+
+    EXPECT_THROW(fs.cp("src", "x"), invalid_argument);
+    EXPECT_THROW(fs.cp("missing", "x"), invalid_argument);
+    EXPECT_THROW(fs.cp("copy", "missing/x"), invalid_argument);
+    EXPECT_THROW(fs.cp("src", "src/sub", true), invalid_argument);
+    fs.cp("src", "dst", true);
+    EXPECT_THROW(fs.cp("src", "dst", true), invalid_argument);
+    EXPECT_THROW(fs.cp("/", "x", true), invalid_argument);
+}
+
+// Tests an overlay reads through to the lower tree, and that its changes (including
+// removing lower nodes) stay its own
+TEST(FileSystem, TestOverlay) {
+    FileSystem base;
+    base.mkdir("/etc/conf");
+    base.mkdir("/home/user");
+    base.cd("etc");
+    base.touch("hosts");
+    base.write("hosts", "localhost");
+    base.cd("../");
+
+    FileSystem tenant(base);
+    EXPECT_EQ((vector<string>{"etc", "home"}), tenant.ls("/"));
+    EXPECT_EQ("localhost", tenant.cat("/etc/hosts"));
+    EXPECT_EQ(vector<string>{"/etc/conf/"}, tenant.find("conf"));
+
+    tenant.write("/etc/hosts", " tenant");
+    tenant.cd("home");
+    tenant.rm("user");
+    tenant.mkdir("other");
+    tenant.cd("../");
+    tenant.cd("etc");
+    tenant.mv("hosts", "hosts2");
+    tenant.cd("conf");
+    tenant.touch("new");
+    EXPECT_EQ("/etc/conf/", tenant.pwd());
+    EXPECT_EQ("localhost tenant", tenant.cat("/etc/hosts2"));
+    EXPECT_EQ(vector<string>{"other"}, tenant.ls("/home"));
+    EXPECT_EQ((vector<string>{"conf", "hosts2"}), tenant.ls("/etc"));
+    EXPECT_EQ(vector<string>{"new"}, tenant.ls("/etc/conf"));
+
+    EXPECT_EQ("localhost", base.cat("/etc/hosts"));
+    EXPECT_EQ(vector<string>{"user"}, base.ls("/home"));
+    EXPECT_EQ((vector<string>{"conf", "hosts"}), base.ls("/etc"));
+    EXPECT_TRUE(base.ls("/etc/conf").empty());
+
+    // Copies of directories not visited yet, and overlays of overlays
+    FileSystem fresh(base);
+    fresh.cp("/etc", "/etc2", true);
+    FileSystem nested(fresh);
+    nested.cd("etc2");
+    nested.rm("hosts");
+    EXPECT_EQ("localhost", fresh.cat("/etc2/hosts"));
+    EXPECT_EQ(vector<string>{"conf"}, nested.ls("/etc2"));
+    EXPECT_EQ((vector<string>{"etc", "etc2", "home"}), nested.ls("/"));
+}
+
+// Tests many overlays reading and writing over one lower tree at once
+TEST(FileSystem, TestConcurrentOverlays) {
+    FileSystem base;
+    base.mkdir("/a/b");
+    base.cd("a");
+    base.touch("f");
+    base.write("f", "base");
+    base.cd("../");
+
+    vector<thread> threads;
+    vector<string> results(8);
+    for (int i = 0; i < 8; i++) {
+        threads.emplace_back([&base, &results, i]() {
+            FileSystem overlay(base);
+            for (int j = 0; j < 100; j++) {
+                overlay.mkdir("/a/b/" + to_string(j));
+                overlay.write("/a/f", to_string(i));
+            }
+            results[i] = overlay.cat("/a/f") + " " + to_string(overlay.ls("/a/b").size());
+        });
+    }
+    for (auto& t : threads) t.join();
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ("base" + string(100, '0' + i) + " 100", results[i]);
+    }
+    EXPECT_EQ("base", base.cat("/a/f"));
+    EXPECT_TRUE(base.ls("/a/b").empty());
+}
+
+// Tests trees built by different ops into the same shape diff as equal, and diffs list
+// exactly the changed paths
+TEST(FileSystem, TestDiff) {
+    FileSystem one;
+    one.mkdir("/a/b/c");
+    one.cd("a");
+    one.touch("f");
+    one.write("f", "hello world");
+    one.touch("g");
+    one.cd("../");
+
+    FileSystem two;
+    two.mkdir("/x");
+    two.mkdir("/a/b");
+    two.cd("a");
+    two.touch("tmp");
+    two.write("tmp", "hello");
+    two.mv("tmp", "f");
+    two.write("f", " world");
+    two.cp("f", "g");
+    two.rm("g");
+    two.touch("g");
+    two.cd("b");
+    two.mkdir("c");
+    two.cd("../");
+    two.cd("../");
+    EXPECT_EQ(vector<string>{"+ /x/"}, FileSystem::diff(one, two));
+    two.rm("x");
+    EXPECT_TRUE(FileSystem::diff(one, two).empty());
+    EXPECT_TRUE(FileSystem::diff(two, one).empty());
+
+    two.write("/a/g", "changed");
+    two.mkdir("/a/b/c/d");
+    two.cd("a");
+    two.rm("f");
+    two.mkdir("f");
+    EXPECT_EQ((vector<string>{"+ /a/b/c/d/", "- /a/f", "+ /a/f/", "M /a/g"}), FileSystem::diff(one, two));
+    EXPECT_EQ((vector<string>{"- /a/b/c/d/", "+ /a/f", "- /a/f/", "M /a/g"}), FileSystem::diff(two, one));
+
+    // An overlay only differs from its lower tree where it changed
+    FileSystem overlay(one);
+    EXPECT_TRUE(FileSystem::diff(one, overlay).empty());
+    overlay.cd("a");
+    overlay.write("f", "!");
+    EXPECT_EQ(vector<string>{"M /a/f"}, FileSystem::diff(one, overlay));
+}
+
+bool sameUsage(const MemoryUsage& one, const MemoryUsage& two) {
+    return one.nodes == two.nodes && one.names == two.names && one.containers == two.containers
+           && one.contents == two.contents;
+}
+
+// Tests memory usage follows every op, per subtree, and goes back where it was once undone
+TEST(FileSystem, TestMemoryUsage) {
+    FileSystem fs;
+    MemoryUsage empty = fs.memoryUsage("/");
+    int64_t nodeBytes = empty.nodes;
+    EXPECT_LT(0, nodeBytes);
+    EXPECT_EQ(0, empty.containers);
+    EXPECT_EQ(nodeBytes, empty.total());
+
+    fs.mkdir("/a/b");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", string(1000, 'x'));
+    EXPECT_EQ(4 * nodeBytes, fs.memoryUsage("/").nodes);
+    MemoryUsage a = fs.memoryUsage(".");
+    EXPECT_EQ(3 * nodeBytes, a.nodes);
+    EXPECT_LT(1000, a.contents);
+    EXPECT_EQ(a.contents, fs.memoryUsage("f").contents);
+    EXPECT_EQ(a.contents, fs.memoryUsage("/").contents);
+    EXPECT_EQ(nodeBytes + a.containers / 3, fs.memoryUsage("/a/b").total());
+    EXPECT_THROW(fs.memoryUsage("missing"), invalid_argument);
+
+    // A copy takes as much as the original, the shared content included
+    fs.cd("../");
+    fs.cp("/a", "/c", true);
+    EXPECT_TRUE(sameUsage(a, fs.memoryUsage("/c")));
+    fs.write("/c/f", "!");
+    EXPECT_LT(a.contents, fs.memoryUsage("/c").contents);
+    EXPECT_TRUE(sameUsage(a, fs.memoryUsage("/a")));
+
+    // Longer names take more. Renamed back, the path string keeps its longer buffer.
+    fs.cd("a");
+    fs.mv("f", "a_name_too_long_to_be_inline");
+    MemoryUsage renamed = fs.memoryUsage(".");
+    EXPECT_LT(a.names, renamed.names);
+    EXPECT_LT(a.containers, renamed.containers);
+    fs.mv("a_name_too_long_to_be_inline", "f");
+    EXPECT_EQ(a.containers, fs.memoryUsage(".").containers);
+    EXPECT_EQ(renamed.names, fs.memoryUsage(".").names);
+    fs.cd("../");
+
+    fs.rm("a");
+    fs.rm("c");
+    EXPECT_TRUE(sameUsage(empty, fs.memoryUsage("/")));
+
+    // An overlay only takes memory for what it changed: reads don't copy the lower tree up
+    FileSystem lower;
+    lower.mkdir("/x/y/z");
+    lower.cd("x");
+    lower.touch("f");
+    lower.write("f", "lower");
+    FileSystem overlay(lower);
+    MemoryUsage fresh = overlay.memoryUsage("/");
+    EXPECT_EQ(nodeBytes, fresh.nodes);
+    EXPECT_EQ(vector<string>{"/x/y/z/"}, overlay.find("z"));
+    EXPECT_EQ((vector<string>{"f", "y"}), overlay.ls("/x"));
+    EXPECT_EQ("lower", overlay.cat("/x/y/../f"));
+    EXPECT_EQ(5, overlay.du("/").bytes);
+    EXPECT_TRUE(sameUsage(fresh, overlay.memoryUsage("/")));
+    EXPECT_EQ(0, overlay.memoryUsage("/x/y").total());
+    // A write copies up the directories above it, one listing each
+    overlay.mkdir("/x/y/w");
+    EXPECT_EQ(6 * nodeBytes, overlay.memoryUsage("/").nodes);
+    EXPECT_EQ((vector<string>{"/x/y/w/"}), overlay.find("w"));
+}
+
+bool sameDiskUsage(const DiskUsage& usage, int64_t files, int64_t dirs, int64_t bytes) {
+    return usage.files == files && usage.dirs == dirs && usage.bytes == bytes;
+}
+
+// Tests du follows every op, per subtree, without walking it
+TEST(FileSystem, TestDu) {
+    FileSystem fs;
+    EXPECT_TRUE(sameDiskUsage(fs.du("/"), 0, 0, 0));
+    fs.mkdir("/a/b/c");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", "12345");
+    fs.write("f", "678");
+    EXPECT_TRUE(sameDiskUsage(fs.du("/"), 1, 3, 8));
+    EXPECT_TRUE(sameDiskUsage(fs.du("."), 1, 2, 8));
+    EXPECT_TRUE(sameDiskUsage(fs.du("b"), 0, 1, 0));
+    EXPECT_TRUE(sameDiskUsage(fs.du("f"), 1, 0, 8));
+    EXPECT_THROW(fs.du("missing"), invalid_argument);
+
+    fs.cp("/a", "/d", true);
+    fs.cp("f", "b/c/g");
+    EXPECT_TRUE(sameDiskUsage(fs.du("/d"), 1, 2, 8));
+    EXPECT_TRUE(sameDiskUsage(fs.du("/"), 3, 6, 24));
+    // Overwritten files don't count anymore
+    fs.touch("short");
+    fs.write("short", "1");
+    fs.mv("short", "f");
+    EXPECT_TRUE(sameDiskUsage(fs.du("."), 2, 2, 9));
+    fs.cp("/d/f", "/a/f");
+    EXPECT_TRUE(sameDiskUsage(fs.du("."), 2, 2, 16));
+    fs.rm("b");
+    EXPECT_TRUE(sameDiskUsage(fs.du("/"), 2, 4, 16));
+
+    // An overlay starts with the sizes of its lower tree, visited or not
+    FileSystem overlay(fs);
+    EXPECT_TRUE(sameDiskUsage(overlay.du("/d/b"), 0, 1, 0));
+    overlay.write("/d/f", "!");
+    EXPECT_TRUE(sameDiskUsage(overlay.du("/"), 2, 4, 17));
+    EXPECT_TRUE(sameDiskUsage(fs.du("/"), 2, 4, 16));
+}
+
+// Tests quotas reject the ops that would exceed them, on their directory and below only
+TEST(FileSystem, TestQuota) {
+    FileSystem fs;
+    fs.mkdir("/t/a");
+    fs.mkdir("/u");
+    QuotaLimits limits;
+    limits.maxBytes = 10;
+    limits.maxInodes = 4;
+    fs.setQuota("/t", limits);
+    EXPECT_EQ(10, fs.quota("/t").maxBytes);
+    EXPECT_EQ(0, fs.quota("/t/a").maxBytes);
+    EXPECT_THROW(fs.setQuota("/missing", limits), invalid_argument);
+
+    fs.cd("t");
+    fs.cd("a");
+    fs.touch("f");
+    fs.write("f", "1234567890");
+    EXPECT_THROW(fs.write("f", "!"), invalid_argument);
+    EXPECT_EQ("1234567890", fs.cat("f"));
+    fs.mkdir("b");
+    EXPECT_THROW(fs.mkdir("b/c/d"), invalid_argument);
+    // Nothing is created when any directory would go over
+    EXPECT_TRUE(fs.ls("b").empty());
+    fs.mkdir("b/c");
+    EXPECT_THROW(fs.touch("g"), invalid_argument);
+    EXPECT_THROW(fs.cp("f", "/t/g"), invalid_argument);
+    EXPECT_THROW(fs.cp("/t/a", "/t/copy", true), invalid_argument);
+    // Outside of the quota, anything goes
+    fs.cp("/t/a", "/u/copy", true);
+    fs.write("/u/copy/f", "1234567890");
+
+    // Freeing space makes room again, and overwriting a file only counts the difference
+    fs.rm("b");
+    fs.touch("g");
+    fs.cd("../");
+    fs.cd("../");
+    fs.cd("u");
+    fs.cd("copy");
+    fs.touch("small");
+    fs.write("small", "12345");
+    EXPECT_THROW(fs.cp("/u/copy/f", "/t/a/g"), invalid_argument);
+    EXPECT_THROW(fs.cp("/u/copy/small", "/t/a/g"), invalid_argument);
+    fs.cp("/u/copy/small", "/t/a/f");
+    fs.cp("/u/copy/small", "/t/a/g");
+    EXPECT_EQ(10, fs.du("/t").bytes);
+
+    // Nested quotas both apply, and loaded directories get them too
+    FileSystem lower;
+    lower.mkdir("/x/y/z");
+    FileSystem overlay(lower);
+    limits.maxBytes = 0;
+    limits.maxInodes = 3;
+    overlay.setQuota("/x", limits);
+    limits.maxInodes = 100;
+    overlay.setQuota("/", limits);
+    overlay.cd("x");
+    overlay.cd("y");
+    overlay.cd("z");
+    overlay.touch("f");
+    EXPECT_THROW(overlay.touch("g"), invalid_argument);
+    overlay.setQuota("/x", QuotaLimits());
+    overlay.touch("g");
+    limits.maxInodes = 5;
+    overlay.setQuota("/", limits);
+    EXPECT_THROW(overlay.touch("h"), invalid_argument);
+    overlay.rm("g");
+    overlay.touch("h");
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc,argv);
     return RUN_ALL_TESTS();
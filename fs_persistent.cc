@@ -0,0 +1,435 @@
+#include "fs_persistent.h"
+
+#include <algorithm>
+#include <queue>
+#include <stack>
+#include <stdexcept>
+
+#include "fs_image.h"
+#include "fs_impl.h"
+
+using namespace std;
+
+using Node = PersistentFileSystem::Node;
+using NodePtr = PersistentFileSystem::NodePtr;
+
+namespace {
+
+// Path of a directory, as FileSystem names it (e.g. "/a/b/")
+string dirName(const vector<string>& names) {
+    string name = "/";
+    for (const string& part : names) name += part + "/";
+    return name;
+}
+
+// Nodes from root down to the directory at names. If it's gone, names is cut to its closest
+// ancestor left.
+vector<const Node*> descend(const Node* root, vector<string>& names) {
+    vector<const Node*> nodes = {root};
+    for (size_t i = 0; i < names.size(); i++) {
+        auto iter = nodes.back()->children.find(names[i]);
+        if (iter == nodes.back()->children.end() || !iter->second->isDir) {
+            names.resize(i);
+            break;
+        }
+        nodes.push_back(iter->second.get());
+    }
+    return nodes;
+}
+
+// Walk path from the directory at names, or from root if the path is absolute, the way
+// FileSystem does. Return the nodes from root to the target, whose path is left in names.
+// If the target doesn't exist, throw notFound + path, or return no nodes without notFound.
+vector<const Node*> walk(const Node* root, vector<string>& names, const string& path, const char* notFound) {
+    vector<string> parts = FileSystem::split(path, '/');
+    size_t i = 0;
+    if (!parts.empty() && parts[0] == "") {
+        names.clear();
+        i = 1;
+    }
+    vector<const Node*> nodes = descend(root, names);
+    for (; i < parts.size(); i++) {
+        if (parts[i] == "..") {
+            if (nodes.size() == 1) throw invalid_argument("Invalid path: " + path);
+            nodes.pop_back();
+            names.pop_back();
+            continue;
+        }
+        auto iter = nodes.back()->children.find(parts[i]);
+        if (iter == nodes.back()->children.end()) {
+            if (!notFound) return {};
+            throw invalid_argument(notFound + path);
+        }
+        nodes.push_back(iter->second.get());
+        names.push_back(parts[i]);
+    }
+    return nodes;
+}
+
+vector<string> lsAt(const Node* root, vector<string> names, const string& path) {
+    const Node* dir;
+    if (path == ".") {
+        dir = descend(root, names).back();
+    } else {
+        if (path.empty()) throw invalid_argument("Invalid path: " + path);
+        dir = walk(root, names, path, "No such file or directory: ").back();
+        if (!dir->isDir) return {FileSystem::split(path, '/').back()};
+    }
+    vector<string> files;
+    for (auto iter = dir->children.begin(); iter != dir->children.end(); iter++) files.push_back(iter->first);
+    return files;
+}
+
+// Breadth first, like FileSystem::find
+vector<string> findAt(const Node* root, vector<string> names, const string& filename) {
+    vector<string> files;
+    queue<pair<const Node*, string>> q;
+    q.push({descend(root, names).back(), dirName(names)});
+    while (!q.empty()) {
+        const Node* dir = q.front().first;
+        string name = q.front().second;
+        q.pop();
+        auto match = dir->children.find(filename);
+        if (match != dir->children.end()) files.push_back(name + filename + (match->second->isDir ? "/" : ""));
+        for (auto iter = dir->children.begin(); iter != dir->children.end(); iter++) {
+            if (iter->second->isDir) q.push({iter->second.get(), name + iter->first + "/"});
+        }
+    }
+    return files;
+}
+
+string catAt(const Node* root, vector<string> names, const string& path) {
+    if (path.empty()) throw invalid_argument("Invalid path: " + path);
+    const Node* file = walk(root, names, path, "File not found: ").back();
+    if (file->isDir) throw invalid_argument("Not a file: " + path);
+    return file->content;
+}
+
+}  // namespace
+
+/************************ path copies ***************************/
+
+// Mutable copies of the directories from root down to the one a write works in. Each copy is
+// linked into its (copied) parent as it's made, and nothing is visible to readers until the
+// new root is published: the tree of the base version is never touched.
+class PersistentFileSystem::PathCopy {
+  public:
+    shared_ptr<const Snapshot> base;
+    vector<shared_ptr<Node>> dirs;
+    vector<string> names;
+
+    explicit PathCopy(shared_ptr<const Snapshot> base) : base(base) {
+        dirs.push_back(make_shared<Node>(*base->root));
+    }
+    Node& dir() { return *dirs.back(); }
+    bool atRoot() { return dirs.size() == 1; }
+    // Go down to the child directory name of the current one
+    void down(const string& name) {
+        shared_ptr<Node> copy = make_shared<Node>(*dir().children.at(name));
+        dir().children[name] = copy;
+        dirs.push_back(copy);
+        names.push_back(name);
+    }
+    // Go down to a new child directory
+    void create(const string& name) {
+        shared_ptr<Node> dir = make_shared<Node>();
+        dir->isDir = true;
+        this->dir().children[name] = dir;
+        dirs.push_back(dir);
+        names.push_back(name);
+    }
+    void up() {
+        dirs.pop_back();
+        names.pop_back();
+    }
+    // Go down to the working directory of session, moving it up first if it's gone
+    void enter(Session& session) {
+        descend(base->root.get(), session.cwd);
+        for (const string& name : session.cwd) down(name);
+    }
+};
+
+PersistentFileSystem::PersistentFileSystem() {
+    shared_ptr<Node> root = make_shared<Node>();
+    root->isDir = true;
+    shared_ptr<Snapshot> first = make_shared<Snapshot>();
+    first->root = root;
+    first->version = 0;
+    current = first;
+}
+
+void PersistentFileSystem::publish(PathCopy& copy) {
+    shared_ptr<Snapshot> next = make_shared<Snapshot>();
+    next->root = copy.dirs[0];
+    next->version = copy.base->version + 1;
+    atomic_store(&current, shared_ptr<const Snapshot>(next));
+}
+
+/************************ read functions ************************/
+
+void PersistentFileSystem::cd(Session& session, string path) {
+    shared_ptr<const Snapshot> version = atomic_load(&current);
+    const Node* dir = descend(version->root.get(), session.cwd).back();
+    if (path == "../") {
+        if (!session.cwd.empty()) session.cwd.pop_back();
+        return;
+    }
+    auto iter = dir->children.find(path);
+    if (iter == dir->children.end()) throw invalid_argument("Directory not found: " + path);
+    if (!iter->second->isDir) throw invalid_argument("Not a directory: " + path);
+    session.cwd.push_back(path);
+}
+
+string PersistentFileSystem::pwd(Session& session) {
+    shared_ptr<const Snapshot> version = atomic_load(&current);
+    descend(version->root.get(), session.cwd);
+    return dirName(session.cwd);
+}
+
+vector<string> PersistentFileSystem::ls(Session& session, string path) {
+    return lsAt(atomic_load(&current)->root.get(), session.cwd, path);
+}
+
+vector<string> PersistentFileSystem::find(Session& session, string filename) {
+    return findAt(atomic_load(&current)->root.get(), session.cwd, filename);
+}
+
+string PersistentFileSystem::cat(Session& session, string path) {
+    return catAt(atomic_load(&current)->root.get(), session.cwd, path);
+}
+
+/************************ write functions ***********************/
+
+// Like FileSystem::mkdir, creates all the missing directories or none: the copy is published
+// only once the whole path is done
+void PersistentFileSystem::mkdir(Session& session, string path) {
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    vector<string> parts = FileSystem::split(path, '/');
+    if (parts.empty()) throw invalid_argument("Invalid path: " + path);
+    size_t i = 0;
+    if (parts[0] == "") i = 1;
+    else copy.enter(session);
+    // Check every name before creating any directory, e.g. the empty one of "a//b"
+    for (size_t j = i; j < parts.size(); j++) {
+        if (parts[j] != ".." && !validName(parts[j])) throw invalid_argument("Invalid path: " + path);
+    }
+    bool created = false;
+    for (; i < parts.size(); i++) {
+        if (parts[i] == "..") {
+            if (copy.atRoot()) throw invalid_argument("Invalid path: " + path);
+            copy.up();
+            continue;
+        }
+        auto iter = copy.dir().children.find(parts[i]);
+        if (iter == copy.dir().children.end()) {
+            copy.create(parts[i]);
+            created = true;
+        } else if (iter->second->isDir) {
+            copy.down(parts[i]);
+        } else {
+            throw invalid_argument("Invalid path: " + path);
+        }
+    }
+    if (!created) throw invalid_argument("File/Directory exists: " + path);
+    publish(copy);
+}
+
+void PersistentFileSystem::rm(Session& session, string path) {
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    copy.enter(session);
+    if (!copy.dir().children.erase(path)) throw invalid_argument("No such file or directory: " + path);
+    publish(copy);
+}
+
+void PersistentFileSystem::touch(Session& session, string path) {
+    if (!validName(path)) throw invalid_argument("Invalid path: " + path);
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    copy.enter(session);
+    if (copy.dir().children.count(path)) throw invalid_argument("File/Directory exists: " + path);
+    shared_ptr<Node> file = make_shared<Node>();
+    file->isDir = false;
+    copy.dir().children[path] = file;
+    publish(copy);
+}
+
+void PersistentFileSystem::write(Session& session, string path, string content) {
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    vector<string> parts = FileSystem::split(path, '/');
+    if (parts.empty()) throw invalid_argument("Invalid path: " + path);
+    size_t i = 0;
+    if (parts[0] == "") i = 1;
+    else copy.enter(session);
+    // File the walk is at, in the current directory; null while at a directory
+    const Node* file = nullptr;
+    string fileName;
+    for (; i < parts.size(); i++) {
+        if (parts[i] == "..") {
+            // From a file, .. is the directory holding it
+            if (file) file = nullptr;
+            else if (copy.atRoot()) throw invalid_argument("Invalid path: " + path);
+            else copy.up();
+            continue;
+        }
+        auto iter = copy.dir().children.find(parts[i]);
+        if (file || iter == copy.dir().children.end()) throw invalid_argument("File not found: " + path);
+        if (iter->second->isDir) {
+            copy.down(parts[i]);
+        } else {
+            file = iter->second.get();
+            fileName = parts[i];
+        }
+    }
+    if (!file) throw invalid_argument("Not a file: " + path);
+    shared_ptr<Node> written = make_shared<Node>(*file);
+    written->content += content;
+    copy.dir().children[fileName] = written;
+    publish(copy);
+}
+
+void PersistentFileSystem::mv(Session& session, string from, string to) {
+    if (!validName(to)) throw invalid_argument("Invalid path: " + to);
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    copy.enter(session);
+    auto iter = copy.dir().children.find(from);
+    if (iter == copy.dir().children.end()) throw invalid_argument("File not found: " + from);
+    if (from == to) return;
+    if (iter->second->isDir) throw invalid_argument("Not a file: " + from);
+    NodePtr file = iter->second;
+    copy.dir().children.erase(iter);
+    copy.dir().children[to] = file;
+    publish(copy);
+}
+
+// Same as FileSystem::cp, but copies share the source node: O(depth) whatever its size
+void PersistentFileSystem::cp(Session& session, string from, string to, bool recursive) {
+    lock_guard<mutex> lock(writeLock);
+    PathCopy copy(atomic_load(&current));
+    const Node* root = copy.base->root.get();
+    descend(root, session.cwd);
+
+    vector<string> sourceNames = session.cwd;
+    vector<const Node*> sourceNodes = walk(root, sourceNames, from, "No such file or directory: ");
+    if (sourceNames.empty()) throw invalid_argument("Invalid path: " + from);
+    NodePtr source = sourceNodes[sourceNodes.size() - 2]->children.at(sourceNames.back());
+    if (source->isDir && !recursive) throw invalid_argument("Not a file: " + from);
+
+    // Directory of the copy, and its name there
+    vector<string> destNames = session.cwd;
+    vector<const Node*> destNodes = walk(root, destNames, to, nullptr);
+    string name;
+    if (!destNodes.empty() && destNodes.back()->isDir) {
+        name = sourceNames.back();
+    } else {
+        size_t slash = to.rfind('/');
+        name = slash == string::npos ? to : to.substr(slash + 1);
+        if (!validName(name)) throw invalid_argument("Invalid path: " + to);
+        destNames = session.cwd;
+        if (slash != string::npos) {
+            destNodes = walk(root, destNames, slash == 0 ? "/" : to.substr(0, slash), nullptr);
+        } else {
+            destNodes = descend(root, destNames);
+        }
+        if (destNodes.empty() || !destNodes.back()->isDir) throw invalid_argument("No such file or directory: " + to);
+    }
+    auto existing = destNodes.back()->children.find(name);
+    if (existing != destNodes.back()->children.end() && (existing->second->isDir || source->isDir)) {
+        throw invalid_argument("File/Directory exists: " + to);
+    }
+    if (source->isDir && destNames.size() >= sourceNames.size()
+            && equal(sourceNames.begin(), sourceNames.end(), destNames.begin())) {
+        throw invalid_argument("Invalid path: " + to);
+    }
+    if (existing != destNodes.back()->children.end() && existing->second == source) return;
+
+    for (const string& dir : destNames) copy.down(dir);
+    copy.dir().children[name] = source;
+    publish(copy);
+}
+
+/************************ snapshot functions ********************/
+
+PersistentFileSystem::Snapshot PersistentFileSystem::snapshot() const {
+    return *atomic_load(&current);
+}
+
+vector<string> PersistentFileSystem::Snapshot::ls(string path) const {
+    return lsAt(root.get(), {}, path);
+}
+
+vector<string> PersistentFileSystem::Snapshot::find(string filename) const {
+    return findAt(root.get(), {}, filename);
+}
+
+string PersistentFileSystem::Snapshot::cat(string path) const {
+    return catAt(root.get(), {}, path);
+}
+
+// Walks both trees together, skipping every subtree the two versions share
+vector<string> PersistentFileSystem::diff(const Snapshot& from, const Snapshot& to) {
+    // Changed paths, with their line
+    vector<pair<string, string>> changes;
+    stack<tuple<const Node*, const Node*, string>> s;
+    s.push({from.root.get(), to.root.get(), "/"});
+    while (!s.empty()) {
+        const Node* oldDir = get<0>(s.top());
+        const Node* newDir = get<1>(s.top());
+        string prefix = get<2>(s.top());
+        s.pop();
+        if (oldDir == newDir) continue;
+
+        auto name = [&prefix](const pair<const string, NodePtr>& child) {
+            return prefix + child.first + (child.second->isDir ? "/" : "");
+        };
+        auto oldIter = oldDir->children.begin();
+        auto newIter = newDir->children.begin();
+        while (oldIter != oldDir->children.end() || newIter != newDir->children.end()) {
+            if (newIter == newDir->children.end() || (oldIter != oldDir->children.end() && oldIter->first < newIter->first)) {
+                changes.push_back({name(*oldIter), "- " + name(*oldIter)});
+                oldIter++;
+            } else if (oldIter == oldDir->children.end() || newIter->first < oldIter->first) {
+                changes.push_back({name(*newIter), "+ " + name(*newIter)});
+                newIter++;
+            } else {
+                const Node* oldChild = oldIter->second.get();
+                const Node* newChild = newIter->second.get();
+                if (oldChild != newChild) {
+                    if (oldChild->isDir != newChild->isDir) {
+                        changes.push_back({name(*oldIter), "- " + name(*oldIter)});
+                        changes.push_back({name(*newIter), "+ " + name(*newIter)});
+                    } else if (oldChild->isDir) {
+                        s.push({oldChild, newChild, name(*newIter)});
+                    } else if (oldChild->content != newChild->content) {
+                        changes.push_back({name(*newIter), "M " + name(*newIter)});
+                    }
+                }
+                oldIter++;
+                newIter++;
+            }
+        }
+    }
+    stable_sort(changes.begin(), changes.end(),
+                [](const pair<string, string>& a, const pair<string, string>& b) { return a.first < b.first; });
+    vector<string> lines;
+    for (auto& change : changes) lines.push_back(change.second);
+    return lines;
+}
+
+uint64_t PersistentFileSystem::retain() {
+    Snapshot version = snapshot();
+    lock_guard<mutex> guard(retainedLock);
+    retained.emplace(version.version, version);
+    return version.version;
+}
+
+vector<string> PersistentFileSystem::diff(uint64_t from, uint64_t to) {
+    lock_guard<mutex> guard(retainedLock);
+    for (uint64_t version : {from, to}) {
+        if (!retained.count(version)) throw invalid_argument("No such version: " + to_string(version));
+    }
+    return diff(retained.at(from), retained.at(to));
+}
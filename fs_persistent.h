@@ -0,0 +1,111 @@
+#ifndef FS_PERSISTENT_H
+#define FS_PERSISTENT_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Persistent variant of the in memory file system
+   Nodes are immutable and shared between versions of the tree: a write copies the
+   directories on the path from the root to the node it changes, and publishes the new root.
+   A snapshot is just a retained root, taken in O(1), readable while writes go on, and
+   diffable against any other snapshot in time proportional to what changed.
+   Readers never lock: they load the current root and walk a tree nobody changes. Writers
+   take turns.
+   Commands, paths, names and errors are the same as FileSystem's (fs_impl.h); paths given
+   to a snapshot are relative to its root. The prompt runs on a persistent tree with
+   --persistent (see fs_command.h for the commands it has).
+*/
+class PersistentFileSystem {
+  public:
+    struct Node;
+    using NodePtr = shared_ptr<const Node>;
+    struct Node {
+        bool isDir;
+        map<string, NodePtr> children;
+        // If the node is a file, its content
+        string content;
+    };
+
+    // A version of the tree
+    class Snapshot {
+        friend class PersistentFileSystem;
+        NodePtr root;
+        // Number of writes before this version
+        uint64_t version;
+      public:
+        uint64_t getVersion() const { return version; }
+        vector<string> ls(string path) const;
+        vector<string> find(string filename) const;
+        string cat(string path) const;
+    };
+
+    // State of one user of the FS, used by one thread at a time. The working directory is
+    // kept as a path: if it's removed, the session moves up to the closest ancestor left.
+    class Session {
+        friend class PersistentFileSystem;
+        vector<string> cwd;
+    };
+
+  private:
+    // Serializes writers
+    mutex writeLock;
+    // The current version, swapped atomically
+    shared_ptr<const Snapshot> current;
+    Session ownSession;
+    // Versions retained by number, for commands
+    mutex retainedLock;
+    map<uint64_t, Snapshot> retained;
+
+    class PathCopy;
+    // Publish the tree a write built
+    void publish(PathCopy& copy);
+
+  public:
+    PersistentFileSystem();
+
+    // Read functions: run on the current version
+    void cd(Session& session, string path);
+    string pwd(Session& session);
+    vector<string> ls(Session& session, string path);
+    vector<string> find(Session& session, string filename);
+    string cat(Session& session, string path);
+
+    // Write functions: publish a new version
+    void mkdir(Session& session, string path);
+    void rm(Session& session, string path);
+    void touch(Session& session, string path);
+    void write(Session& session, string path, string content);
+    void mv(Session& session, string from, string to);
+    void cp(Session& session, string from, string to, bool recursive);
+
+    // Single user functions: same as above, on the FS's own session
+    Session& defaultSession() { return ownSession; }
+    void cd(string path) { cd(ownSession, path); }
+    string pwd() { return pwd(ownSession); }
+    vector<string> ls(string path) { return ls(ownSession, path); }
+    vector<string> find(string filename) { return find(ownSession, filename); }
+    string cat(string path) { return cat(ownSession, path); }
+    void mkdir(string path) { mkdir(ownSession, path); }
+    void rm(string path) { rm(ownSession, path); }
+    void touch(string path) { touch(ownSession, path); }
+    void write(string path, string content) { write(ownSession, path, content); }
+    void mv(string from, string to) { mv(ownSession, from, to); }
+    void cp(string from, string to, bool recursive = false) { cp(ownSession, from, to, recursive); }
+
+    // Snapshot functions
+    Snapshot snapshot() const;
+    // Paths that differ from one snapshot to the other, in path order, one per line:
+    // "+ path" added, "- path" removed, "M path" file content changed. Directories end with
+    // '/', and an added or removed directory is listed without its contents.
+    static vector<string> diff(const Snapshot& from, const Snapshot& to);
+    // Retain the current version until the FS goes, and return its number
+    uint64_t retain();
+    // diff between two retained versions. Throw invalid_argument if one isn't retained.
+    vector<string> diff(uint64_t from, uint64_t to);
+};
+#endif
@@ -0,0 +1,231 @@
+#include "fs_persistent.h"
+
+#include <sstream>
+#include <thread>
+
+#include "fs_command.h"
+#include "gtest/gtest.h"
+
+/* Test the persistent FS and its snapshots */
+namespace {
+
+// Tests the commands behave like FileSystem's
+TEST(PersistentFileSystem, TestCommands) {
+    PersistentFileSystem fs;
+    fs.mkdir("/a/b/c");
+    fs.cd("a");
+    EXPECT_EQ("/a/", fs.pwd());
+    fs.mkdir("../x/../y");
+    EXPECT_EQ((vector<string>{"a", "x", "y"}), fs.ls("/"));
+    fs.touch("f");
+    fs.write("f", "hello ");
+    fs.write("/a/f", "world");
+    EXPECT_EQ("hello world", fs.cat("f"));
+    EXPECT_EQ("hello world", fs.cat("b/../f"));
+    fs.mv("f", "g");
+    EXPECT_EQ((vector<string>{"b", "g"}), fs.ls("."));
+    EXPECT_EQ(vector<string>{"g"}, fs.ls("g"));
+    fs.mkdir("b/g");
+    EXPECT_EQ((vector<string>{"/a/g", "/a/b/g/"}), fs.find("g"));
+    fs.cd("../");
+    EXPECT_EQ("/", fs.pwd());
+
+    try {
+        fs.mkdir("../a");
+        FAIL() << "Expected exception because already reached root";
+    } catch (const invalid_argument& err) {
+        EXPECT_EQ(string("Invalid path: ../a"), err.what());
+    }
+    EXPECT_THROW(fs.mkdir("a"), invalid_argument);
+    EXPECT_THROW(fs.touch("a"), invalid_argument);
+    EXPECT_THROW(fs.write("a", "x"), invalid_argument);
+    EXPECT_THROW(fs.write("a/missing", "x"), invalid_argument);
+    EXPECT_THROW(fs.cat("a"), invalid_argument);
+    EXPECT_THROW(fs.cd("missing"), invalid_argument);
+    EXPECT_THROW(fs.rm("missing"), invalid_argument);
+    EXPECT_THROW(fs.mv("a", "b"), invalid_argument);
+    // Failing halfway creates nothing
+    EXPECT_THROW(fs.mkdir("z/../../.."), invalid_argument);
+    EXPECT_EQ((vector<string>{"a", "x", "y"}), fs.ls("/"));
+}
+
+// Tests names are checked like FileSystem's, before anything is created
+TEST(PersistentFileSystem, TestInvalidNames) {
+    PersistentFileSystem fs;
+    fs.mkdir("/a");
+    fs.touch("f");
+    EXPECT_THROW(fs.touch("a/b"), invalid_argument);
+    EXPECT_THROW(fs.touch(""), invalid_argument);
+    EXPECT_THROW(fs.touch(".."), invalid_argument);
+    EXPECT_THROW(fs.mv("f", "x/y"), invalid_argument);
+    EXPECT_THROW(fs.mv("f", ".."), invalid_argument);
+    EXPECT_THROW(fs.mkdir("x//y"), invalid_argument);
+    for (const auto& path : {"", "/"}) {
+        EXPECT_THROW(fs.write(path, "x"), invalid_argument);
+        EXPECT_THROW(fs.cat(path), invalid_argument);
+    }
+    EXPECT_THROW(fs.mkdir(""), invalid_argument);
+    EXPECT_THROW(fs.ls(""), invalid_argument);
+    EXPECT_EQ((vector<string>{"a", "f"}), fs.ls("/"));
+    EXPECT_TRUE(fs.ls("/a").empty());
+}
+
+// Tests the command table runs on a persistent tree, with snapshot and diff on numbered versions
+TEST(PersistentFileSystem, TestRunCommand) {
+    PersistentFileSystem fs;
+    PersistentFileSystem::Session& session = fs.defaultSession();
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, session, "mkdir /a/b", out));
+    EXPECT_TRUE(runCommand(fs, session, "cd a", out));
+    EXPECT_TRUE(runCommand(fs, session, "touch f", out));
+    EXPECT_TRUE(runCommand(fs, session, "snapshot", out));
+    EXPECT_TRUE(runCommand(fs, session, "write f hello", out));
+    EXPECT_TRUE(runCommand(fs, session, "cp -r b c", out));
+    EXPECT_TRUE(runCommand(fs, session, "rm b", out));
+    EXPECT_TRUE(runCommand(fs, session, "snapshot", out));
+    EXPECT_TRUE(runCommand(fs, session, "diff 2 5", out));
+    EXPECT_TRUE(runCommand(fs, session, "pwd", out));
+    EXPECT_TRUE(runCommand(fs, session, "cat f", out));
+    EXPECT_EQ("version 2\nversion 5\n- /a/b/\n+ /a/c/\nM /a/f\n/a/\nhello\n", out.str());
+
+    out.str("");
+    EXPECT_FALSE(runCommand(fs, session, "diff 2 3", out));
+    EXPECT_FALSE(runCommand(fs, session, "diff 2 x", out));
+    EXPECT_FALSE(runCommand(fs, session, "snapshot /tmp/image", out));
+    EXPECT_FALSE(runCommand(fs, session, "du", out));
+    EXPECT_FALSE(runCommand(fs, session, "touch x/y", out));
+    EXPECT_EQ(0, out.str().find("No such version: 3\n"));
+    EXPECT_NE(string::npos, out.str().find("Not supported on a persistent tree\n"));
+
+    // diff is the persistent tree's only
+    FileSystem tree;
+    EXPECT_FALSE(runCommand(tree, tree.defaultSession(), "diff 1 2", out));
+}
+
+// Tests copies share the source until either side is written
+TEST(PersistentFileSystem, TestCp) {
+    PersistentFileSystem fs;
+    fs.mkdir("/src/sub");
+    fs.cd("src");
+    fs.touch("f");
+    fs.write("f", "shared");
+    fs.cd("../");
+    fs.cp("src", "dst", true);
+    fs.mkdir("into");
+    fs.cp("/src/f", "into");
+    PersistentFileSystem::Snapshot copied = fs.snapshot();
+    EXPECT_EQ((vector<string>{"dst", "into", "src"}), fs.ls("/"));
+    EXPECT_EQ((vector<string>{"f", "sub"}), fs.ls("dst"));
+    EXPECT_EQ(vector<string>{"f"}, fs.ls("into"));
+
+    fs.write("dst/f", " dst");
+    EXPECT_EQ("shared dst", fs.cat("dst/f"));
+    EXPECT_EQ("shared", fs.cat("src/f"));
+    EXPECT_EQ(vector<string>{"M /dst/f"}, PersistentFileSystem::diff(copied, fs.snapshot()));
+
+    EXPECT_THROW(fs.cp("src", "x"), invalid_argument);
+    EXPECT_THROW(fs.cp("src", "src/sub", true), invalid_argument);
+    fs.cp("src", "dst", true);
+    EXPECT_THROW(fs.cp("src", "dst", true), invalid_argument);
+    EXPECT_THROW(fs.cp("/", "x", true), invalid_argument);
+}
+
+// Tests a session whose working directory is removed moves up to the closest ancestor left
+TEST(PersistentFileSystem, TestRemovedWorkingDirectory) {
+    PersistentFileSystem fs;
+    fs.mkdir("/a/b/c");
+    PersistentFileSystem::Session session;
+    fs.cd(session, "a");
+    fs.cd(session, "b");
+    fs.cd(session, "c");
+    fs.cd("a");
+    fs.rm("b");
+    EXPECT_EQ("/a/", fs.pwd(session));
+    EXPECT_EQ(vector<string>{}, fs.ls(session, "."));
+}
+
+// Tests snapshots keep their version of the tree while it changes
+TEST(PersistentFileSystem, TestSnapshot) {
+    PersistentFileSystem fs;
+    fs.mkdir("/a/b");
+    fs.touch("f");
+    fs.write("f", "v1");
+    PersistentFileSystem::Snapshot first = fs.snapshot();
+    EXPECT_EQ(3, first.getVersion());
+
+    fs.write("f", " v2");
+    fs.rm("a");
+    fs.mkdir("c");
+    PersistentFileSystem::Snapshot second = fs.snapshot();
+    EXPECT_EQ(6, second.getVersion());
+
+    EXPECT_EQ((vector<string>{"a", "f"}), first.ls("/"));
+    EXPECT_EQ(vector<string>{"b"}, first.ls("a"));
+    EXPECT_EQ("v1", first.cat("/f"));
+    EXPECT_EQ(vector<string>{"/a/b/"}, first.find("b"));
+    EXPECT_EQ((vector<string>{"c", "f"}), second.ls("/"));
+    EXPECT_EQ("v1 v2", second.cat("f"));
+    EXPECT_THROW(second.ls("a"), invalid_argument);
+}
+
+// Tests diffs list what changed between two snapshots
+TEST(PersistentFileSystem, TestDiff) {
+    PersistentFileSystem fs;
+    fs.mkdir("/a/b/c");
+    fs.mkdir("/keep/deep");
+    fs.touch("f");
+    fs.touch("g");
+    fs.write("g", "same");
+    fs.touch("t");
+    PersistentFileSystem::Snapshot before = fs.snapshot();
+    EXPECT_EQ(vector<string>{}, PersistentFileSystem::diff(before, fs.snapshot()));
+
+    fs.write("f", "changed");
+    fs.cd("a");
+    fs.cd("b");
+    fs.rm("c");
+    fs.mkdir("d/e");
+    fs.cd("../");
+    fs.cd("../");
+    fs.rm("t");
+    fs.mkdir("t");
+    fs.mkdir("new");
+    PersistentFileSystem::Snapshot after = fs.snapshot();
+    EXPECT_EQ((vector<string>{"- /a/b/c/", "+ /a/b/d/", "M /f", "+ /new/", "- /t", "+ /t/"}),
+              PersistentFileSystem::diff(before, after));
+    EXPECT_EQ((vector<string>{"+ /a/b/c/", "- /a/b/d/", "M /f", "- /new/", "+ /t", "- /t/"}),
+              PersistentFileSystem::diff(after, before));
+}
+
+// Tests readers of snapshots and of the live tree run while writers change it
+TEST(PersistentFileSystem, TestConcurrentReaders) {
+    PersistentFileSystem fs;
+    fs.touch("f");
+    const int writes = 500;
+    thread writer([&fs]() {
+        PersistentFileSystem::Session session;
+        for (int i = 0; i < writes; i++) {
+            fs.write(session, "f", "x");
+            fs.mkdir(session, "d" + to_string(i));
+        }
+    });
+    vector<thread> readers;
+    for (int t = 0; t < 4; t++) {
+        readers.emplace_back([&fs]() {
+            PersistentFileSystem::Session session;
+            for (int i = 0; i < writes; i++) {
+                PersistentFileSystem::Snapshot snapshot = fs.snapshot();
+                // Every version is consistent: one more x per directory, as written
+                size_t dirs = snapshot.ls("/").size() - 1;
+                size_t size = snapshot.cat("f").size();
+                EXPECT_TRUE(size == dirs || size == dirs + 1);
+                fs.ls(session, ".");
+            }
+        });
+    }
+    writer.join();
+    for (thread& reader : readers) reader.join();
+    EXPECT_EQ(string(writes, 'x'), fs.cat("f"));
+}
+
+}  // namespace
@@ -0,0 +1,147 @@
+#include "fs_protocol.h"
+
+#include <cstring>
+
+#include "fs_command.h"
+#include "fs_spans.h"
+#include "fs_util.h"
+
+using namespace std;
+
+namespace fsproto {
+
+namespace {
+
+void putString(string& out, const string& s) {
+    putU32(out, s.size());
+    out += s;
+}
+
+// Reads the fields of one frame, checking every read against the end of the frame
+class FrameReader {
+    const char* pos;
+    const char* end;
+  public:
+    FrameReader(const char* data, size_t size) : pos(data), end(data + size) {}
+    uint8_t u8() {
+        if (end - pos < 1) throw invalid_argument("Truncated frame");
+        return *pos++;
+    }
+    uint32_t u32() {
+        if (end - pos < 4) throw invalid_argument("Truncated frame");
+        uint32_t value = getU32(pos);
+        pos += 4;
+        return value;
+    }
+    string str() {
+        uint32_t len = u32();
+        if (uint32_t(end - pos) < len) throw invalid_argument("Truncated frame");
+        string s(pos, len);
+        pos += len;
+        return s;
+    }
+    bool done() { return pos == end; }
+};
+
+// Length of the complete frame at the start of data including its length prefix, or 0
+size_t frameLength(const char* data, size_t size) {
+    if (size < 4) return 0;
+    uint32_t len = getU32(data);
+    if (len > kMaxFrameLength) throw invalid_argument("Frame too long");
+    if (size - 4 < len) return 0;
+    return 4 + len;
+}
+
+class ItemOutput : public CommandOutput {
+    vector<string>& items;
+  public:
+    explicit ItemOutput(vector<string>& items) : items(items) {}
+    void add(const string& line) override { items.push_back(line); }
+};
+
+// Patch the length prefix of the frame started at offset start, once its body is written
+void finishFrame(string& out, size_t start) {
+    uint32_t len = out.size() - start - 4;
+    for (int i = 0; i < 4; i++) out[start + i] = char(len >> (8 * i));
+}
+
+}  // namespace
+
+void encodeRequest(const Request& request, string& out) {
+    size_t start = out.size();
+    putU32(out, 0);
+    putU32(out, request.id);
+    out += char(request.op);
+    out += char(request.args.size());
+    for (const string& arg : request.args) putString(out, arg);
+    finishFrame(out, start);
+}
+
+void encodeResponse(const Response& response, string& out) {
+    size_t start = out.size();
+    putU32(out, 0);
+    putU32(out, response.id);
+    out += char(response.status);
+    putU32(out, response.items.size());
+    for (const string& item : response.items) putString(out, item);
+    finishFrame(out, start);
+}
+
+size_t decodeRequest(const char* data, size_t size, Request& request) {
+    size_t len = frameLength(data, size);
+    if (len == 0) return 0;
+    FrameReader reader(data + 4, len - 4);
+    request.id = reader.u32();
+    request.op = Op(reader.u8());
+    uint8_t argc = reader.u8();
+    request.args.clear();
+    for (int i = 0; i < argc; i++) request.args.push_back(reader.str());
+    if (!reader.done()) throw invalid_argument("Trailing bytes in frame");
+    return len;
+}
+
+size_t decodeResponse(const char* data, size_t size, Response& response) {
+    size_t len = frameLength(data, size);
+    if (len == 0) return 0;
+    FrameReader reader(data + 4, len - 4);
+    response.id = reader.u32();
+    response.status = Status(reader.u8());
+    uint32_t count = reader.u32();
+    response.items.clear();
+    for (uint32_t i = 0; i < count; i++) response.items.push_back(reader.str());
+    if (!reader.done()) throw invalid_argument("Trailing bytes in frame");
+    return len;
+}
+
+Response execute(FileSystem& fs, FileSystem::Session& session, const Request& request) {
+    Response response;
+    response.id = request.id;
+    response.status = Status::Error;
+    Span parse(SpanPhase::Parse);
+    const Command* command = findCommand(uint8_t(request.op));
+    if (!command) {
+        response.items.push_back("Bad request: op " + to_string(int(request.op)));
+        return response;
+    }
+    RequestSpan::labelCurrent(command->name.data());
+    const vector<string>& args = request.args;
+    if (args.size() < command->minArgs || args.size() > command->maxArgs) {
+        response.items.push_back(string(command->synopsis));
+        return response;
+    }
+    // Optional params not given stay empty
+    string_view params[kMaxTokens];
+    for (size_t i = 0; i < args.size(); i++) params[i] = args[i];
+    parse.end();
+    ItemOutput output(response.items);
+    try {
+        command->run(fs, session, params, output);
+    } catch (const invalid_argument& e) {
+        response.items.assign(1, e.what());
+        return response;
+    }
+    response.status = Status::Ok;
+    return response;
+}
+
+}  // namespace fsproto
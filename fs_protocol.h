@@ -0,0 +1,89 @@
+#ifndef FS_PROTOCOL_H
+#define FS_PROTOCOL_H
+
+#include <cstdint>
+
+#include "fs_impl.h"
+
+using namespace std;
+
+/* Binary protocol of the server
+   A client opts in by sending the 4 byte magic kBinaryMagic right after connecting; text
+   commands never start with a NUL byte. Then both sides exchange length prefixed frames,
+   all integers are little endian:
+
+   request:  u32 frame length (excluding itself) | u32 id | u8 op | u8 argc | args
+   response: u32 frame length (excluding itself) | u32 id | u8 status | u32 count | items
+   arg/item: u32 length | bytes
+
+   Args and items are binary safe, e.g. the content of write can hold spaces or newlines.
+   Items of a response are the output lines of the command: one for cat and pwd, one per
+   entry for ls and find, none for write functions. An error response has one item, the
+   error message.
+
+   Clients can pipeline any number of requests without waiting. Requests run concurrently
+   and responses come back as they finish, possibly out of order: match them by id. cd is
+   the exception: it runs once the requests before it finished, and the ones after it start
+   once it finished, so relative paths resolve against the directory the client is in at
+   that point of the pipeline. A client relying on the effect of any other request must wait
+   for its response first.
+*/
+namespace fsproto {
+
+const char kBinaryMagic[4] = {'\0', 'F', 'S', 'B'};
+// Connections sending a bigger frame are closed
+const uint32_t kMaxFrameLength = 64 << 20;
+
+enum class Op : uint8_t {
+    Cd = 1,
+    Pwd = 2,
+    Ls = 3,
+    Find = 4,
+    Cat = 5,
+    Mkdir = 6,
+    Rm = 7,
+    Touch = 8,
+    Write = 9,
+    Mv = 10,
+    Snapshot = 11,
+    Cp = 12,
+    Stats = 13,
+    Memory = 14,
+    Du = 15,
+    Quota = 16,
+    Spans = 17,
+    Slowlog = 18,
+    Diff = 19,
+};
+
+enum class Status : uint8_t {
+    Ok = 0,
+    Error = 1,
+};
+
+struct Request {
+    uint32_t id;
+    Op op;
+    vector<string> args;
+};
+
+struct Response {
+    uint32_t id;
+    Status status;
+    vector<string> items;
+};
+
+// Append the encoded frame to out
+void encodeRequest(const Request& request, string& out);
+void encodeResponse(const Response& response, string& out);
+
+// Decode the frame at the start of data. Return the number of bytes consumed, or 0 if data
+// doesn't hold a complete frame yet. Throw invalid_argument for malformed frames.
+size_t decodeRequest(const char* data, size_t size, Request& request);
+size_t decodeResponse(const char* data, size_t size, Response& response);
+
+// Run the request on the session. Errors are returned as error responses.
+Response execute(FileSystem& fs, FileSystem::Session& session, const Request& request);
+
+}  // namespace fsproto
+#endif
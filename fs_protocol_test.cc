@@ -0,0 +1,112 @@
+#include "fs_protocol.h"
+#include "fs_shm.h"
+
+#include "gtest/gtest.h"
+
+/* Test the binary protocol codec and request execution */
+namespace {
+
+using namespace fsproto;
+
+// Tests frames survive encoding, including binary args, and are only decoded once complete
+TEST(FsProtocol, TestRoundTrip) {
+    Request request = {7, Op::Write, {"/a/f", string("with space\nand \0 byte", 21)}};
+    string frame;
+    encodeRequest(request, frame);
+
+    Request decoded;
+    for (size_t len = 0; len < frame.size(); len++) {
+        EXPECT_EQ(0, decodeRequest(frame.data(), len, decoded));
+    }
+    EXPECT_EQ(frame.size(), decodeRequest(frame.data(), frame.size(), decoded));
+    EXPECT_EQ(7, decoded.id);
+    EXPECT_EQ(Op::Write, decoded.op);
+    EXPECT_EQ(request.args, decoded.args);
+
+    Response response = {9, Status::Ok, {"a", "", "c"}};
+    string frames;
+    encodeResponse(response, frames);
+    encodeResponse({10, Status::Error, {"File not found: x"}}, frames);
+    Response first, second;
+    size_t len = decodeResponse(frames.data(), frames.size(), first);
+    EXPECT_EQ(frames.size(), len + decodeResponse(frames.data() + len, frames.size() - len, second));
+    EXPECT_EQ(9, first.id);
+    EXPECT_EQ(response.items, first.items);
+    EXPECT_EQ(10, second.id);
+    EXPECT_EQ(Status::Error, second.status);
+}
+
+// Tests malformed frames are rejected
+TEST(FsProtocol, TestMalformedFrame) {
+    string frame;
+    encodeRequest({1, Op::Cat, {"file"}}, frame);
+    // Claim an arg longer than the frame
+    frame[10] = 100;
+    Request request;
+    try {
+        decodeRequest(frame.data(), frame.size(), request);
+        FAIL() << "Expected exception because the arg is truncated";
+    }
+    catch (invalid_argument const & err) {
+        EXPECT_EQ(err.what(), string("Truncated frame"));
+    }
+}
+
+// Tests executing requests, with file content that the text protocol can't express
+TEST(FsProtocol, TestExecute) {
+    FileSystem fs;
+    FileSystem::Session session(fs);
+    EXPECT_EQ(Status::Ok, execute(fs, session, {1, Op::Mkdir, {"/a"}}).status);
+    EXPECT_EQ(Status::Ok, execute(fs, session, {2, Op::Cd, {"a"}}).status);
+    EXPECT_EQ(Status::Ok, execute(fs, session, {3, Op::Touch, {"f"}}).status);
+    EXPECT_EQ(Status::Ok, execute(fs, session, {4, Op::Write, {"f", "two words\n"}}).status);
+
+    Response response = execute(fs, session, {5, Op::Cat, {"/a/f"}});
+    EXPECT_EQ(5, response.id);
+    EXPECT_EQ(vector<string>{"two words\n"}, response.items);
+    response = execute(fs, session, {6, Op::Ls, {}});
+    EXPECT_EQ(vector<string>{"f"}, response.items);
+
+    response = execute(fs, session, {7, Op::Cat, {"g"}});
+    EXPECT_EQ(Status::Error, response.status);
+    EXPECT_EQ(vector<string>{"File not found: g"}, response.items);
+    response = execute(fs, session, {8, Op::Mv, {"f"}});
+    EXPECT_EQ(Status::Error, response.status);
+    EXPECT_EQ(vector<string>{"SYNOPSIS: mv [source_file_name] [dest_file_name]"}, response.items);
+    response = execute(fs, session, {9, Op(0), {}});
+    EXPECT_EQ(Status::Error, response.status);
+    EXPECT_EQ(vector<string>{"Bad request: op 0"}, response.items);
+}
+
+// Tests the shared memory ring keeps bytes in order while wrapping around, and never overfills
+TEST(FsProtocol, TestShmRingWraps) {
+    ShmRing ring = {};
+    char data[16];
+    string received;
+    EXPECT_EQ(10, ring.write(data, sizeof(data), "0123456789", 10));
+    EXPECT_EQ(6, ring.write(data, sizeof(data), "abcdefgh", 8));
+    EXPECT_EQ(0, ring.write(data, sizeof(data), "x", 1));
+    EXPECT_EQ(16, ring.read(data, sizeof(data), received));
+    EXPECT_TRUE(ring.empty());
+    EXPECT_EQ(8, ring.write(data, sizeof(data), "ghijklmn", 8));
+    EXPECT_EQ(8, ring.read(data, sizeof(data), received));
+    EXPECT_EQ("0123456789abcdefghijklmn", received);
+    EXPECT_EQ(0, ring.read(data, sizeof(data), received));
+}
+
+// Tests positions the other process corrupted are rejected before any copy
+TEST(FsProtocol, TestShmRingCorrupt) {
+    ShmRing ring = {};
+    char data[16];
+    string received;
+    ring.tail.store(17);
+    EXPECT_THROW(ring.read(data, sizeof(data), received), invalid_argument);
+    EXPECT_THROW(ring.write(data, sizeof(data), "x", 1), invalid_argument);
+    ring.tail.store(0);
+    ring.head.store(5);
+    EXPECT_THROW(ring.read(data, sizeof(data), received), invalid_argument);
+    EXPECT_THROW(ring.write(data, sizeof(data), "x", 1), invalid_argument);
+    EXPECT_TRUE(received.empty());
+}
+
+}  // namespace
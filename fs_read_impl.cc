@@ -1,5 +1,9 @@
 #include "fs_impl.h"
 
+#include <algorithm>
+
+#include "fs_stats.h"
+
 using namespace std;
 
 /* Implementation of functions in this file does not mutate nodes during traversal */
@@ -8,25 +12,35 @@ using namespace std;
 // If the working directory is already at root, changing directory to parent is a no op.
 // Return Error if directory doesn't exist or given input is a file.
 // TODO(mianl): Implement with absolute vs relative path extension
-void FileSystem::cd(string path) {
+void FileSystem::cd(Session& session, string path) try {
+    OpTimer timer(FsOp::Cd, session.id, &path);
+    shared_lock<shared_mutex> lock = readLock();
+    File* currDir = session.currDir;
     if (path == "../") {
-        if (currDir->parent) currDir = currDir->parent;
+        if (currDir->parent) setCurrDir(session, currDir->parent);
         return;
     }
     File* traverse = currDir;
+    countNodes();
+    loadChildren(traverse);
     if (traverse->children.find(path) == traverse->children.end()) {
         throw invalid_argument("Directory not found: " + path);
     } else {
-        if (traverse->children[path]->isDir) currDir = traverse->children[path];
+        if (traverse->children[path]->isDir) setCurrDir(session, traverse->children[path]);
         else  {
             throw invalid_argument("Not a directory: " + path);
         }
     }
+} catch (const invalid_argument& e) {
+    countError(FsOp::Cd, e);
+    throw;
 }
 
 // Get the current working directory. Returns the current working directory's path from the root.
-string FileSystem::pwd() {
-    return currDir->name;
+string FileSystem::pwd(Session& session) {
+    OpTimer timer(FsOp::Pwd, session.id);
+    shared_lock<shared_mutex> lock = readLock();
+    return session.currDir.load()->name;
 }
 
 // Get the directory contents: Returns the children of the current working directory.
@@ -36,63 +50,60 @@ string FileSystem::pwd() {
 // 2. if path param doesn't start with "/", traversal starts from the working directory
 // 3. if path points to a file, list the filename
 // 4. O(n+m) for n subdirs and m files
-vector<string> FileSystem::ls(string path) {
+vector<string> FileSystem::ls(Session& session, string path) try {
+    OpTimer timer(FsOp::Ls, session.id, &path);
+    shared_lock<shared_mutex> lock = readLock();
     vector<string> files;
-    File* traverse = currDir;
-    int i = 0;
+    NodeRef traverse{session.currDir, nullptr, true};
     if (path != ".") {
         vector<string> subdirs = split(path, '/');
-        if (subdirs[0] == "") {
-            traverse = root;
-            i = 1;
-        }
-        for (; i < subdirs.size(); i++) {
-            string subdir = subdirs[i];
-            if (subdir == "..") {
-                if (traverse->parent) {
-                    traverse = traverse->parent;
-                    continue;
-                } else {
-                    throw invalid_argument("Invalid path: " + path);
-                }
-            }
-
-            if (traverse->children.find(subdir) == traverse->children.end()) {
-                throw invalid_argument("No such file or directory: " + path);
-            }
-            traverse = traverse->children[subdir];
-        }
-
-        if (!traverse->isDir) {
+        if (subdirs.empty()) throw invalid_argument("Invalid path: " + path);
+        if (!resolve(session, subdirs, path, traverse)) throw invalid_argument("No such file or directory: " + path);
+        if (!traverse.isDir()) {
             files.push_back(subdirs.back());
             return files;
         }
     }
-    // c++ map is a treemap: keys should be sorted and the returned file list will be in alphabetic order.
-    for (auto iter = traverse->children.begin(); iter != traverse->children.end(); iter++) {
-        files.push_back(iter->first);
-    }
+    // Children come sorted (c++ map is a treemap, and images keep that order): the returned
+    // file list will be in alphabetic order.
+    forChildren(traverse, [&files](string_view name, const NodeRef&) { files.emplace_back(name); });
+    countNodes(files.size());
     return files;
+} catch (const invalid_argument& e) {
+    countError(FsOp::Ls, e);
+    throw;
 }
 
 // Find a file/directory: Given a filename, find all the files and directories within the current
 // working directory that have exactly that name.
 // Implemented with BFS and return a list of absolute paths in sorted order (empty if nothing is found).
-vector<string> FileSystem::find(string filename) {
+vector<string> FileSystem::find(Session& session, string filename) try {
+    OpTimer timer(FsOp::Find, session.id, &filename);
+    shared_lock<shared_mutex> lock = readLock();
     vector<string> files;
-    queue<File*> q;
-    q.push(currDir);
+    // Nodes read in place have no name here: their path is built from their parent's
+    queue<pair<NodeRef, string>> q;
+    q.push({NodeRef{session.currDir, nullptr, true}, ""});
     while (!q.empty()) {
-        File* traverse = q.front();
+        NodeRef traverse = q.front().first;
+        string path = move(q.front().second);
         q.pop();
-        if (traverse->children.find(filename) != traverse->children.end()) {
-            files.push_back(traverse->children[filename]->name);
-        }
-        for (auto iter = traverse->children.begin(); iter != traverse->children.end(); iter++) {
-            q.push(iter->second);
-        }
+        countNodes();
+        if (!traverse.isDir()) continue;
+        const string& dirPath = traverse.own ? traverse.file->name : path;
+        forChildren(traverse, [&](string_view name, const NodeRef& child) {
+            string childPath;
+            if (!child.own && (child.isDir() || name == filename)) {
+                childPath = dirPath + string(name) + (child.isDir() ? "/" : "");
+            }
+            if (name == filename) files.push_back(child.own ? child.file->name : childPath);
+            q.push({child, move(childPath)});
+        });
     }
     return files;
+} catch (const invalid_argument& e) {
+    countError(FsOp::Find, e);
+    throw;
 }
 
 // Get file contents: Returns the content of a file in the current working directory.
@@ -100,33 +111,401 @@ vector<string> FileSystem::find(string filename) {
 // 1. if path param starts with "/", traversal starts from root
 // 2. if path param doesn't start with "/", traversal starts from the working directory
 // 3. O(n) for n subdirs
-string FileSystem::cat(string path) {
-    File* traverse = currDir;
+string FileSystem::cat(Session& session, string path) try {
+    OpTimer timer(FsOp::Cat, session.id, &path);
+    shared_lock<shared_mutex> lock = readLock();
+    vector<string> subdirs = split(path, '/');
+    if (subdirs.empty()) throw invalid_argument("Invalid path: " + path);
+    NodeRef traverse;
+    if (!resolve(session, subdirs, path, traverse)) throw invalid_argument("File not found: " + path);
+    if (!traverse.isDir()) {
+        string_view content = contentOf(traverse);
+        countBytes(content.size());
+        return string(content);
+    }
+    throw invalid_argument("Not a file: " + path);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Cat, e);
+    throw;
+}
+
+// Get the memory a subtree takes: kept in every node for its subtree, so only the walk to
+// path costs. Nodes read in place take no memory of this tree. Return Error if path doesn't
+// exist.
+MemoryUsage FileSystem::memoryUsage(Session& session, string path) {
+    shared_lock<shared_mutex> lock = readLock();
+    NodeRef node{session.currDir, nullptr, true};
+    if (path != "." && !resolve(session, split(path, '/'), path, node)) {
+        throw invalid_argument("No such file or directory: " + path);
+    }
+    return node.own ? node.file->usage.load() : MemoryUsage();
+}
+
+// Get the files, directories and content bytes under path: kept in every node for its
+// subtree, like memory. Return Error if path doesn't exist.
+DiskUsage FileSystem::du(Session& session, string path) {
+    shared_lock<shared_mutex> lock = readLock();
+    NodeRef node{session.currDir, nullptr, true};
+    if (path != "." && !resolve(session, split(path, '/'), path, node)) {
+        throw invalid_argument("No such file or directory: " + path);
+    }
+    DiskUsage usage = node.diskUsage();
+    if (node.isDir()) usage.dirs--;
+    return usage;
+}
+
+// Quotas are set on directories of this tree only.
+QuotaLimits FileSystem::quota(Session& session, string path) {
+    shared_lock<shared_mutex> lock = readLock();
+    NodeRef node{session.currDir, nullptr, true};
+    if (path != "." && !resolve(session, split(path, '/'), path, node)) {
+        throw invalid_argument("No such file or directory: " + path);
+    }
+    if (!node.isDir()) throw invalid_argument("Not a directory: " + path);
+    File* dir = node.file;
+    return node.own && dir->quota && dir->quota->dir == dir ? dir->quota->limits : QuotaLimits();
+}
+
+// Walk path from the working directory (or from root if it starts with "/"), the way write
+// does. Used by commands taking paths for both params.
+FileSystem::File* FileSystem::lookup(Session& session, const string& path) {
+    Span resolve(SpanPhase::Resolve);
+    File* traverse = session.currDir;
     int i = 0;
     vector<string> subdirs = split(path, '/');
-    if (subdirs[0] == "") {
+    if (!subdirs.empty() && subdirs[0] == "") {
         traverse = root;
         i = 1;
     }
     for (; i < subdirs.size(); i++) {
-        string subdir = subdirs[i];
-        if (subdir == "..") {
-            if (traverse->parent) {
-                traverse = traverse->parent;
-                continue;
+        if (subdirs[i] == "..") {
+            if (!traverse->parent) throw invalid_argument("Invalid path: " + path);
+            traverse = traverse->parent;
+            continue;
+        }
+        loadChildren(traverse);
+        auto iter = traverse->children.find(subdirs[i]);
+        if (iter == traverse->children.end()) return nullptr;
+        traverse = iter->second;
+        countNodes();
+    }
+    return traverse;
+}
+
+// Walk the path split in subdirs like lookup(), through forChildren. ".." goes back the way
+// the walk came, so nodes read in place need no parent.
+bool FileSystem::resolve(Session& session, const vector<string>& subdirs, const string& path, NodeRef& node) {
+    Span resolve(SpanPhase::Resolve);
+    vector<NodeRef> walked{NodeRef{session.currDir, nullptr, true}};
+    int i = 0;
+    if (!subdirs.empty() && subdirs[0] == "") {
+        walked.back().file = root;
+        i = 1;
+    }
+    for (; i < subdirs.size(); i++) {
+        if (subdirs[i] == "..") {
+            if (walked.size() > 1) {
+                walked.pop_back();
             } else {
-                throw invalid_argument("Invalid path: " + path);
+                File* parent = walked.back().file->parent;
+                if (!parent) throw invalid_argument("Invalid path: " + path);
+                walked.back().file = parent;
             }
+            continue;
         }
+        NodeRef child;
+        if (!childOf(walked.back(), subdirs[i], child)) return false;
+        walked.push_back(child);
+        countNodes();
+    }
+    node = walked.back();
+    return true;
+}
 
-        if (traverse->children.find(subdir) == traverse->children.end()) {
-            throw invalid_argument("File not found: " + path);
+// Find a directory by its absolute path, as stored in its node (e.g. "/a/b/").
+// Used to replay logged ops: the directory must exist.
+FileSystem::File* FileSystem::findDir(const string& path) {
+    Span resolve(SpanPhase::Resolve);
+    File* traverse = root;
+    vector<string> subdirs = split(path, '/');
+    for (int i = 1; i < subdirs.size(); i++) {
+        loadChildren(traverse);
+        auto iter = traverse->children.find(subdirs[i]);
+        if (iter == traverse->children.end() || !iter->second->isDir) {
+            throw runtime_error("Log doesn't match the tree, no directory: " + path);
         }
-        traverse = traverse->children[subdir];
+        traverse = iter->second;
+        countNodes();
     }
+    return traverse;
+}
 
-    if (!traverse->isDir) return traverse->content;
-    throw invalid_argument("Not a file: " + path);
+/************************ diff functions ************************/
+
+// Walk both trees from root in step, descending only into directories whose hashes differ.
+// Directories of either tree not visited yet are loaded, under each tree's shared lock.
+vector<string> FileSystem::diff(FileSystem& from, FileSystem& to) {
+    if (&from == &to) return {};
+    shared_lock<shared_mutex> fromLock(from.treeLock);
+    shared_lock<shared_mutex> toLock(to.treeLock);
+    // Changed paths, with their line
+    vector<pair<string, string>> changes;
+    stack<pair<File*, File*>> s;
+    s.push({from.root, to.root});
+    while (!s.empty()) {
+        File* oldDir = s.top().first;
+        File* newDir = s.top().second;
+        s.pop();
+        if (oldDir->hash == newDir->hash) continue;
+        from.loadChildren(oldDir);
+        to.loadChildren(newDir);
+
+        auto oldIter = oldDir->children.begin();
+        auto newIter = newDir->children.begin();
+        while (oldIter != oldDir->children.end() || newIter != newDir->children.end()) {
+            if (newIter == newDir->children.end() || (oldIter != oldDir->children.end() && oldIter->first < newIter->first)) {
+                changes.push_back({oldIter->second->name, "- " + oldIter->second->name});
+                oldIter++;
+            } else if (oldIter == oldDir->children.end() || newIter->first < oldIter->first) {
+                changes.push_back({newIter->second->name, "+ " + newIter->second->name});
+                newIter++;
+            } else {
+                File* oldChild = oldIter->second;
+                File* newChild = newIter->second;
+                if (oldChild->isDir != newChild->isDir) {
+                    changes.push_back({oldChild->name, "- " + oldChild->name});
+                    changes.push_back({newChild->name, "+ " + newChild->name});
+                } else if (oldChild->hash != newChild->hash) {
+                    if (oldChild->isDir) s.push({oldChild, newChild});
+                    else changes.push_back({newChild->name, "M " + newChild->name});
+                }
+                oldIter++;
+                newIter++;
+            }
+        }
+    }
+    stable_sort(changes.begin(), changes.end(),
+                [](const pair<string, string>& a, const pair<string, string>& b) { return a.first < b.first; });
+    vector<string> lines;
+    for (auto& change : changes) lines.push_back(change.second);
+    return lines;
+}
+
+/************************ checkpoint functions ******************/
+
+// Write an image of the tree to fd, consistent with the log: the image holds exactly the
+// records up to the returned lsn (0 without a log). The lsn is read, and the log rotated,
+// under the tree lock, which is held for the fork of the child writing the image only:
+// writers wait for the fork, not for the image. Parts of the tree not visited since it was
+// loaded are copied from the old image as they are, without going through the heap.
+uint64_t FileSystem::save(int fd, bool rotate) {
+    shared_lock<shared_mutex> lock = readLock();
+    uint64_t lsn = !wal ? 0 : rotate ? wal->rotate() : wal->lsn();
+    // Readers copy children to the heap under the shared lock: the child must not get a
+    // directory they are halfway through
+    unique_lock<mutex> loading(loadLock);
+    ForkedWrite writer(fd, [this, lsn](int fd, BackgroundSnapshot::Progress& progress) {
+        writeImage(fd, lsn, &progress);
+    });
+    loading.unlock();
+    lock.unlock();
+    writer.wait();
+    return lsn;
+}
+
+// The image of the tree as of the last logged mutation: the lsn is read under the tree lock,
+// which every logged mutation holds. The tree is forked while that lock is held, so writers
+// wait for the fork only, not for the image. Like save(), the fork waits for readers copying
+// children.
+void FileSystem::snapshot(const string& path) {
+    shared_lock<shared_mutex> lock = readLock();
+    uint64_t lsn = wal ? wal->lsn() : 0;
+    lock_guard<mutex> loading(loadLock);
+    background.start(path, [this, lsn](int fd, BackgroundSnapshot::Progress& progress) {
+        writeImage(fd, lsn, &progress);
+    });
+}
+
+void FileSystem::writeImage(int fd, uint64_t lsn, BackgroundSnapshot::Progress* progress) {
+    // A node to write: on the heap, or only in the mapped image
+    using Node = NodeRef;
+    // Call visit(name, child) for the children of a directory, in name order. Runs in the
+    // forked child, which never loads: the fork waited for loads under way (see save()).
+    auto forChildren = [this](const Node& dir, auto&& visit) {
+        const ImageNode* node = dir.imageNode;
+        File* source = dir.file ? listingOf(dir.file, node) : nullptr;
+        if (!node) {
+            for (auto iter = source->children.begin(); iter != source->children.end(); iter++) {
+                visit(string_view(iter->first), Node{iter->second, nullptr, true});
+            }
+            return;
+        }
+        const ImageNode* children = image->children(node);
+        for (uint64_t i = 0; i < node->size; i++) visit(image->name(children + i), Node{nullptr, children + i, true});
+    };
+
+    uint64_t nodeCount = 0;
+    stack<Node> s;
+    s.push(Node{root, nullptr, true});
+    while (!s.empty()) {
+        Node node = s.top();
+        s.pop();
+        nodeCount++;
+        if (node.isDir()) forChildren(node, [&s](string_view, const Node& child) { s.push(child); });
+    }
+    if (progress) progress->total = nodeCount;
+
+    // Breadth first, so the children of every directory are contiguous
+    ImageWriter writer(fd, nodeCount);
+    queue<pair<string_view, Node>> q;
+    q.push({"", Node{root, nullptr, true}});
+    while (!q.empty()) {
+        string_view name = q.front().first;
+        Node node = q.front().second;
+        q.pop();
+        if (progress) progress->done.fetch_add(1, memory_order_relaxed);
+        if (!node.isDir()) {
+            writer.addFile(name, node.file ? contentOf(node.file) : image->content(node.imageNode), node.hash());
+            continue;
+        }
+        uint64_t childCount = 0;
+        forChildren(node, [&](string_view childName, const Node& child) {
+            q.push({childName, child});
+            childCount++;
+        });
+        DiskUsage usage = node.diskUsage();
+        writer.addDir(name, childCount, node.hash(), usage.files, usage.dirs, usage.bytes);
+    }
+    writer.finish(lsn);
 }
 
+// Where the children of dir are: in the image node set in node, or in the children of the
+// returned directory. That's dir itself once loaded, or a directory of a lower tree.
+FileSystem::File* FileSystem::listingOf(File* dir, const ImageNode*& node) {
+    while (true) {
+        node = dir->backing.load(memory_order_acquire);
+        File* lower = dir->lower.load(memory_order_acquire);
+        if (node || !lower) return dir;
+        dir = lower;
+    }
+}
+
+// Copy the children of a directory loaded from an image, or of an overlay directory, to the
+// heap on the first write below it (or first visit by readers, for the tree's own image).
+// Readers holding the tree lock shared may visit the same directory concurrently.
+void FileSystem::loadChildren(File* dir) {
+    if (!dir->isDir) return;
+    if (!dir->backing.load(memory_order_acquire) && !dir->lower.load(memory_order_acquire)) return;
+    lock_guard<mutex> lock(loadLock);
+    const ImageNode* node;
+    File* source = listingOf(dir, node);
+    if (source == dir && !node) return;
+
+    map<string, File*> children;
+    try {
+        if (node) {
+            const ImageNode* first = image->children(node);
+            for (uint64_t i = 0; i < node->size; i++) {
+                const ImageNode* child = first + i;
+                // Names were checked when the image was opened
+                string name(image->name(child));
+                File* file = new File();
+                file->isDir = child->isDir;
+                file->parent = dir;
+                file->name = dir->name + name + (file->isDir ? "/" : "");
+                file->backing = child;
+                file->hash = child->hash;
+                if (file->isDir) file->quota = dir->quota;
+                file->usage.store(ownUsage(file));
+                file->diskUsage.files = child->files;
+                file->diskUsage.dirs = child->dirs;
+                file->diskUsage.bytes = child->bytes;
+                children.emplace_hint(children.end(), name, file);
+            }
+        } else {
+            // The lower tree doesn't change: its loaded directories can be read without its lock
+            for (auto iter = source->children.begin(); iter != source->children.end(); iter++) {
+                File* child = iter->second;
+                File* file = new File();
+                file->isDir = child->isDir;
+                file->parent = dir;
+                file->name = dir->name + iter->first + (file->isDir ? "/" : "");
+                file->content = child->content;
+                file->hash = child->hash;
+                if (file->isDir) file->quota = dir->quota;
+                file->backing = child->backing.load(memory_order_acquire);
+                if (file->isDir && !file->backing) file->lower = child;
+                file->usage.store(ownUsage(file));
+                file->diskUsage = child->diskUsage;
+                children.emplace_hint(children.end(), iter->first, file);
+            }
+        }
+    } catch (...) {
+        for (auto iter = children.begin(); iter != children.end(); iter++) delete iter->second;
+        throw;
+    }
+    MemoryUsage added;
+    for (auto iter = children.begin(); iter != children.end(); iter++) added += iter->second->usage.load();
+    dir->children.swap(children);
+    addUsage(dir, added);
+    dir->backing.store(nullptr, memory_order_release);
+    dir->lower.store(nullptr, memory_order_release);
+}
+
+string_view FileSystem::contentOf(File* file) {
+    const ImageNode* node = file->backing.load(memory_order_relaxed);
+    if (node) return image->content(node);
+    return file->content ? string_view(*file->content) : string_view();
+}
 
+string_view FileSystem::contentOf(const NodeRef& file) {
+    return file.file ? contentOf(file.file) : image->content(file.imageNode);
+}
+
+// Where readers find the children of dir: like listingOf(), after loading a directory of the
+// tree's own image
+FileSystem::File* FileSystem::readListing(const NodeRef& dir, const ImageNode*& node) {
+    node = dir.imageNode;
+    if (!dir.file) return nullptr;
+    if (dir.own && !sharedImage) loadChildren(dir.file);
+    return listingOf(dir.file, node);
+}
+
+// The children of a lower directory or of an image node aren't of this tree, even when
+// reached from one of its directories.
+template <class Visit>
+void FileSystem::forChildren(const NodeRef& dir, Visit&& visit) {
+    const ImageNode* node;
+    File* source = readListing(dir, node);
+    if (node) {
+        const ImageNode* children = image->children(node);
+        for (uint64_t i = 0; i < node->size; i++) visit(image->name(children + i), NodeRef{nullptr, children + i, false});
+        return;
+    }
+    bool own = dir.own && source == dir.file;
+    for (auto iter = source->children.begin(); iter != source->children.end(); iter++) {
+        visit(string_view(iter->first), NodeRef{iter->second, nullptr, own});
+    }
+}
+
+// Child of dir named name, found like forChildren lists it: false if there's none. Image
+// children are sorted by name, so it's a binary search.
+bool FileSystem::childOf(const NodeRef& dir, const string& name, NodeRef& child) {
+    if (!dir.isDir()) return false;
+    const ImageNode* node;
+    File* source = readListing(dir, node);
+    if (node) {
+        const ImageNode* first = image->children(node);
+        const ImageNode* last = first + node->size;
+        const ImageNode* found = lower_bound(first, last, name, [this](const ImageNode& entry, const string& name) {
+            return image->name(&entry) < name;
+        });
+        if (found == last || image->name(found) != name) return false;
+        child = NodeRef{nullptr, found, false};
+        return true;
+    }
+    auto iter = source->children.find(name);
+    if (iter == source->children.end()) return false;
+    child = NodeRef{iter->second, nullptr, dir.own && source == dir.file};
+    return true;
+}
@@ -0,0 +1,94 @@
+#include <fstream>
+
+#include "fs_generator.h"
+#include "fs_impl.h"
+#include "fs_trace.h"
+
+using namespace std;
+
+namespace {
+
+void usage() {
+    cout << "SYNOPSIS: fs_replay trace_path|- [--image path | --nodes n [--seed n]] [--original-timing] [--out file]" << endl;
+    cout << "   Runs the commands of a trace recorded by fs_service --record again, on an empty FS, on one" << endl;
+    cout << "   loaded from an image, or on a generated tree of n nodes (see fs_generator.h)." << endl;
+    cout << "   Commands run as fast as possible, or with --original-timing as far apart as they started in the trace." << endl;
+    cout << "   Prints JSON with throughput and latency percentiles, overall and by command, to stdout or to --out." << endl;
+    cout << "   Commands writing host files (snapshot, spans dump) fail." << endl;
+}
+
+}  // namespace
+
+/* Replays workload traces, e.g. to reproduce an incident or a regression locally
+   The commands of all traced sessions run one at a time in the order they started, each
+   on a session of its own per traced session. Commands whose outcome or result size differ
+   from the trace are counted as diverged: the FS didn't start in the same state.
+*/
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage();
+        return 1;
+    }
+    string tracePath = argv[1];
+    string imagePath;
+    string outPath;
+    bool originalTiming = false;
+    TreeShape shape;
+    shape.nodeCount = 0;
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--original-timing") {
+            originalTiming = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        string value = argv[++i];
+        if (option == "--image") imagePath = value;
+        else if (option == "--nodes") shape.nodeCount = strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--seed") shape.seed = strtoull(value.c_str(), nullptr, 10);
+        else if (option == "--out") outPath = value;
+        else {
+            usage();
+            return 1;
+        }
+    }
+    if (!imagePath.empty() && shape.nodeCount > 0) {
+        usage();
+        return 1;
+    }
+
+    FileSystem fs;
+    ReplayReport report;
+    try {
+        if (!imagePath.empty()) fs.load(imagePath);
+        if (shape.nodeCount > 0) generateTree(fs, shape);
+        if (tracePath == "-") {
+            report = replayTrace(fs, cin, originalTiming);
+        } else {
+            ifstream trace(tracePath);
+            if (!trace) {
+                cout << "Cannot open trace: " << tracePath << endl;
+                return 1;
+            }
+            report = replayTrace(fs, trace, originalTiming);
+        }
+    } catch (const exception& e) {
+        cout << e.what() << endl;
+        return 1;
+    }
+
+    if (outPath.empty()) {
+        printReplayReport(cout, report);
+    } else {
+        ofstream out(outPath);
+        printReplayReport(out, report);
+        if (!out) {
+            cout << "Cannot write " << outPath << endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,340 @@
+#include "fs_replication.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <stdexcept>
+
+#include "fs_util.h"
+
+using namespace std;
+
+namespace {
+
+const char kMagic[8] = {'F', 'S', 'R', 'E', 'P', 'L', '1', '\0'};
+// Frame header: type and payload size
+const size_t kFrameHeaderSize = 9;
+const char kRecords = 'R';
+const char kImage = 'I';
+// Bytes of an image copied at a time
+const size_t kChunk = 1 << 20;
+// Wait before accepting again after accept fails, e.g. out of fds
+const chrono::milliseconds kAcceptBackoff(100);
+// How often a sender waiting for records checks its follower is still there
+const chrono::seconds kIdleCheck(1);
+
+runtime_error systemError(const string& what) {
+    return runtime_error(what + ": " + strerror(errno));
+}
+
+void writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) throw systemError("Replication send");
+        data += n;
+        size -= n;
+    }
+}
+
+// Whether the peer closed the connection, without waiting. Followers send nothing after
+// their hello, so anything else is an error too.
+bool peerGone(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Return false if the peer closed the connection first
+bool readAll(int fd, char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::read(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw systemError("Replication receive");
+        if (n == 0) return false;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+string frameHeader(char type, uint64_t size) {
+    string header(1, type);
+    putU64(header, size);
+    return header;
+}
+
+sockaddr_un unixAddress(const string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw invalid_argument("Socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+// An unlinked temporary file, for images on their way in or out
+int tempFile() {
+    const char* dir = getenv("TMPDIR");
+    string path = string(dir ? dir : "/tmp") + "/fs_replication.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) throw systemError("Cannot create " + path);
+    unlink(path.c_str());
+    return fd;
+}
+
+}  // namespace
+
+/************************ leader ********************************/
+
+ReplicationLeader::ReplicationLeader(FileSystem& fs, WriteAheadLog& wal, size_t maxTailBytes)
+        : fs(fs), wal(wal), tailLastLsn(wal.lsn()), maxTailBytes(maxTailBytes) {
+    wal.setTap([this](uint64_t lsn, const string& record) {
+        lock_guard<mutex> guard(lock);
+        tail.push_back(record);
+        tailLastLsn = lsn;
+        tailBytes += record.size();
+        while (tailBytes > this->maxTailBytes && !tail.empty()) {
+            tailBytes -= tail.front().size();
+            tail.pop_front();
+        }
+        appended.notify_all();
+    });
+}
+
+ReplicationLeader::~ReplicationLeader() {
+    wal.setTap(nullptr);
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        // Wake up senders blocked on their socket, and the acceptor
+        for (int fd : followerFds) shutdown(fd, SHUT_RDWR);
+        if (listenFd >= 0) shutdown(listenFd, SHUT_RDWR);
+    }
+    appended.notify_all();
+    if (acceptor.joinable()) acceptor.join();
+    {
+        unique_lock<mutex> guard(lock);
+        senderExited.wait(guard, [this]() { return senders.empty(); });
+        joinExited();
+    }
+    if (listenFd >= 0) close(listenFd);
+}
+
+void ReplicationLeader::listenUnix(const string& path) {
+    sockaddr_un addr = unixAddress(path);
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) throw systemError("socket");
+    unlink(path.c_str());
+    if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        runtime_error error = systemError("Cannot listen on " + path);
+        close(listenFd);
+        listenFd = -1;
+        throw error;
+    }
+    acceptor = thread([this]() { acceptLoop(); });
+}
+
+size_t ReplicationLeader::followers() {
+    lock_guard<mutex> guard(lock);
+    return senders.size();
+}
+
+void ReplicationLeader::acceptLoop() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        int error = errno;
+        unique_lock<mutex> guard(lock);
+        if (stopping) {
+            if (fd >= 0) close(fd);
+            return;
+        }
+        joinExited();
+        if (fd >= 0) {
+            followerFds.push_back(fd);
+            // The sender can't exit before it's assigned: it takes lock first
+            auto self = senders.emplace(senders.end());
+            *self = thread([this, fd, self]() { sendLoop(fd, self); });
+        } else if (error != EINTR && error != ECONNABORTED) {
+            // E.g. out of fds: wait for followers to go away instead of spinning
+            appended.wait_for(guard, kAcceptBackoff, [this]() { return stopping; });
+        }
+    }
+}
+
+void ReplicationLeader::joinExited() {
+    // Exited senders only have to return: joining them under lock is safe
+    for (thread& sender : exited) sender.join();
+    exited.clear();
+}
+
+// Send a follower the records after its lsn as they are appended, in batches of whatever
+// accumulated while the previous batch was sent.
+void ReplicationLeader::sendLoop(int fd, list<thread>::iterator self) {
+    try {
+        char hello[16];
+        if (readAll(fd, hello, sizeof(hello)) && memcmp(hello, kMagic, sizeof(kMagic)) == 0) {
+            uint64_t next = getU64(hello + 8) + 1;
+            string batch;
+            while (true) {
+                uint64_t last;
+                {
+                    unique_lock<mutex> guard(lock);
+                    auto ready = [&]() { return stopping || tailLastLsn >= next || next > tailLastLsn + 1; };
+                    while (!appended.wait_for(guard, kIdleCheck, ready)) {
+                        if (peerGone(fd)) throw runtime_error("Follower gone");
+                    }
+                    if (stopping) break;
+                    uint64_t first = tailLastLsn + 1 - tail.size();
+                    // Behind the records kept, or ahead of the leader (which lost records it
+                    // never made durable): start over from an image
+                    last = tailLastLsn;
+                    if (next < first || next > last + 1) {
+                        guard.unlock();
+                        next = sendImage(fd) + 1;
+                        continue;
+                    }
+                    batch.clear();
+                    for (uint64_t lsn = next; lsn <= last; lsn++) batch += tail[lsn - first];
+                }
+                wal.commit(last);
+                string header = frameHeader(kRecords, batch.size());
+                writeAll(fd, header.data(), header.size());
+                writeAll(fd, batch.data(), batch.size());
+                next = last + 1;
+            }
+        }
+    } catch (const exception&) {
+        // The follower went away: it reconnects
+    }
+    lock_guard<mutex> guard(lock);
+    for (auto iter = followerFds.begin(); iter != followerFds.end(); iter++) {
+        if (*iter == fd) {
+            followerFds.erase(iter);
+            break;
+        }
+    }
+    close(fd);
+    exited.push_back(move(*self));
+    senders.erase(self);
+    senderExited.notify_all();
+}
+
+// The image is written by a forked child without rotating the log (see FileSystem::save), so
+// leader writes go on meanwhile. It is sent once the records it holds are durable, like records.
+uint64_t ReplicationLeader::sendImage(int fd) {
+    int imageFd = tempFile();
+    try {
+        uint64_t lsn = fs.save(imageFd, false);
+        wal.commit(lsn);
+        struct stat st;
+        if (fstat(imageFd, &st) < 0) throw systemError("Cannot stat image");
+        string header = frameHeader(kImage, st.st_size);
+        writeAll(fd, header.data(), header.size());
+        off_t offset = 0;
+        while (offset < st.st_size) {
+            ssize_t n = sendfile(fd, imageFd, &offset, st.st_size - offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw systemError("Replication send");
+        }
+        close(imageFd);
+        return lsn;
+    } catch (...) {
+        close(imageFd);
+        throw;
+    }
+}
+
+/************************ follower ******************************/
+
+ReplicationFollower::ReplicationFollower(FileSystem& fs, const string& leaderPath, uint64_t lsn)
+        : fs(fs), leaderPath(leaderPath), session(fs), appliedLsn(lsn) {
+    receiver = thread([this]() { receiveLoop(); });
+}
+
+ReplicationFollower::~ReplicationFollower() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+        if (fd >= 0) shutdown(fd, SHUT_RDWR);
+    }
+    wake.notify_one();
+    receiver.join();
+}
+
+// Connect to the leader and follow it, and again every second whenever the connection
+// can't be made or ends
+void ReplicationFollower::receiveLoop() {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        int socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = unixAddress(leaderPath);
+        if (socketFd >= 0 && connect(socketFd, (sockaddr*) &addr, sizeof(addr)) == 0) {
+            fd = socketFd;
+            guard.unlock();
+            try {
+                follow(socketFd);
+            } catch (const exception& e) {
+                cerr << "Replication: " << e.what() << endl;
+            }
+            guard.lock();
+            fd = -1;
+        }
+        if (socketFd >= 0) close(socketFd);
+        wake.wait_for(guard, chrono::seconds(1), [this]() { return stopping; });
+    }
+}
+
+void ReplicationFollower::follow(int fd) {
+    string hello(kMagic, sizeof(kMagic));
+    putU64(hello, appliedLsn);
+    writeAll(fd, hello.data(), hello.size());
+
+    char header[kFrameHeaderSize];
+    string payload;
+    WalRecord record;
+    while (readAll(fd, header, sizeof(header))) {
+        uint64_t size = getU64(header + 1);
+        if (header[0] == kImage) {
+            // Copied to a file first: the tree maps its image
+            int imageFd = tempFile();
+            try {
+                string chunk;
+                for (uint64_t done = 0; done < size; done += chunk.size()) {
+                    chunk.resize(min<uint64_t>(kChunk, size - done));
+                    if (!readAll(fd, &chunk[0], chunk.size())) throw runtime_error("Leader closed the connection mid image");
+                    if (pwrite(imageFd, chunk.data(), chunk.size(), done) != ssize_t(chunk.size())) {
+                        throw systemError("Cannot write image");
+                    }
+                }
+                appliedLsn = fs.load("/proc/self/fd/" + to_string(imageFd));
+            } catch (...) {
+                close(imageFd);
+                throw;
+            }
+            close(imageFd);
+        } else if (header[0] == kRecords) {
+            payload.resize(size);
+            if (!readAll(fd, &payload[0], size)) return;
+            for (size_t pos = 0; pos < payload.size();) {
+                size_t recordSize = WriteAheadLog::decode(payload.data() + pos, payload.size() - pos, record);
+                if (recordSize == 0) throw runtime_error("Corrupt record from the leader");
+                if (record.lsn != appliedLsn + 1) {
+                    throw runtime_error("Expected lsn " + to_string(appliedLsn + 1) + " from the leader, got " + to_string(record.lsn));
+                }
+                fs.apply(session, record);
+                appliedLsn = record.lsn;
+                pos += recordSize;
+            }
+        } else {
+            throw runtime_error("Unknown frame from the leader");
+        }
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef FS_REPLICATION_H
+#define FS_REPLICATION_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fs_impl.h"
+#include "fs_wal.h"
+
+using namespace std;
+
+/* Replication of a FileSystem to follower processes over a unix domain socket
+   The leader streams the records of its write-ahead log to every follower, which applies
+   them to its own tree in lsn order and serves reads (see ClientMode::ReadOnly).
+
+   A follower connects and sends the 8 byte magic "FSREPL1\0" and the u64 lsn of the last
+   record it applied. The leader answers with frames: u8 type | u64 payload size | payload
+   - 'R': the next records, encoded as in the log (see fs_wal.h).
+   - 'I': an image of the whole tree (see fs_image.h), for a follower too far behind to
+     continue from the records the leader keeps in memory. Records after its lsn follow.
+   Records are sent once they are durable on the leader. A follower losing its leader
+   reconnects, and continues from the last record it applied.
+*/
+class ReplicationLeader {
+    FileSystem& fs;
+    WriteAheadLog& wal;
+
+    mutex lock;
+    // Wakes senders up when records are appended
+    condition_variable appended;
+    // The most recent records, encoded, and the lsn of the last one. The oldest records are
+    // dropped past maxTailBytes: followers still needing them get an image instead.
+    deque<string> tail;
+    uint64_t tailLastLsn;
+    size_t tailBytes = 0;
+    size_t maxTailBytes;
+    bool stopping = false;
+
+    int listenFd = -1;
+    thread acceptor;
+    // Sockets of the connected followers, and the threads sending to them. A sender moves
+    // its thread to exited when it's done, to be joined by the acceptor or on exit.
+    vector<int> followerFds;
+    list<thread> senders;
+    vector<thread> exited;
+    condition_variable senderExited;
+
+    void acceptLoop();
+    void sendLoop(int fd, list<thread>::iterator self);
+    // Join the senders done. Callers hold lock.
+    void joinExited();
+    // Send an image of the tree and return the lsn it holds the records up to
+    uint64_t sendImage(int fd);
+  public:
+    // Stream the records fs logs to wal from now on. The tree must be recovered already.
+    ReplicationLeader(FileSystem& fs, WriteAheadLog& wal, size_t maxTailBytes = 64 << 20);
+    ~ReplicationLeader();
+    ReplicationLeader(const ReplicationLeader&) = delete;
+    ReplicationLeader& operator=(const ReplicationLeader&) = delete;
+
+    // Accept followers on a unix domain socket. Throw runtime_error if it can't listen.
+    void listenUnix(const string& path);
+    // Number of followers connected
+    size_t followers();
+};
+
+class ReplicationFollower {
+    FileSystem& fs;
+    string leaderPath;
+    // Session the records are applied on
+    FileSystem::Session session;
+    atomic<uint64_t> appliedLsn;
+
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    // Connection to the leader, -1 while disconnected
+    int fd = -1;
+    thread receiver;
+
+    void receiveLoop();
+    // Apply what the leader sends until the connection ends
+    void follow(int fd);
+  public:
+    // Follow the leader listening at leaderPath in a background thread. fs holds the
+    // records up to lsn already (0: fs is empty).
+    ReplicationFollower(FileSystem& fs, const string& leaderPath, uint64_t lsn = 0);
+    ~ReplicationFollower();
+    ReplicationFollower(const ReplicationFollower&) = delete;
+    ReplicationFollower& operator=(const ReplicationFollower&) = delete;
+
+    // Lsn of the last record applied
+    uint64_t lsn() { return appliedLsn; }
+};
+#endif
@@ -0,0 +1,154 @@
+#include "fs_replication.h"
+
+#include <dirent.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+/* Test streaming the log of a leader to followers */
+namespace {
+
+void removeDir(const string& dir) {
+    DIR* d = opendir(dir.c_str());
+    while (dirent* entry = d ? readdir(d) : nullptr) {
+        if (entry->d_name[0] != '.') unlink((dir + "/" + entry->d_name).c_str());
+    }
+    if (d) closedir(d);
+    rmdir(dir.c_str());
+}
+
+// A FileSystem logging to a fresh log, streamed to followers on a socket
+struct Leader {
+    string dir = "/tmp/fs_replication_test." + to_string(getpid());
+    string socketPath = dir + ".sock";
+    FileSystem fs;
+    unique_ptr<WriteAheadLog> wal;
+    unique_ptr<ReplicationLeader> leader;
+
+    explicit Leader(size_t maxTailBytes = 64 << 20) {
+        removeDir(dir);
+        wal.reset(new WriteAheadLog(dir, Durability::GroupCommit));
+        fs.attachLog(wal.get());
+        leader.reset(new ReplicationLeader(fs, *wal, maxTailBytes));
+        leader->listenUnix(socketPath);
+    }
+    ~Leader() {
+        leader.reset();
+        fs.attachLog(nullptr);
+        wal.reset();
+        removeDir(dir);
+        unlink(socketPath.c_str());
+    }
+};
+
+int countFiles(const string& dir) {
+    int count = 0;
+    DIR* d = opendir(dir.c_str());
+    while (dirent* entry = d ? readdir(d) : nullptr) count += entry->d_name[0] != '.';
+    if (d) closedir(d);
+    return count;
+}
+
+// Wait until the follower applied the records up to lsn
+bool caughtUp(ReplicationFollower& follower, uint64_t lsn) {
+    for (int i = 0; i < 500 && follower.lsn() < lsn; i++) usleep(10000);
+    return follower.lsn() == lsn;
+}
+
+// Tests a follower applies the records of the leader as they are logged
+TEST(Replication, TestStream) {
+    Leader leader;
+    FileSystem replica;
+    ReplicationFollower follower(replica, leader.socketPath);
+
+    leader.fs.mkdir("/a/b");
+    leader.fs.cd("a");
+    leader.fs.touch("f");
+    leader.fs.write("f", "replicated");
+    ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+    EXPECT_EQ("replicated", replica.cat("/a/f"));
+
+    leader.fs.cp("f", "g");
+    leader.fs.mv("f", "h");
+    leader.fs.rm("b");
+    ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+    EXPECT_TRUE(FileSystem::diff(leader.fs, replica).empty());
+    EXPECT_EQ((vector<string>{"g", "h"}), replica.ls("/a"));
+}
+
+// Tests a follower behind the records the leader keeps catches up from an image, and
+// followers resume from their lsn after reconnecting
+TEST(Replication, TestCatchUp) {
+    Leader leader(256);
+    for (int i = 0; i < 50; i++) leader.fs.mkdir("/dir" + to_string(i));
+
+    FileSystem replica;
+    uint64_t lsn;
+    {
+        ReplicationFollower follower(replica, leader.socketPath);
+        ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+        EXPECT_EQ(50, replica.ls("/").size());
+        // Sending the image didn't rotate the leader's log
+        EXPECT_EQ(1, countFiles(leader.dir));
+        leader.fs.touch("f");
+        ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+        lsn = follower.lsn();
+    }
+
+    leader.fs.write("f", "while away");
+    ReplicationFollower follower(replica, leader.socketPath, lsn);
+    ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+    EXPECT_EQ("while away", replica.cat("f"));
+    EXPECT_TRUE(FileSystem::diff(leader.fs, replica).empty());
+}
+
+// Tests the leader is done with followers going away, including ones which never said hello
+TEST(Replication, TestFollowersGoAway) {
+    Leader leader;
+    leader.fs.mkdir("/a");
+    for (int i = 0; i < 20; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, leader.socketPath.c_str());
+        ASSERT_EQ(0, connect(fd, (sockaddr*) &addr, sizeof(addr)));
+        if (i % 2) {
+            EXPECT_EQ(3, write(fd, "bad", 3));
+        }
+        close(fd);
+    }
+    {
+        FileSystem replica;
+        ReplicationFollower follower(replica, leader.socketPath);
+        ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+    }
+    for (int i = 0; i < 500 && leader.leader->followers() > 0; i++) usleep(10000);
+    EXPECT_EQ(0, leader.leader->followers());
+
+    // Still serving followers
+    FileSystem replica;
+    ReplicationFollower follower(replica, leader.socketPath);
+    ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+    EXPECT_EQ(1, leader.leader->followers());
+}
+
+// Tests clients of a replica can read but not write
+TEST(Replication, TestReadOnlyClients) {
+    Leader leader;
+    leader.fs.mkdir("/a");
+    FileSystem replica;
+    ReplicationFollower follower(replica, leader.socketPath);
+    ASSERT_TRUE(caughtUp(follower, leader.wal->lsn()));
+
+    FileSystem::Session client(replica, true);
+    replica.cd(client, "a");
+    EXPECT_EQ("/a/", replica.pwd(client));
+    EXPECT_THROW(replica.mkdir(client, "b"), invalid_argument);
+    EXPECT_THROW(replica.touch(client, "f"), invalid_argument);
+    EXPECT_THROW(replica.rm(client, "/a"), invalid_argument);
+    EXPECT_TRUE(replica.ls("/a").empty());
+}
+}  // namespace
@@ -0,0 +1,570 @@
+#include "fs_server.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <unordered_set>
+
+#include "fs_command.h"
+#include "fs_protocol.h"
+#include "fs_spans.h"
+
+using namespace std;
+
+namespace {
+
+// Stop running commands of a connection whose unsent output is over this size,
+// until the client reads it. Bounds the memory a slow client can pin.
+const size_t kMaxPendingOutput = 1 << 20;
+// Stop reading a connection holding this much input it can't run yet. The rest waits in the
+// socket (or ring), and the client blocks sending, until commands finish. Also the most read
+// from one connection at a time.
+const size_t kMaxPendingInput = 1 << 20;
+// Close connections sending a line longer than this
+const size_t kMaxLineLength = 1 << 20;
+// Stop decoding requests of a binary connection with that many requests running
+const int kMaxInFlight = 1024;
+// Size of each of the request and response rings of a shared memory connection
+const uint32_t kShmRingCapacity = 1 << 20;
+// Stop accepting for this long after running out of fds (or memory), rather than waking up
+// on the listener, which stays readable, over and over
+const chrono::milliseconds kAcceptBackoff(100);
+
+runtime_error systemError(const string& what) {
+    return runtime_error(what + ": " + strerror(errno));
+}
+
+}  // namespace
+
+/************************ worker pool *****************************/
+
+FsServer::WorkerPool::WorkerPool(int size) {
+    for (int i = 0; i < size; i++) {
+        threads.emplace_back([this]() {
+            while (true) {
+                function<void()> task;
+                {
+                    unique_lock<mutex> guard(lock);
+                    ready.wait(guard, [this]() { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) return;
+                    task = move(tasks.front());
+                    tasks.pop();
+                }
+                task();
+            }
+        });
+    }
+}
+
+void FsServer::WorkerPool::submit(function<void()> task) {
+    {
+        lock_guard<mutex> guard(lock);
+        tasks.push(move(task));
+    }
+    ready.notify_one();
+}
+
+void FsServer::WorkerPool::stop() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread& t : threads) {
+        if (t.joinable()) t.join();
+    }
+}
+
+/************************ server **********************************/
+
+bool FsServer::Connection::inputPaused() const {
+    return stalled && in.size() >= kMaxPendingInput;
+}
+
+FsServer::FsServer(FileSystem& fs, int workerCount, ClientMode clients)
+        : fs(fs), clients(clients), stopping(false), workers(workerCount) {
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd < 0) throw systemError("epoll_create1");
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd < 0) throw systemError("eventfd");
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+}
+
+FsServer::~FsServer() {
+    // Workers refer to the connections and wakeFd: let them finish first.
+    workers.stop();
+    while (!connections.empty()) closeConnection(connections.begin()->second);
+    for (int fd : listenFds) ::close(fd);
+    ::close(wakeFd);
+    ::close(epollFd);
+}
+
+void FsServer::listenUnix(const string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw invalid_argument("Socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw systemError("socket");
+    unlink(path.c_str());
+    if (bind(fd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        ::close(fd);
+        throw systemError("Cannot listen on " + path);
+    }
+    addListener(fd);
+}
+
+int FsServer::listenTcp(int port) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) throw systemError("socket");
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    socklen_t len = sizeof(addr);
+    if (bind(fd, (sockaddr*) &addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0
+            || getsockname(fd, (sockaddr*) &addr, &len) < 0) {
+        ::close(fd);
+        throw systemError("Cannot listen on port " + to_string(port));
+    }
+    addListener(fd);
+    return ntohs(addr.sin_port);
+}
+
+void FsServer::addListener(int fd) {
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    listenFds.push_back(fd);
+}
+
+void FsServer::run() {
+    epoll_event events[256];
+    while (!stopping) {
+        int timeout = armShmWakeups();
+        if (acceptPaused) {
+            int64_t wait = chrono::duration_cast<chrono::milliseconds>(acceptResume - chrono::steady_clock::now()).count();
+            if (wait <= 0) watchListeners(true);
+            else if (timeout < 0 || wait < timeout) timeout = wait;
+        }
+        int n = epoll_wait(epollFd, events, 256, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            throw systemError("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd) {
+                uint64_t count;
+                while (::read(wakeFd, &count, sizeof(count)) > 0) {}
+                finishTasks();
+                continue;
+            }
+            if (find(listenFds.begin(), listenFds.end(), fd) != listenFds.end()) {
+                acceptAll(fd);
+                continue;
+            }
+            auto iter = connections.find(fd);
+            if (iter == connections.end()) continue;
+            shared_ptr<Connection> conn = iter->second;
+            if (conn->shm && fd == conn->shm->doorbell()) {
+                // Rings are polled below
+                uint64_t count;
+                while (::read(fd, &count, sizeof(count)) > 0) {}
+                continue;
+            }
+            if (events[i].events & EPOLLERR) {
+                closeConnection(conn);
+                continue;
+            }
+            // A peer that hung up may have sent commands before: read them first
+            if (events[i].events & (EPOLLIN | EPOLLHUP)) readAll(conn);
+            if (conn->fd >= 0 && (events[i].events & EPOLLHUP)) peerGone(conn);
+            if (conn->fd >= 0 && (events[i].events & EPOLLOUT)) flush(conn);
+            progress(conn);
+        }
+        pollShm();
+    }
+}
+
+// Before sleeping in epoll, ask shared memory clients to ring their doorbell on new work.
+// Return the epoll timeout: don't sleep if some ring has work already.
+int FsServer::armShmWakeups() {
+    int timeout = -1;
+    for (shared_ptr<Connection>& conn : shmConnections) {
+        if (!conn->shm->armWakeup(!conn->inputPaused(), !conn->out.empty())) timeout = 0;
+    }
+    return timeout;
+}
+
+// Move requests and responses of all shared memory connections
+void FsServer::pollShm() {
+    vector<shared_ptr<Connection>> polled = shmConnections;
+    for (shared_ptr<Connection>& conn : polled) {
+        if (conn->fd < 0) continue;
+        try {
+            if (!conn->inputPaused()) conn->shm->receive(conn->in);
+        } catch (const invalid_argument& e) {
+            closeConnection(conn);
+            continue;
+        }
+        flush(conn);
+        progress(conn);
+    }
+}
+
+void FsServer::stop() {
+    stopping = true;
+    uint64_t one = 1;
+    ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+    (void) ignored;
+}
+
+void FsServer::acceptAll(int listenFd) {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // Accepted all pending
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            // The connection failed, not the listener
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO || errno == EPERM) continue;
+            // Out of fds or memory: connections wait in the backlog until some are freed
+            watchListeners(false);
+            return;
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        shared_ptr<Connection> conn = make_shared<Connection>();
+        conn->fd = fd;
+        conn->id = ++connectionCount;
+        if (clients == ClientMode::Overlay) conn->overlay.reset(new FileSystem(fs));
+        conn->fs = conn->overlay ? conn->overlay.get() : &fs;
+        conn->session.reset(new FileSystem::Session(*conn->fs, clients == ClientMode::ReadOnly, conn->id));
+        conn->session->anyHostPath = false;
+        conn->session->hostDir = hostDir;
+        conn->events = EPOLLIN;
+        epoll_event event = {};
+        event.events = conn->events;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        connections[fd] = conn;
+    }
+}
+
+// Start or stop watching the listening sockets. Stopping resumes by itself after a backoff.
+void FsServer::watchListeners(bool watch) {
+    for (int fd : listenFds) {
+        epoll_event event = {};
+        event.events = watch ? EPOLLIN : 0;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+    }
+    acceptPaused = !watch;
+    if (!watch) acceptResume = chrono::steady_clock::now() + kAcceptBackoff;
+}
+
+// Read what the socket has, up to kMaxPendingInput at a time: progress() runs what it can,
+// and the socket stays readable for the rest.
+void FsServer::readAll(const shared_ptr<Connection>& conn) {
+    char buf[65536];
+    size_t total = 0;
+    while (total < kMaxPendingInput && !conn->inputPaused()) {
+        ssize_t n = ::read(conn->fd, buf, sizeof(buf));
+        if (n > 0) {
+            // Requests of shared memory clients come through the ring, the socket just tells when they're gone
+            if (conn->protocol != Protocol::Shm) conn->in.append(buf, n);
+            total += n;
+            continue;
+        }
+        if (n == 0) {
+            conn->readClosed = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            closeConnection(conn);
+        }
+        break;
+    }
+}
+
+void FsServer::flush(const shared_ptr<Connection>& conn) {
+    if (conn->shm) {
+        try {
+            conn->shm->send(conn->out);
+        } catch (const invalid_argument& e) {
+            closeConnection(conn);
+        }
+        return;
+    }
+    if (conn->hungUp) conn->out.clear();
+    if (conn->out.empty()) return;
+    Span span(SpanPhase::Respond, "send");
+    size_t sent = 0;
+    while (sent < conn->out.size()) {
+        ssize_t n = send(conn->fd, conn->out.data() + sent, conn->out.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                peerGone(conn);
+                return;
+            }
+            break;
+        }
+        sent += n;
+    }
+    conn->out.erase(0, sent);
+}
+
+// The peer can't read output anymore. Drop it, and let progress() run the commands it sent
+// before: the socket is read until its end, at the pace they run.
+void FsServer::peerGone(const shared_ptr<Connection>& conn) {
+    conn->hungUp = true;
+    conn->out.clear();
+}
+
+// Move a connection forward after any event: run its next commands, close it when it's
+// done, and watch for the events it waits on.
+void FsServer::progress(const shared_ptr<Connection>& conn) {
+    if (conn->fd < 0) return;
+    if (conn->protocol == Protocol::Unknown && !detectProtocol(conn)) return;
+    if (conn->protocol == Protocol::Text) dispatchLines(conn);
+    else dispatchFrames(conn);
+    if (conn->fd < 0) return;
+
+    // Nothing is running or left to write, and the peer won't send more.
+    // A shared memory client is gone once its socket is closed.
+    if ((!conn->busy && conn->inFlight == 0 && conn->readClosed && conn->out.empty())
+            || (conn->shm && conn->readClosed)) {
+        closeConnection(conn);
+        return;
+    }
+    // Not watched at all while paused, or the hangup would be reported on every wait
+    uint32_t events = (conn->readClosed || conn->inputPaused() ? 0 : EPOLLIN)
+            | (conn->out.empty() || conn->shm || conn->hungUp ? 0 : EPOLLOUT);
+    if (events != conn->events) {
+        epoll_event event = {};
+        event.events = events;
+        event.data.fd = conn->fd;
+        int op = events == 0 ? EPOLL_CTL_DEL : conn->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        epoll_ctl(epollFd, op, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+// Binary and shared memory clients start with their magic, anything else is a text client.
+// Return false if there aren't enough bytes to decide yet, or the connection got closed.
+bool FsServer::detectProtocol(const shared_ptr<Connection>& conn) {
+    const size_t magicLen = sizeof(fsproto::kBinaryMagic);
+    if (conn->in.empty() || (conn->in[0] == '\0' && conn->in.size() < magicLen)) {
+        if (conn->readClosed) closeConnection(conn);
+        return false;
+    }
+    if (conn->in[0] != '\0') {
+        conn->protocol = Protocol::Text;
+        return true;
+    }
+    if (conn->in.compare(0, magicLen, fsproto::kBinaryMagic, magicLen) == 0) {
+        conn->protocol = Protocol::Binary;
+    } else if (conn->in.compare(0, magicLen, fsproto::kShmMagic, magicLen) == 0) {
+        try {
+            conn->shm.reset(new fsproto::ShmChannel(kShmRingCapacity));
+            conn->shm->handOver(conn->fd);
+        } catch (const exception& e) {
+            closeConnection(conn);
+            return false;
+        }
+        int doorbell = conn->shm->doorbell();
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = doorbell;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, doorbell, &event);
+        connections[doorbell] = conn;
+        shmConnections.push_back(conn);
+        conn->protocol = Protocol::Shm;
+    } else {
+        closeConnection(conn);
+        return false;
+    }
+    conn->in.erase(0, magicLen);
+    return true;
+}
+
+// Run all complete lines of the connection on a worker. Commands of a connection run one
+// batch at a time, so they see each other's effects (e.g. cd) and answer in order.
+void FsServer::dispatchLines(const shared_ptr<Connection>& conn) {
+    if (conn->readClosed && !conn->in.empty() && conn->in.back() != '\n') {
+        // Run an unterminated last line too
+        conn->in += '\n';
+    }
+    // Until the batch ran, nothing more can
+    conn->stalled = conn->busy || conn->out.size() >= kMaxPendingOutput;
+    if (conn->stalled) return;
+    size_t newline = conn->in.rfind('\n');
+    if (newline == string::npos) {
+        if (conn->in.size() > kMaxLineLength) closeConnection(conn);
+        return;
+    }
+    string lines = conn->in.substr(0, newline + 1);
+    conn->in.erase(0, newline + 1);
+    conn->busy = true;
+    conn->stalled = true;
+    workers.submit([this, conn, lines]() {
+        ostringstream out;
+        size_t start = 0;
+        while (start < lines.size()) {
+            size_t newline = lines.find('\n', start);
+            size_t len = newline - start;
+            if (len > 0 && lines[newline - 1] == '\r') len--;
+            {
+                RequestSpan request;
+                runRecorded(*conn->fs, *conn->session, string_view(lines).substr(start, len), out, recorder, conn->id);
+            }
+            start = newline + 1;
+        }
+        // Outputs of all the lines go at once
+        Span respond(SpanPhase::Respond);
+        complete(conn, out.str());
+    });
+}
+
+// Run every complete request frame of the connection on its own worker task, so a slow
+// request doesn't hold back the ones pipelined behind it. A cd runs alone, so the requests
+// around it see the directory it leaves: it is held until the requests before it finished
+// (and decoded again then), and later ones wait for it.
+void FsServer::dispatchFrames(const shared_ptr<Connection>& conn) {
+    size_t consumed = 0;
+    conn->stalled = false;
+    while (true) {
+        if (conn->barrier || conn->inFlight >= kMaxInFlight || conn->out.size() >= kMaxPendingOutput) {
+            conn->stalled = true;
+            break;
+        }
+        shared_ptr<fsproto::Request> request = make_shared<fsproto::Request>();
+        size_t len;
+        try {
+            len = fsproto::decodeRequest(conn->in.data() + consumed, conn->in.size() - consumed, *request);
+        } catch (const invalid_argument& e) {
+            closeConnection(conn);
+            return;
+        }
+        if (len == 0) break;
+        if (request->op == fsproto::Op::Cd) {
+            if (conn->inFlight > 0) {
+                conn->stalled = true;
+                break;
+            }
+            conn->barrier = true;
+        }
+        consumed += len;
+        conn->inFlight++;
+        workers.submit([this, conn, request]() {
+            RequestSpan requestSpan;
+            string out;
+            if (!recorder) {
+                fsproto::Response response = fsproto::execute(*conn->fs, *conn->session, *request);
+                Span respond(SpanPhase::Respond);
+                fsproto::encodeResponse(response, out);
+                complete(conn, move(out));
+                return;
+            }
+            // Traced as the command name and the params as decoded, which may hold any bytes
+            TraceEntry entry;
+            entry.timestampUs = traceTimestamp();
+            entry.session = conn->id;
+            const Command* command = findCommand(uint8_t(request->op));
+            entry.command = command ? string(command->name) : "op" + to_string(int(request->op));
+            entry.hasArgs = true;
+            entry.args = request->args;
+            auto start = chrono::steady_clock::now();
+            fsproto::Response response = fsproto::execute(*conn->fs, *conn->session, *request);
+            entry.latencyNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+            entry.ok = response.status == fsproto::Status::Ok;
+            for (const string& item : response.items) entry.resultBytes += item.size() + 1;
+            Span respond(SpanPhase::Respond);
+            fsproto::encodeResponse(response, out);
+            complete(conn, move(out));
+            recorder->record(entry);
+        });
+    }
+    conn->in.erase(0, consumed);
+}
+
+// Called by workers: queue the output of a task for the event loop
+void FsServer::complete(const shared_ptr<Connection>& conn, string output) {
+    bool wake;
+    {
+        lock_guard<mutex> guard(doneLock);
+        // A non empty queue already has a wakeup pending
+        wake = done.empty();
+        done.emplace_back(conn, move(output));
+    }
+    if (wake) {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(wakeFd, &one, sizeof(one));
+        (void) ignored;
+    }
+}
+
+// Hand the output of finished tasks back to their connections. Outputs of many tasks of a
+// connection are written with one send.
+void FsServer::finishTasks() {
+    vector<pair<shared_ptr<Connection>, string>> finished;
+    {
+        lock_guard<mutex> guard(doneLock);
+        finished.swap(done);
+    }
+    vector<shared_ptr<Connection>> touched;
+    unordered_set<Connection*> seen;
+    for (auto& task : finished) {
+        shared_ptr<Connection>& conn = task.first;
+        if (conn->protocol == Protocol::Text) {
+            conn->busy = false;
+        } else {
+            conn->inFlight--;
+            // A cd ran alone
+            conn->barrier = false;
+        }
+        if (conn->fd < 0) continue;
+        conn->out += task.second;
+        if (seen.insert(conn.get()).second) touched.push_back(conn);
+    }
+    for (shared_ptr<Connection>& conn : touched) {
+        flush(conn);
+        progress(conn);
+    }
+}
+
+// Close the socket right away. A worker may still run commands of the connection: the
+// session is released with the last reference to the connection.
+void FsServer::closeConnection(const shared_ptr<Connection>& conn) {
+    if (conn->fd < 0) return;
+    // conn may be the map entry erased below
+    shared_ptr<Connection> keep = conn;
+    if (keep->events != 0) epoll_ctl(epollFd, EPOLL_CTL_DEL, keep->fd, nullptr);
+    ::close(keep->fd);
+    connections.erase(keep->fd);
+    keep->fd = -1;
+    if (keep->shm) {
+        int doorbell = keep->shm->doorbell();
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, doorbell, nullptr);
+        connections.erase(doorbell);
+        shmConnections.erase(find(shmConnections.begin(), shmConnections.end(), keep));
+        // Workers don't touch the rings: safe to unmap now
+        keep->shm.reset();
+    }
+}
@@ -0,0 +1,151 @@
+#ifndef FS_SERVER_H
+#define FS_SERVER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+#include <unordered_map>
+
+#include "fs_impl.h"
+#include "fs_shm.h"
+#include "fs_trace.h"
+
+using namespace std;
+
+/* Network front end of the FS: serves many clients from one in memory tree.
+   A single thread runs a non-blocking epoll loop over the listening sockets and all
+   connections, while the commands themselves run on a pool of worker threads.
+   Every connection has its own session, and speaks either the same line based protocol as
+   the prompt, or the binary protocol of fs_protocol.h. Clients on the unix domain socket can
+   also move binary frames through shared memory rings (fs_shm.h), which the loop polls
+   alongside the sockets.
+*/
+// What clients may do to the tree
+enum class ClientMode {
+    // All clients work on the one tree
+    Shared,
+    // Every connection gets its own writable overlay of the tree (see FileSystem(FileSystem&)),
+    // so clients don't see each other's changes and the tree itself never changes
+    Overlay,
+    // Write commands fail, e.g. on a replica
+    ReadOnly,
+};
+
+class FsServer {
+    // Fixed set of threads running submitted tasks in FIFO order
+    class WorkerPool {
+        vector<thread> threads;
+        mutex lock;
+        condition_variable ready;
+        queue<function<void()>> tasks;
+        bool stopping = false;
+      public:
+        explicit WorkerPool(int size);
+        ~WorkerPool() { stop(); }
+        void submit(function<void()> task);
+        // Run the tasks already submitted, then join the threads
+        void stop();
+    };
+
+    enum class Protocol { Unknown, Text, Binary, Shm };
+
+    struct Connection {
+        int fd;
+        // Tells the connection apart in traces, from 1 on
+        uint64_t id = 0;
+        // Decided by the first bytes the client sends
+        Protocol protocol = Protocol::Unknown;
+        // The tree the connection works on: the shared one, or its overlay
+        unique_ptr<FileSystem> overlay;
+        FileSystem* fs;
+        unique_ptr<FileSystem::Session> session;
+        // Bytes read but not yet run, and output not yet written to the socket
+        string in;
+        string out;
+        // Text: a worker is running commands of this connection, which owns its session until done.
+        bool busy = false;
+        // Binary: number of requests running on workers, and whether one of them is a cd,
+        // which runs alone
+        int inFlight = 0;
+        bool barrier = false;
+        // The last dispatch left input that can't run until running commands finish or the
+        // client reads its output
+        bool stalled = false;
+        // The peer shut down its side: close once pending commands ran and their output is written.
+        bool readClosed = false;
+        // The peer is gone (hung up, or sending failed): commands it sent still run, and their
+        // output is dropped. The socket is read until its end only.
+        bool hungUp = false;
+        // Events currently registered with epoll
+        uint32_t events = 0;
+        // Shm: the rings carrying in/out instead of the socket
+        unique_ptr<fsproto::ShmChannel> shm;
+
+        // Stop reading: stalled with too much input buffered already
+        bool inputPaused() const;
+    };
+
+    FileSystem& fs;
+    ClientMode clients;
+    TraceRecorder* recorder = nullptr;
+    // Where clients may write host files, empty for nowhere
+    string hostDir;
+    uint64_t connectionCount = 0;
+    int epollFd;
+    // Written by workers (and stop) to wake up the event loop
+    int wakeFd;
+    vector<int> listenFds;
+    // Accepting stopped until acceptResume after running out of fds
+    bool acceptPaused = false;
+    chrono::steady_clock::time_point acceptResume;
+    // By socket fd, and by doorbell fd for shared memory connections
+    unordered_map<int, shared_ptr<Connection>> connections;
+    vector<shared_ptr<Connection>> shmConnections;
+    atomic<bool> stopping;
+
+    // Output of finished tasks, handed back to the event loop
+    mutex doneLock;
+    vector<pair<shared_ptr<Connection>, string>> done;
+
+    WorkerPool workers;
+
+    void addListener(int fd);
+    void acceptAll(int listenFd);
+    void watchListeners(bool watch);
+    void readAll(const shared_ptr<Connection>& conn);
+    void flush(const shared_ptr<Connection>& conn);
+    void peerGone(const shared_ptr<Connection>& conn);
+    int armShmWakeups();
+    void pollShm();
+    void progress(const shared_ptr<Connection>& conn);
+    bool detectProtocol(const shared_ptr<Connection>& conn);
+    void dispatchLines(const shared_ptr<Connection>& conn);
+    void dispatchFrames(const shared_ptr<Connection>& conn);
+    void complete(const shared_ptr<Connection>& conn, string output);
+    void finishTasks();
+    void closeConnection(const shared_ptr<Connection>& conn);
+
+  public:
+    FsServer(FileSystem& fs, int workerCount, ClientMode clients = ClientMode::Shared);
+    ~FsServer();
+    FsServer(const FsServer&) = delete;
+    FsServer& operator=(const FsServer&) = delete;
+
+    // Listen on a unix domain socket, replacing any stale socket file at the path
+    void listenUnix(const string& path);
+    // Listen on 127.0.0.1. Port 0 picks a free port. Returns the port listened on.
+    int listenTcp(int port);
+
+    // Record every command of every client to recorder, until run() returns
+    void record(TraceRecorder* recorder) { this->recorder = recorder; }
+    // Let clients write host files (snapshot images, span dumps) named in dir. Without a
+    // directory they can't: the paths they'd give are on the server's host.
+    void setHostDir(const string& dir) { hostDir = dir; }
+
+    // Serve clients until stop() is called
+    void run();
+    // Safe to call from any thread and from signal handlers
+    void stop();
+};
+#endif
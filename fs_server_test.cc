@@ -0,0 +1,469 @@
+#include "fs_server.h"
+
+#include "fs_protocol.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+/* Test the server against real clients on a unix domain socket */
+namespace {
+
+int connectUnix(const string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void send(int fd, const string& data) {
+    ASSERT_EQ(data.size(), ::send(fd, data.data(), data.size(), 0));
+}
+
+// Read from the socket until the expected number of lines arrived
+string receiveLines(int fd, int count) {
+    string received;
+    char buf[4096];
+    while (std::count(received.begin(), received.end(), '\n') < count) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        received.append(buf, n);
+    }
+    return received;
+}
+
+// Tests clients sharing one tree, each with its own working directory
+TEST(FsServer, TestClientsShareTree) {
+    FileSystem fs;
+    FsServer server(fs, 2);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    int alice = connectUnix(path);
+    int bob = connectUnix(path);
+    ASSERT_GE(alice, 0);
+    ASSERT_GE(bob, 0);
+
+    send(alice, "mkdir /a/b\ncd a\npwd\n");
+    EXPECT_EQ("/a/\n", receiveLines(alice, 1));
+    send(bob, "touch f\nwrite f hello\npwd\nls /\n");
+    EXPECT_EQ("/\na\nf\n", receiveLines(bob, 3));
+    send(alice, "cat ../f\nls\nfoo\n");
+    EXPECT_EQ("hello\nb\ncommand not found: foo\n", receiveLines(alice, 3));
+    // Clients don't write host files without a directory for them
+    send(alice, "spans dump " + path + ".json\n");
+    EXPECT_EQ("Host files are not writable by clients: " + path + ".json\n", receiveLines(alice, 1));
+    EXPECT_NE(0, access((path + ".json").c_str(), F_OK));
+
+    // A client closing its side still gets the output of its last commands
+    send(bob, "cat f");
+    shutdown(bob, SHUT_WR);
+    EXPECT_EQ("hello\n", receiveLines(bob, 1));
+    EXPECT_EQ("", receiveLines(bob, 1));
+
+    close(alice);
+    close(bob);
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests commands a client sent before closing its socket still run
+TEST(FsServer, TestClientHangsUp) {
+    FileSystem fs;
+    FsServer server(fs, 2);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    for (int i = 0; i < 5; i++) {
+        int client = connectUnix(path);
+        ASSERT_GE(client, 0);
+        send(client, "mkdir /d" + to_string(i) + "\nls /\nmkdir /d" + to_string(i) + "/e");
+        close(client);
+    }
+    // The output has nowhere to go, but the commands apply
+    for (int wait = 0; wait < 500 && fs.ls("/").size() < 5; wait++) this_thread::sleep_for(chrono::milliseconds(10));
+    EXPECT_EQ(vector<string>({"d0", "d1", "d2", "d3", "d4"}), fs.ls("/"));
+    for (int wait = 0; wait < 500 && fs.ls("/d4").empty(); wait++) this_thread::sleep_for(chrono::milliseconds(10));
+    EXPECT_EQ(vector<string>{"e"}, fs.ls("/d4"));
+
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests clients of an overlay server each change only their own overlay of the tree
+TEST(FsServer, TestOverlays) {
+    FileSystem fs;
+    fs.mkdir("/base");
+    FsServer server(fs, 2, ClientMode::Overlay);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    int alice = connectUnix(path);
+    int bob = connectUnix(path);
+    ASSERT_GE(alice, 0);
+    ASSERT_GE(bob, 0);
+
+    send(alice, "mkdir /a\nls /\n");
+    EXPECT_EQ("a\nbase\n", receiveLines(alice, 2));
+    send(bob, "rm base\ntouch f\nls /\n");
+    EXPECT_EQ("f\n", receiveLines(bob, 1));
+    send(alice, "ls /\n");
+    EXPECT_EQ("a\nbase\n", receiveLines(alice, 2));
+    EXPECT_EQ(vector<string>{"base"}, fs.ls("/"));
+
+    close(alice);
+    close(bob);
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests a binary client pipelining many requests in one write
+TEST(FsServer, TestBinaryPipelining) {
+    FileSystem fs;
+    FsServer server(fs, 4);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    int fd = connectUnix(path);
+    ASSERT_GE(fd, 0);
+    string requests(fsproto::kBinaryMagic, sizeof(fsproto::kBinaryMagic));
+    fsproto::encodeRequest({0, fsproto::Op::Mkdir, {"/d"}}, requests);
+    send(fd, requests);
+
+    // Wait for the directory, then pipeline requests that don't depend on each other
+    string received;
+    fsproto::Response response;
+    char buf[4096];
+    while (fsproto::decodeResponse(received.data(), received.size(), response) == 0) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        ASSERT_GT(n, 0);
+        received.append(buf, n);
+    }
+    EXPECT_EQ(fsproto::Status::Ok, response.status);
+    received.clear();
+
+    const int count = 100;
+    requests.clear();
+    for (uint32_t id = 1; id <= count; id++) {
+        fsproto::encodeRequest({id, fsproto::Op::Mkdir, {"/d/dir " + to_string(id)}}, requests);
+    }
+    send(fd, requests);
+    set<uint32_t> ids;
+    size_t consumed = 0;
+    while (ids.size() < count) {
+        size_t len = fsproto::decodeResponse(received.data() + consumed, received.size() - consumed, response);
+        if (len == 0) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            ASSERT_GT(n, 0);
+            received.append(buf, n);
+            continue;
+        }
+        consumed += len;
+        EXPECT_EQ(fsproto::Status::Ok, response.status);
+        ids.insert(response.id);
+    }
+    EXPECT_EQ(1, *ids.begin());
+    EXPECT_EQ(count, *ids.rbegin());
+    EXPECT_EQ(count, fs.ls("/d").size());
+
+    close(fd);
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests a pipelined cd runs after the requests before it and before the ones after it
+TEST(FsServer, TestBinaryPipelinedCd) {
+    FileSystem fs;
+    FsServer server(fs, 4);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    int fd = connectUnix(path);
+    ASSERT_GE(fd, 0);
+    const uint32_t dirs = 50;
+    fs.touch("big");
+    string requests(fsproto::kBinaryMagic, sizeof(fsproto::kBinaryMagic));
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < dirs; i++) {
+        string dir = "d" + to_string(i);
+        fsproto::encodeRequest({id++, fsproto::Op::Mkdir, {"/" + dir}}, requests);
+        // Keeps the tree locked, so the requests after it are likely to start together
+        fsproto::encodeRequest({id++, fsproto::Op::Write, {"/big", string(64 << 10, 'x')}}, requests);
+        fsproto::encodeRequest({id++, fsproto::Op::Cd, {dir}}, requests);
+        fsproto::encodeRequest({id++, fsproto::Op::Touch, {"f"}}, requests);
+        fsproto::encodeRequest({id++, fsproto::Op::Pwd, {}}, requests);
+        fsproto::encodeRequest({id++, fsproto::Op::Cd, {"../"}}, requests);
+    }
+    send(fd, requests);
+
+    map<uint32_t, fsproto::Response> responses;
+    string received;
+    size_t consumed = 0;
+    char buf[4096];
+    while (responses.size() < id) {
+        fsproto::Response response;
+        size_t len = fsproto::decodeResponse(received.data() + consumed, received.size() - consumed, response);
+        if (len == 0) {
+            ssize_t n = read(fd, buf, sizeof(buf));
+            ASSERT_GT(n, 0);
+            received.append(buf, n);
+            continue;
+        }
+        consumed += len;
+        responses[response.id] = response;
+    }
+    for (auto& entry : responses) {
+        EXPECT_EQ(fsproto::Status::Ok, entry.second.status) << entry.first;
+    }
+    for (uint32_t i = 0; i < dirs; i++) {
+        EXPECT_EQ(vector<string>{"/d" + to_string(i) + "/"}, responses[i * 6 + 4].items);
+        EXPECT_EQ(vector<string>{"f"}, fs.ls("/d" + to_string(i)));
+    }
+    EXPECT_EQ(dirs + 1, fs.ls("/").size());
+
+    close(fd);
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests binary requests are traced with their params whole, so the trace replays to the same tree
+TEST(FsServer, TestBinaryTrace) {
+    string tracePath = "/tmp/fs_server_test.trace." + to_string(getpid());
+    unlink(tracePath.c_str());
+    FileSystem fs;
+    // The trace is complete once the recorder is gone, after the server
+    {
+        TraceRecorder recorder(tracePath);
+        FsServer server(fs, 2);
+        server.record(&recorder);
+        string path = "/tmp/fs_server_test." + to_string(getpid());
+        server.listenUnix(path);
+        thread loop([&server]() { server.run(); });
+
+        int fd = connectUnix(path);
+        ASSERT_GE(fd, 0);
+        string requests(fsproto::kBinaryMagic, sizeof(fsproto::kBinaryMagic));
+        fsproto::encodeRequest({1, fsproto::Op::Touch, {"f"}}, requests);
+        send(fd, requests);
+        // One at a time, so they run in order
+        vector<fsproto::Request> next = {
+            {2, fsproto::Op::Write, {"f", "two words\nand a line"}},
+            {3, fsproto::Op::Write, {"f", ""}},
+            {4, fsproto::Op::Mkdir, {"/dir with spaces"}},
+            {5, fsproto::Op::Pwd, {}},
+        };
+        string received;
+        char buf[4096];
+        for (size_t i = 0; i <= next.size(); i++) {
+            fsproto::Response response;
+            size_t len;
+            while ((len = fsproto::decodeResponse(received.data(), received.size(), response)) == 0) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                ASSERT_GT(n, 0);
+                received.append(buf, n);
+            }
+            received.erase(0, len);
+            EXPECT_EQ(fsproto::Status::Ok, response.status);
+            if (i == next.size()) break;
+            requests.clear();
+            fsproto::encodeRequest(next[i], requests);
+            send(fd, requests);
+        }
+        close(fd);
+        server.stop();
+        loop.join();
+        unlink(path.c_str());
+    }
+
+    ifstream trace(tracePath);
+    FileSystem replica;
+    ReplayReport report = replayTrace(replica, trace, false);
+    EXPECT_EQ(5, report.commands);
+    EXPECT_EQ(0, report.failed);
+    EXPECT_EQ(0, report.diverged);
+    EXPECT_TRUE(FileSystem::diff(fs, replica).empty());
+    EXPECT_EQ("two words\nand a line", replica.cat("f"));
+    unlink(tracePath.c_str());
+}
+
+// Tests a server out of fds backs off instead of waking up on the listener over and over, and
+// accepts the client waiting in the backlog once fds are freed
+TEST(FsServer, TestOutOfFds) {
+    FileSystem fs;
+    FsServer server(fs, 2);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    // Use up every fd but the one of the client
+    rlimit limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &limit));
+    rlimit lowered = limit;
+    int probe = open("/dev/null", O_RDONLY);
+    close(probe);
+    lowered.rlim_cur = probe + 16;
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lowered));
+    vector<int> taken;
+    for (int fd; (fd = open("/dev/null", O_RDONLY)) >= 0;) taken.push_back(fd);
+    close(taken.back());
+    taken.pop_back();
+    int client = connectUnix(path);
+    EXPECT_GE(client, 0);
+
+    timespec start, end;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+    this_thread::sleep_for(chrono::milliseconds(500));
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+    int64_t cpuNs = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+    EXPECT_GT(100000000, cpuNs);
+
+    for (int fd : taken) close(fd);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (client >= 0) {
+        send(client, "pwd\n");
+        EXPECT_EQ("/\n", receiveLines(client, 1));
+        close(client);
+    }
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests a client pipelining commands without reading the output: the server stops reading
+// instead of buffering all of them, and runs them all once the client reads
+TEST(FsServer, TestInputHighWaterMark) {
+    FileSystem fs;
+    fs.touch("big");
+    fs.write("big", string(512 * 1024, 'x'));
+    FsServer server(fs, 2);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    int client = connectUnix(path);
+    ASSERT_GE(client, 0);
+    send(client, "cat big\ncat big\ncat big\ncat big\n");
+    fcntl(client, F_SETFL, O_NONBLOCK);
+    string pwds;
+    for (int i = 0; i < 4096; i++) pwds += "pwd\n";
+    size_t sent = 0;
+    const size_t limit = 64 << 20;
+    while (sent < limit) {
+        pollfd writable = {client, POLLOUT, 0};
+        if (poll(&writable, 1, 200) <= 0) break;
+        // Picks up the lines where the last send cut them
+        ssize_t n = ::send(client, pwds.data() + sent % 4, pwds.size() - 4, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    EXPECT_GT(8u << 20, sent);
+
+    fcntl(client, F_SETFL, 0);
+    if (sent % 4 != 0) {
+        send(client, pwds.substr(sent % 4, 4 - sent % 4));
+        sent += 4 - sent % 4;
+    }
+    shutdown(client, SHUT_WR);
+    string received;
+    char buf[65536];
+    for (ssize_t n; (n = read(client, buf, sizeof(buf))) > 0;) received.append(buf, n);
+    EXPECT_EQ(4 * 512 * 1024, count(received.begin(), received.end(), 'x'));
+    EXPECT_EQ(sent / 4, count(received.begin(), received.end(), '/'));
+    close(client);
+
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+// Tests a client moving requests through shared memory, with pipelined requests and binary content
+TEST(FsServer, TestShmClient) {
+    FileSystem fs;
+    FsServer server(fs, 2);
+    string path = "/tmp/fs_server_test." + to_string(getpid());
+    server.listenUnix(path);
+    thread loop([&server]() { server.run(); });
+
+    {
+        fsproto::ShmClient client(path);
+        client.send({1, fsproto::Op::Touch, {"f"}});
+        EXPECT_EQ(fsproto::Status::Ok, client.receive().status);
+
+        // More than fits in the rings at once
+        string content(100000, 'x');
+        content[0] = '\0';
+        const int count = 50;
+        for (uint32_t id = 0; id < count; id++) client.send({id, fsproto::Op::Write, {"f", content}});
+        for (int i = 0; i < count; i++) EXPECT_EQ(fsproto::Status::Ok, client.receive().status);
+
+        client.send({2, fsproto::Op::Cat, {"/f"}});
+        fsproto::Response response = client.receive();
+        EXPECT_EQ(2, response.id);
+        ASSERT_EQ(1, response.items.size());
+        EXPECT_EQ(count * content.size(), response.items[0].size());
+        EXPECT_EQ(content, response.items[0].substr(0, content.size()));
+    }
+
+    // A client corrupting the request ring is disconnected, and the server keeps serving
+    int fd = connectUnix(path);
+    ASSERT_GE(fd, 0);
+    send(fd, string(fsproto::kShmMagic, sizeof(fsproto::kShmMagic)));
+    int fds[2];
+    char ack;
+    iovec iov = {&ack, 1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ASSERT_EQ(1, recvmsg(fd, &msg, 0));
+    memcpy(fds, CMSG_DATA(CMSG_FIRSTHDR(&msg)), sizeof(fds));
+    struct stat st;
+    ASSERT_EQ(0, fstat(fds[0], &st));
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    ASSERT_NE(MAP_FAILED, mapped);
+    fsproto::ShmSegment* segment = (fsproto::ShmSegment*) mapped;
+    segment->capacity = UINT32_MAX;
+    segment->requests.tail.store(uint64_t(1) << 40);
+    uint64_t one = 1;
+    EXPECT_EQ(sizeof(one), write(fds[1], &one, sizeof(one)));
+    EXPECT_EQ("", receiveLines(fd, 1));
+    munmap(mapped, st.st_size);
+    close(fds[0]);
+    close(fds[1]);
+    close(fd);
+    {
+        fsproto::ShmClient client(path);
+        client.send({3, fsproto::Op::Ls, {"/"}});
+        EXPECT_EQ(vector<string>{"f"}, client.receive().items);
+    }
+
+    server.stop();
+    loop.join();
+    unlink(path.c_str());
+}
+
+}  // namespace
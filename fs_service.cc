@@ -1,148 +1,243 @@
-#include "fs_impl.h"
+#include <signal.h>
+
+#include <fstream>
+
+#include "fs_checkpoint.h"
+#include "fs_command.h"
+#include "fs_replication.h"
+#include "fs_server.h"
+#include "fs_slowlog.h"
+#include "fs_spans.h"
+#include "fs_trace.h"
 
 using namespace std;
 
+namespace {
+
+FsServer* server = nullptr;
+
+void stopServer(int) {
+    if (server) server->stop();
+}
+
+void usage() {
+    cout << "SYNOPSIS: fs_service [--batch script|-] [--stop-on-error] [--unix socket_path] [--tcp port] [--workers count]"
+         << " [--overlay] [--wal log_dir] [--durability mode] [--checkpoint-interval seconds]"
+         << " [--leader socket_path | --follow socket_path] [--record trace_path] [--spans]"
+         << " [--slowlog-threshold microseconds] [--host-dir dir] [--persistent]" << endl;
+    cout << "   without options: interactive prompt" << endl;
+    cout << "   --batch: run the commands of a script file (- for stdin) with buffered output" << endl;
+    cout << "   --stop-on-error: in batch mode, stop at the first failing command" << endl;
+    cout << "   --unix, --tcp: serve clients on a unix domain socket and/or 127.0.0.1:port" << endl;
+    cout << "   --workers: threads running the commands of all clients (default: cores)" << endl;
+    cout << "   --overlay: give every client its own writable overlay of the tree, which lasts as long as its connection" << endl;
+    cout << "   --wal: recover the FS from the checkpoint and write-ahead log in a directory, and log every mutation to it" << endl;
+    cout << "   --durability none|group|per-op: when logged mutations are on disk (default: group)" << endl;
+    cout << "   --checkpoint-interval: seconds between checkpoints, which truncate the log (default: 300, 0: never)" << endl;
+    cout << "   --leader: stream the log to followers connecting to a unix domain socket (needs --wal)" << endl;
+    cout << "   --follow: replicate the FS of the leader listening on a unix domain socket, and only serve reads" << endl;
+    cout << "   --record: append every command, with its start time, session, latency and result size, to a JSONL trace"
+         << " (see fs_replay)" << endl;
+    cout << "   --spans: record the phases of every command from the start, for the spans command to dump (see fs_spans.h)"
+         << endl;
+    cout << "   --slowlog-threshold: log the commands taking at least that long, for the slowlog command to print"
+         << " (see fs_slowlog.h)" << endl;
+    cout << "   --host-dir: let server clients write snapshot images and span dumps, named by file name, to a directory."
+         << " Without it they can't; the prompt and scripts write anywhere" << endl;
+    cout << "   --persistent: run the prompt or script on a persistent tree, whose snapshot command retains versions for"
+         << " diff (see fs_persistent.h). Not with a server, a log, replication or a trace" << endl;
+}
+
+// Run commands line by line until EOF. Output of the prompt is flushed after every command,
+// while batch output is only flushed when the buffer fills up.
+// Return 1 if any command failed, as the exit status of batch mode.
+int runCommands(istream& in, bool interactive, bool stopOnError, const function<bool(const string& line)>& run) {
+    int status = 0;
+    string input;
+    while (getline(in, input)) {
+        RequestSpan request;
+        if (!run(input)) {
+            status = 1;
+            if (stopOnError) break;
+        }
+        if (interactive) cout.flush();
+    }
+    cout.flush();
+    return status;
+}
+
+// Run the prompt, or the script (- for stdin) if any. Return the exit status.
+int runInput(const string& script, bool stopOnError, const function<bool(const string& line)>& run) {
+    if (script.empty()) {
+        runCommands(cin, true, stopOnError, run);
+        return 0;
+    }
+    if (script == "-") return runCommands(cin, false, stopOnError, run);
+    ifstream in(script);
+    if (!in) {
+        cout << "Cannot open script: " << script << endl;
+        return 1;
+    }
+    return runCommands(in, false, stopOnError, run);
+}
+
+}  // namespace
+
 /* User prompt for using the in memory file system
-   TODO(mianl): each user have their own FS.
+   The prompt is a single user of the FS: commands run on the FS's own session.
+   With --batch, runs a script instead. With --unix/--tcp, serves many clients, each on its
+   own session. With --overlay, clients only change their own overlay of the tree.
+   With --leader/--follow, the FS is replicated to other processes, which serve reads.
+   With --record, every command goes to a trace that fs_replay runs again. With --spans, the
+   phases of every command are recorded for the spans command to dump. With --slowlog-threshold,
+   the ops slower than it are kept for the slowlog command to print. With --persistent, the
+   prompt or script runs on a PersistentFileSystem instead.
 */
-int main() {
+int main(int argc, char** argv) {
     FileSystem fs;
 
-    while(1) {
-        string input;
-        while(getline(std::cin, input)) {
-            vector<string> commands = fs.split(input, ' ');
-            if (commands.size() == 0) continue;
-            string command = commands[0];
-            string param = ".";
-
-            if (command == "mkdir") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: mkdir [directory_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    fs.mkdir(param);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "rm") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: rm [file/dir_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    fs.rm(param);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "write") {
-                if (commands.size() != 3) {
-                    cout << "SYNOPSIS: write [file_name] [file_content]" << endl;
-                    continue;
-                }
-                try {
-                    fs.write(commands[1], commands[2]);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "mv") {
-                if (commands.size() != 3) {
-                    cout << "SYNOPSIS: mv [source_file_name] [dest_file_name]" << endl;
-                    continue;
-                }
-                try {
-                    fs.mv(commands[1], commands[2]);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "touch") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: touch [file_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    fs.touch(param);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "ls") {
-                if (commands.size() > 2) {
-                    cout << "SYNOPSIS: " << endl;
-                    cout << "   ls: list current working directory contents " << endl;
-                    cout << "   ls [file/dir_name]: list for specified param " << endl;
-                    continue;
-                }
-                if (commands.size() == 2) param = commands[1];
-                try {
-                    for(string file : fs.ls(param)) {
-                        cout << file << endl;
-                    }
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "cd") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: cd [directory_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    fs.cd(param);
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            }
-            else if (command == "pwd") {
-                if (commands.size() != 1) {
-                    cout << "SYNOPSIS: pwd – return working directory name" << endl;
-                    continue;
-                }
-                try {
-                    cout << fs.pwd() << endl;
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
+    string unixPath;
+    string script;
+    bool stopOnError = false;
+    bool persistent = false;
+    ClientMode clients = ClientMode::Shared;
+    string walPath;
+    string leaderPath;
+    string followPath;
+    string tracePath;
+    string hostDir;
+    int checkpointInterval = 300;
+    Durability durability = Durability::GroupCommit;
+    int tcpPort = -1;
+    int workerCount = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+        if (option == "--stop-on-error") {
+            stopOnError = true;
+            continue;
+        }
+        if (option == "--overlay") {
+            clients = ClientMode::Overlay;
+            continue;
+        }
+        if (option == "--persistent") {
+            persistent = true;
+            continue;
+        }
+        if (option == "--spans") {
+            enableSpans(true);
+            continue;
+        }
+        if (i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        if (option == "--batch") script = argv[++i];
+        else if (option == "--unix") unixPath = argv[++i];
+        else if (option == "--tcp") tcpPort = atoi(argv[++i]);
+        else if (option == "--workers") workerCount = max(1, atoi(argv[++i]));
+        else if (option == "--wal") walPath = argv[++i];
+        else if (option == "--leader") leaderPath = argv[++i];
+        else if (option == "--slowlog-threshold") setSlowThreshold(strtoull(argv[++i], nullptr, 10) * 1000);
+        else if (option == "--follow") followPath = argv[++i];
+        else if (option == "--record") tracePath = argv[++i];
+        else if (option == "--host-dir") hostDir = argv[++i];
+        else if (option == "--checkpoint-interval") checkpointInterval = max(0, atoi(argv[++i]));
+        else if (option == "--durability") {
+            string mode = argv[++i];
+            if (mode == "none") durability = Durability::None;
+            else if (mode == "group") durability = Durability::GroupCommit;
+            else if (mode == "per-op") durability = Durability::PerOp;
+            else {
+                usage();
+                return 1;
             }
-            else if (command == "find") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: find [file/dir_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    for(string file : fs.find(param)) {
-                        cout << file << endl;
-                    }
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
+        }
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    // A leader logs what it streams. A follower only applies the stream, and clients must not
+    // write to its tree, in overlays or not.
+    if ((!leaderPath.empty() && walPath.empty())
+            || (!followPath.empty() && (!walPath.empty() || !leaderPath.empty() || clients != ClientMode::Shared))) {
+        usage();
+        return 1;
+    }
+    if (persistent) {
+        if (!unixPath.empty() || tcpPort >= 0 || !walPath.empty() || !followPath.empty() || !tracePath.empty()
+                || clients != ClientMode::Shared) {
+            usage();
+            return 1;
+        }
+        ios::sync_with_stdio(false);
+        PersistentFileSystem tree;
+        return runInput(script, stopOnError, [&tree](const string& line) {
+            return runCommand(tree, tree.defaultSession(), line, cout);
+        });
+    }
+
+    unique_ptr<WriteAheadLog> wal;
+    unique_ptr<Checkpointer> checkpointer;
+    if (!walPath.empty()) {
+        try {
+            uint64_t lastLsn = Checkpointer::recover(fs, walPath);
+            wal.reset(new WriteAheadLog(walPath, durability, lastLsn));
+        } catch (const exception& e) {
+            cout << e.what() << endl;
+            return 1;
+        }
+        fs.attachLog(wal.get());
+        checkpointer.reset(new Checkpointer(fs, *wal, walPath));
+        if (checkpointInterval > 0) checkpointer->start(chrono::seconds(checkpointInterval));
+    }
+    unique_ptr<ReplicationLeader> leader;
+    unique_ptr<ReplicationFollower> follower;
+    unique_ptr<TraceRecorder> recorder;
+    try {
+        if (!tracePath.empty()) recorder.reset(new TraceRecorder(tracePath));
+        if (!leaderPath.empty()) {
+            leader.reset(new ReplicationLeader(fs, *wal));
+            leader->listenUnix(leaderPath);
+        }
+    } catch (const exception& e) {
+        cout << e.what() << endl;
+        return 1;
+    }
+    if (!followPath.empty()) {
+        follower.reset(new ReplicationFollower(fs, followPath));
+        clients = ClientMode::ReadOnly;
+    }
+
+    if (!unixPath.empty() || tcpPort >= 0) {
+        try {
+            FsServer fsServer(fs, workerCount, clients);
+            fsServer.record(recorder.get());
+            fsServer.setHostDir(hostDir);
+            if (!unixPath.empty()) {
+                fsServer.listenUnix(unixPath);
+                cout << "Listening on " << unixPath << endl;
             }
-            else if (command == "cat") {
-                if (commands.size() != 2) {
-                    cout << "SYNOPSIS: cat [file_name]" << endl;
-                    continue;
-                }
-                param = commands[1];
-                try {
-                    cout << fs.cat(param) << endl;
-                } catch (const std::invalid_argument& e) {
-                    cout << e.what() << endl;
-                }
-            } else {
-                cout << "command not found: " << command << endl;
+            if (tcpPort >= 0) {
+                cout << "Listening on 127.0.0.1:" << fsServer.listenTcp(tcpPort) << endl;
             }
+            server = &fsServer;
+            signal(SIGINT, stopServer);
+            signal(SIGTERM, stopServer);
+            fsServer.run();
+            server = nullptr;
+        } catch (const exception& e) {
+            cout << e.what() << endl;
+            return 1;
         }
+        return 0;
     }
 
-    return 0;
+    ios::sync_with_stdio(false);
+    FileSystem::Session session(fs, clients == ClientMode::ReadOnly);
+    return runInput(script, stopOnError, [&](const string& line) {
+        return runRecorded(fs, session, line, cout, recorder.get(), 0);
+    });
 }
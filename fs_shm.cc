@@ -0,0 +1,261 @@
+#include "fs_shm.h"
+
+#include <climits>
+#include <cstring>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace fsproto {
+
+namespace {
+
+const uint32_t kSegmentMagic = 0x46534d31;  // "FSM1"
+
+runtime_error systemError(const string& what) {
+    return runtime_error(what + ": " + strerror(errno));
+}
+
+// Wake the other process sleeping on the futex word (not FUTEX_PRIVATE: it's shared memory)
+void futexWake(atomic<uint32_t>& word) {
+    syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void futexWait(atomic<uint32_t>& word, uint32_t expected, const timespec* timeout) {
+    syscall(SYS_futex, (uint32_t*) &word, FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+}  // namespace
+
+/************************ ring ************************************/
+
+size_t ShmRing::write(char* data, uint32_t capacity, const char* src, size_t size) {
+    uint64_t end = tail.load(memory_order_relaxed);
+    uint64_t used = end - head.load(memory_order_acquire);
+    if (used > capacity) throw invalid_argument("Corrupt shared memory ring");
+    size_t n = min<size_t>(size, capacity - used);
+    if (n == 0) return 0;
+    size_t pos = end & (capacity - 1);
+    size_t first = min<size_t>(n, capacity - pos);
+    memcpy(data + pos, src, first);
+    memcpy(data, src + first, n - first);
+    // seq_cst: the waiting flag of the consumer is checked after this store
+    tail.store(end + n);
+    return n;
+}
+
+size_t ShmRing::read(const char* data, uint32_t capacity, string& dst) {
+    uint64_t start = head.load(memory_order_relaxed);
+    uint64_t n = tail.load(memory_order_acquire) - start;
+    if (n > capacity) throw invalid_argument("Corrupt shared memory ring");
+    if (n == 0) return 0;
+    size_t pos = start & (capacity - 1);
+    size_t first = min<size_t>(n, capacity - pos);
+    dst.append(data + pos, first);
+    dst.append(data, n - first);
+    head.store(start + n);
+    return n;
+}
+
+/************************ server end ******************************/
+
+ShmChannel::ShmChannel(uint32_t capacity) : capacity(capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1))) throw invalid_argument("Ring capacity must be a power of 2");
+    size = sizeof(ShmSegment) + 2 * size_t(capacity);
+    memFd = memfd_create("fs_shm", MFD_CLOEXEC);
+    if (memFd < 0) throw systemError("memfd_create");
+    if (ftruncate(memFd, size) < 0) {
+        ::close(memFd);
+        throw systemError("ftruncate");
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (addr == MAP_FAILED) {
+        ::close(memFd);
+        throw systemError("mmap");
+    }
+    segment = new (addr) ShmSegment();
+    segment->magic = kSegmentMagic;
+    segment->capacity = capacity;
+    doorbellFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+ShmChannel::~ShmChannel() {
+    munmap(segment, size);
+    ::close(memFd);
+    ::close(doorbellFd);
+}
+
+void ShmChannel::handOver(int socketFd) {
+    int fds[2] = {memFd, doorbellFd};
+    char ack = 'S';
+    iovec iov = {&ack, 1};
+    char control[CMSG_SPACE(sizeof(fds))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(socketFd, &msg, MSG_NOSIGNAL) != 1) throw systemError("sendmsg");
+}
+
+void ShmChannel::receive(string& in) {
+    ShmRing& ring = segment->requests;
+    // Awake: no need for the doorbell
+    ring.consumerWaiting.store(0);
+    if (ring.read(segment->requestData(), capacity, in) > 0 && ring.producerWaiting.exchange(0)) {
+        futexWake(ring.producerWaiting);
+    }
+}
+
+void ShmChannel::send(string& out) {
+    ShmRing& ring = segment->responses;
+    ring.producerWaiting.store(0);
+    size_t n = ring.write(segment->requestData() + capacity, capacity, out.data(), out.size());
+    out.erase(0, n);
+    if (n > 0 && ring.consumerWaiting.load() && ring.consumerWaiting.exchange(0)) {
+        futexWake(ring.consumerWaiting);
+    }
+}
+
+bool ShmChannel::armWakeup(bool requestsWanted, bool outputPending) {
+    if (requestsWanted) {
+        ShmRing& requests = segment->requests;
+        requests.consumerWaiting.store(1);
+        if (!requests.empty()) return false;
+    }
+    if (outputPending) {
+        ShmRing& responses = segment->responses;
+        responses.producerWaiting.store(1);
+        if (responses.tail.load() - responses.head.load() < capacity) return false;
+    }
+    return true;
+}
+
+/************************ client end ******************************/
+
+ShmClient::ShmClient(const string& path) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw invalid_argument("Socket path too long: " + path);
+    strcpy(addr.sun_path, path.c_str());
+    socketFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socketFd < 0) throw systemError("socket");
+    if (connect(socketFd, (sockaddr*) &addr, sizeof(addr)) < 0
+            || ::send(socketFd, kShmMagic, sizeof(kShmMagic), MSG_NOSIGNAL) != sizeof(kShmMagic)) {
+        ::close(socketFd);
+        throw systemError("Cannot connect to " + path);
+    }
+
+    int fds[2];
+    char ack;
+    iovec iov = {&ack, 1};
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg;
+    if (recvmsg(socketFd, &msg, MSG_CMSG_CLOEXEC) != 1 || !(cmsg = CMSG_FIRSTHDR(&msg))
+            || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        ::close(socketFd);
+        throw runtime_error("No shared memory segment from " + path);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    doorbellFd = fds[1];
+
+    struct stat st;
+    void* mapped = MAP_FAILED;
+    if (fstat(fds[0], &st) == 0) {
+        size = st.st_size;
+        mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    ::close(fds[0]);
+    if (mapped == MAP_FAILED || ((ShmSegment*) mapped)->magic != kSegmentMagic) {
+        if (mapped != MAP_FAILED) munmap(mapped, size);
+        ::close(doorbellFd);
+        ::close(socketFd);
+        throw runtime_error("Bad shared memory segment from " + path);
+    }
+    segment = (ShmSegment*) mapped;
+}
+
+ShmClient::~ShmClient() {
+    munmap(segment, size);
+    ::close(doorbellFd);
+    ::close(socketFd);
+}
+
+void ShmClient::ringDoorbell() {
+    uint64_t one = 1;
+    ssize_t ignored = ::write(doorbellFd, &one, sizeof(one));
+    (void) ignored;
+}
+
+// Sleep until woken up through the futex word, checking now and then that the server is
+// still there: it closes the socket when it goes away.
+void ShmClient::wait(atomic<uint32_t>& word) {
+    timespec timeout = {0, 100 * 1000 * 1000};
+    futexWait(word, 1, &timeout);
+    pollfd pfd = {socketFd, POLLRDHUP, 0};
+    if (poll(&pfd, 1, 0) > 0) throw runtime_error("Server closed the connection");
+}
+
+void ShmClient::send(const Request& request) {
+    encoded.clear();
+    encodeRequest(request, encoded);
+    ShmRing& ring = segment->requests;
+    size_t sent = 0;
+    while (sent < encoded.size()) {
+        size_t n = ring.write(segment->requestData(), segment->capacity, encoded.data() + sent, encoded.size() - sent);
+        if (n > 0) {
+            sent += n;
+            if (ring.consumerWaiting.load() && ring.consumerWaiting.exchange(0)) ringDoorbell();
+            continue;
+        }
+        ring.producerWaiting.store(1);
+        if (ring.tail.load() - ring.head.load() < segment->capacity) {
+            ring.producerWaiting.store(0);
+            continue;
+        }
+        wait(ring.producerWaiting);
+    }
+}
+
+Response ShmClient::receive() {
+    ShmRing& ring = segment->responses;
+    Response response;
+    while (true) {
+        size_t len = decodeResponse(received.data(), received.size(), response);
+        if (len > 0) {
+            received.erase(0, len);
+            return response;
+        }
+        if (ring.read(segment->responseData(), segment->capacity, received) > 0) {
+            if (ring.producerWaiting.load() && ring.producerWaiting.exchange(0)) ringDoorbell();
+            continue;
+        }
+        ring.consumerWaiting.store(1);
+        if (!ring.empty()) {
+            ring.consumerWaiting.store(0);
+            continue;
+        }
+        wait(ring.consumerWaiting);
+    }
+}
+
+}  // namespace fsproto
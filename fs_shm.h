@@ -0,0 +1,109 @@
+#ifndef FS_SHM_H
+#define FS_SHM_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "fs_protocol.h"
+
+using namespace std;
+
+/* Shared memory transport for clients on the same host
+   A client connects to the server's unix domain socket and sends the 4 byte magic
+   kShmMagic. The server answers with two fds (SCM_RIGHTS): a memfd holding the segment, and
+   an eventfd doorbell. From then on requests and responses of the binary protocol
+   (fs_protocol.h) move through two single producer single consumer byte rings in the
+   segment, without syscalls while both sides are busy. The socket only tells the server
+   when the client is gone.
+
+   Wakeups: a side that finds a ring empty (consumer) or full (producer) sets its waiting
+   flag in the ring and sleeps; the other side clears the flag after moving the ring and
+   wakes it up. Clients sleep on a futex on the flag. The server sleeps in its epoll loop,
+   which can't wait on a futex, so clients wake it with the doorbell instead.
+*/
+namespace fsproto {
+
+const char kShmMagic[4] = {'\0', 'F', 'S', 'M'};
+
+// Byte ring in shared memory: the producer only moves tail, the consumer only moves head.
+// Positions grow forever, data lives at position % capacity. The other process may write
+// anything to the positions: a ring holding more than capacity bytes is corrupt.
+struct ShmRing {
+    alignas(64) atomic<uint64_t> head;
+    alignas(64) atomic<uint64_t> tail;
+    // Futex words, 1 while that side is sleeping (or about to)
+    alignas(64) atomic<uint32_t> consumerWaiting;
+    atomic<uint32_t> producerWaiting;
+
+    // Copy up to size bytes in/out of the ring whose data area is data. Return bytes copied.
+    // Throw invalid_argument if the positions are corrupt, before touching data.
+    size_t write(char* data, uint32_t capacity, const char* src, size_t size);
+    size_t read(const char* data, uint32_t capacity, string& dst);
+    bool empty() { return head.load() == tail.load(); }
+};
+
+// Mapped segment: header, then the request ring data, then the response ring data
+struct ShmSegment {
+    uint32_t magic;
+    uint32_t capacity;
+    ShmRing requests;
+    ShmRing responses;
+
+    char* requestData() { return (char*) (this + 1); }
+    char* responseData() { return requestData() + capacity; }
+};
+
+// Server end of a shared memory connection. The client can write anything to the segment: the
+// server keeps its own capacity, and receive() and send() throw invalid_argument on corrupt
+// rings, after which the connection must be closed.
+class ShmChannel {
+    ShmSegment* segment;
+    size_t size;
+    uint32_t capacity;
+    int memFd;
+    int doorbellFd;
+  public:
+    // Create a segment with rings of capacity bytes (a power of 2)
+    explicit ShmChannel(uint32_t capacity);
+    ~ShmChannel();
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+
+    // Send the segment and doorbell fds to the client over its unix domain socket
+    void handOver(int socketFd);
+    int doorbell() { return doorbellFd; }
+    // Append available request bytes to in, and wake the client if it waits for space
+    void receive(string& in);
+    // Move as much of out as fits to the response ring, and wake the client if it waits
+    void send(string& out);
+    // Before the server sleeps: ask the client to ring the doorbell for new requests (unless
+    // the server takes none now) or free response space. Return false if there's work already,
+    // so the server must not sleep.
+    bool armWakeup(bool requestsWanted, bool outputPending);
+};
+
+// Client end of a shared memory connection. Not thread safe.
+class ShmClient {
+    int socketFd;
+    ShmSegment* segment;
+    size_t size;
+    int doorbellFd;
+    string received;
+    string encoded;
+    void ringDoorbell();
+    void wait(atomic<uint32_t>& word);
+  public:
+    // Connect to the server's unix domain socket
+    explicit ShmClient(const string& path);
+    ~ShmClient();
+    ShmClient(const ShmClient&) = delete;
+    ShmClient& operator=(const ShmClient&) = delete;
+
+    // Queue a request, waiting while the request ring is full
+    void send(const Request& request);
+    // Wait for the next response
+    Response receive();
+};
+
+}  // namespace fsproto
+#endif
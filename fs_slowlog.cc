@@ -0,0 +1,71 @@
+#include "fs_slowlog.h"
+
+#include <mutex>
+
+using namespace std;
+
+thread_local OpWork opWork;
+atomic<uint64_t> slowThresholdNs{0};
+
+namespace {
+
+// Slow ops are rare: a lock is cheap enough
+struct SlowLog {
+    mutex lock;
+    vector<SlowOp> ring;
+    // Once the ring is full, the oldest op, which the next one replaces
+    size_t oldest = 0;
+    // Ops logged so far
+    uint64_t count = 0;
+};
+
+// Never destroyed: ops may run after static destructors ran
+SlowLog& slowLog() {
+    static SlowLog* log = new SlowLog();
+    return *log;
+}
+
+}  // namespace
+
+void setSlowThreshold(uint64_t ns) {
+    slowThresholdNs.store(ns, memory_order_relaxed);
+}
+
+string SlowOp::format() const {
+    return "ts_us=" + to_string(timestampUs) + " op=" + op + " session=" + to_string(session) + " duration_ns="
+           + to_string(durationNs) + " nodes=" + to_string(work.nodes) + " bytes=" + to_string(work.bytes)
+           + " lock_wait_ns=" + to_string(work.lockWaitNs) + " path=" + path;
+}
+
+void logSlowOp(SlowOp op) {
+    SlowLog& log = slowLog();
+    lock_guard<mutex> guard(log.lock);
+    if (log.ring.size() < kSlowLogSize) {
+        log.ring.push_back(move(op));
+    } else {
+        log.ring[log.oldest] = move(op);
+        log.oldest = (log.oldest + 1) % kSlowLogSize;
+    }
+    log.count++;
+}
+
+vector<SlowOp> slowOps() {
+    SlowLog& log = slowLog();
+    lock_guard<mutex> guard(log.lock);
+    vector<SlowOp> ops(log.ring.begin() + log.oldest, log.ring.end());
+    ops.insert(ops.end(), log.ring.begin(), log.ring.begin() + log.oldest);
+    return ops;
+}
+
+uint64_t slowOpCount() {
+    SlowLog& log = slowLog();
+    lock_guard<mutex> guard(log.lock);
+    return log.count;
+}
+
+void clearSlowOps() {
+    SlowLog& log = slowLog();
+    lock_guard<mutex> guard(log.lock);
+    log.ring.clear();
+    log.oldest = 0;
+}
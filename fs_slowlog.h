@@ -0,0 +1,60 @@
+#ifndef FS_SLOWLOG_H
+#define FS_SLOWLOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Slow log: FS ops that took longer than a threshold, with what they did
+   With a threshold set, every op slower than it is kept in a ring of the last kSlowLogSize,
+   with its path, its session and a breakdown of its work: nodes it visited, content bytes it
+   copied and how long it waited for the tree lock. That's what tells a pathological path (a
+   very deep tree, a huge directory, a writer holding the lock) from a busy machine.
+   Without a threshold (the default), ops only count their work in thread local counters.
+*/
+const size_t kSlowLogSize = 1024;
+
+// Work of the op the calling thread runs, reset as the op starts
+struct OpWork {
+    // Nodes visited: path components walked, children listed or searched, nodes copied or freed
+    uint64_t nodes = 0;
+    // File content copied: read by cat, appended or copied up by write
+    uint64_t bytes = 0;
+    uint64_t lockWaitNs = 0;
+};
+
+extern thread_local OpWork opWork;
+extern atomic<uint64_t> slowThresholdNs;
+
+inline void countNodes(uint64_t n = 1) { opWork.nodes += n; }
+inline void countBytes(uint64_t n) { opWork.bytes += n; }
+
+// Ops taking at least ns are logged, none with 0
+void setSlowThreshold(uint64_t ns);
+inline uint64_t slowThreshold() { return slowThresholdNs.load(memory_order_relaxed); }
+
+struct SlowOp {
+    // When the op started, in microseconds since the epoch
+    uint64_t timestampUs = 0;
+    // Name of the op, e.g. "cat"
+    const char* op = "";
+    // Params of the op: its path, or "from to" for mv and cp
+    string path;
+    uint64_t session = 0;
+    uint64_t durationNs = 0;
+    OpWork work;
+
+    // e.g. "ts_us=1700000000123456 op=cat session=3 duration_ns=5210000 nodes=4 bytes=1048576
+    // lock_wait_ns=5100000 path=/a/b/c"
+    string format() const;
+};
+
+void logSlowOp(SlowOp op);
+// Ops in the ring, oldest first, and the number logged since the process started
+vector<SlowOp> slowOps();
+uint64_t slowOpCount();
+void clearSlowOps();
+#endif
@@ -0,0 +1,116 @@
+#include "fs_slowlog.h"
+
+#include <sstream>
+
+#include "fs_command.h"
+#include "gtest/gtest.h"
+
+/* Test logging slow ops. The slow log is process wide: tests set a threshold, clear the ops
+   logged before, and set the threshold back to 0 when done. */
+namespace {
+
+// Tests ops over the threshold are logged with their params, session and work, and none without one
+TEST(SlowLog, TestOps) {
+    FileSystem fs;
+    FileSystem::Session session(fs, false, 7);
+    fs.mkdir(session, "/a/b/c");
+    fs.cd(session, "a");
+    fs.touch(session, "f");
+    fs.write(session, "/a/f", "hello");
+
+    setSlowThreshold(1);
+    clearSlowOps();
+    uint64_t logged = slowOpCount();
+    EXPECT_EQ("hello", fs.cat(session, "/a/f"));
+    EXPECT_EQ(vector<string>({"b", "f"}), fs.ls(session, "."));
+    fs.cp(session, "/a/b", "/a/d", true);
+    EXPECT_THROW(fs.cat(session, "/a/missing"), invalid_argument);
+    fs.cat(fs.defaultSession(), "a/f");
+    setSlowThreshold(0);
+    fs.cat(session, "f");
+
+    vector<SlowOp> ops = slowOps();
+    ASSERT_EQ(5, ops.size());
+    EXPECT_EQ(logged + 5, slowOpCount());
+    EXPECT_EQ("cat", string(ops[0].op));
+    EXPECT_EQ("/a/f", ops[0].path);
+    EXPECT_EQ(7, ops[0].session);
+    EXPECT_GT(ops[0].durationNs, 0);
+    EXPECT_GT(ops[0].timestampUs, 0);
+    EXPECT_EQ(2, ops[0].work.nodes);
+    EXPECT_EQ(5, ops[0].work.bytes);
+    // Children listed
+    EXPECT_EQ("ls", string(ops[1].op));
+    EXPECT_EQ(".", ops[1].path);
+    EXPECT_EQ(2, ops[1].work.nodes);
+    // Paths walked to the source, the destination and its parent, then b and c copied
+    EXPECT_EQ("cp", string(ops[2].op));
+    EXPECT_EQ("/a/b /a/d", ops[2].path);
+    EXPECT_EQ(2 + 1 + 1 + 2, ops[2].work.nodes);
+    EXPECT_EQ(0, ops[2].work.bytes);
+    // Failed ops are logged too
+    EXPECT_EQ("cat", string(ops[3].op));
+    EXPECT_EQ(0, ops[3].work.bytes);
+    EXPECT_EQ(0, ops[4].session);
+    EXPECT_EQ("a/f", ops[4].path);
+
+    string line = ops[0].format();
+    EXPECT_EQ(0, line.find("ts_us="));
+    EXPECT_NE(string::npos, line.find(" op=cat session=7 duration_ns="));
+    EXPECT_NE(string::npos, line.find(" nodes=2 bytes=5 lock_wait_ns="));
+    EXPECT_EQ(line.size() - 10, line.find(" path=/a/f"));
+    clearSlowOps();
+}
+
+// Tests the log keeps the last kSlowLogSize ops, oldest first
+TEST(SlowLog, TestRing) {
+    clearSlowOps();
+    uint64_t logged = slowOpCount();
+    for (uint64_t i = 0; i < kSlowLogSize + 10; i++) {
+        SlowOp op;
+        op.op = "ls";
+        op.durationNs = i;
+        logSlowOp(op);
+    }
+    vector<SlowOp> ops = slowOps();
+    ASSERT_EQ(kSlowLogSize, ops.size());
+    EXPECT_EQ(10, ops.front().durationNs);
+    EXPECT_EQ(kSlowLogSize + 9, ops.back().durationNs);
+    EXPECT_EQ(logged + kSlowLogSize + 10, slowOpCount());
+
+    clearSlowOps();
+    EXPECT_TRUE(slowOps().empty());
+    SlowOp op;
+    op.durationNs = 1;
+    logSlowOp(op);
+    ASSERT_EQ(1, slowOps().size());
+    EXPECT_EQ(1, slowOps()[0].durationNs);
+    clearSlowOps();
+}
+
+// Tests the slowlog command sets the threshold, prints the ops logged and clears them
+TEST(SlowLog, TestCommand) {
+    FileSystem fs;
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "slowlog clear", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "slowlog threshold 0", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /fast", out));
+    setSlowThreshold(1);
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /slow", out));
+    setSlowThreshold(0);
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "slowlog", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "slowlog threshold", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "slowlog threshold -1", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "slowlog all", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "slowlog threshold 250", out));
+    EXPECT_EQ(250000, slowThreshold());
+    setSlowThreshold(0);
+
+    string lines = out.str();
+    EXPECT_NE(string::npos, lines.find("threshold_us=0 logged="));
+    EXPECT_NE(string::npos, lines.find(" op=mkdir session=0 "));
+    EXPECT_NE(string::npos, lines.find(" path=/slow\n"));
+    EXPECT_EQ(string::npos, lines.find(" path=/fast\n"));
+    clearSlowOps();
+}
+}  // namespace
@@ -0,0 +1,141 @@
+#include "fs_snapshot.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <new>
+#include <stdexcept>
+
+using namespace std;
+
+namespace {
+
+BackgroundSnapshot::Progress* mapProgress() {
+    void* mapped = mmap(nullptr, sizeof(BackgroundSnapshot::Progress), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw runtime_error(string("Cannot map snapshot progress: ") + strerror(errno));
+    return new (mapped) BackgroundSnapshot::Progress();
+}
+
+// Child side: report what failed through the shared mapping
+void reportError(BackgroundSnapshot::Progress& progress, const exception& e) {
+    strncpy(progress.error, e.what(), sizeof(progress.error) - 1);
+    progress.error[sizeof(progress.error) - 1] = '\0';
+}
+
+// Wait for pid, and return why it failed, or an empty string if it succeeded
+string waitChild(pid_t pid, const BackgroundSnapshot::Progress& progress) {
+    int status = 0;
+    pid_t waited;
+    do {
+        waited = waitpid(pid, &status, 0);
+    } while (waited < 0 && errno == EINTR);
+    if (waited < 0) return string("cannot wait for it: ") + strerror(errno);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) return "";
+    if (progress.error[0]) return progress.error;
+    if (WIFSIGNALED(status)) return "killed by signal " + to_string(WTERMSIG(status));
+    return "exit status " + to_string(WEXITSTATUS(status));
+}
+
+}  // namespace
+
+/************************ background snapshots **********************/
+
+BackgroundSnapshot::BackgroundSnapshot() : progress(mapProgress()) {}
+
+BackgroundSnapshot::~BackgroundSnapshot() {
+    if (reaper.joinable()) reaper.join();
+    munmap(progress, sizeof(Progress));
+}
+
+void BackgroundSnapshot::start(const string& path, const function<void(int fd, Progress& progress)>& write) {
+    lock_guard<mutex> guard(lock);
+    if (child) throw invalid_argument("Snapshot already running: " + this->path);
+    // The previous reaper is done, or child would be set
+    if (reaper.joinable()) reaper.join();
+
+    progress->done = 0;
+    progress->total = 0;
+    progress->error[0] = '\0';
+    pid_t pid = fork();
+    if (pid < 0) throw runtime_error(string("Cannot fork snapshot: ") + strerror(errno));
+    if (pid == 0) {
+        // Child: only this thread exists, and exit must not run the parent's cleanup
+        string tmpPath = path + ".tmp";
+        try {
+            int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0) throw runtime_error("Cannot create " + tmpPath + ": " + strerror(errno));
+            write(fd, *progress);
+            if (fsync(fd) < 0) throw runtime_error("Cannot sync " + tmpPath + ": " + strerror(errno));
+            close(fd);
+            if (rename(tmpPath.c_str(), path.c_str()) < 0) {
+                throw runtime_error("Cannot rename " + tmpPath + ": " + strerror(errno));
+            }
+        } catch (const exception& e) {
+            reportError(*progress, e);
+            unlink(tmpPath.c_str());
+            _exit(1);
+        }
+        _exit(0);
+    }
+    this->path = path;
+    child = pid;
+    result.clear();
+    reaper = thread([this, pid]() { reap(pid); });
+}
+
+void BackgroundSnapshot::reap(pid_t pid) {
+    string error = waitChild(pid, *progress);
+    lock_guard<mutex> guard(lock);
+    if (error.empty()) {
+        result = "Snapshot " + path + " done: " + to_string(progress->total.load()) + " nodes";
+    } else {
+        result = "Snapshot " + path + " failed: " + error;
+    }
+    child = 0;
+}
+
+string BackgroundSnapshot::status() {
+    lock_guard<mutex> guard(lock);
+    if (child) {
+        return "Snapshot " + path + " running: " + to_string(progress->done.load()) + "/"
+               + to_string(progress->total.load()) + " nodes";
+    }
+    return path.empty() ? "No snapshot" : result;
+}
+
+/************************ forked writes **********************/
+
+ForkedWrite::ForkedWrite(int fd, const function<void(int fd, BackgroundSnapshot::Progress& progress)>& write)
+        : progress(mapProgress()) {
+    child = fork();
+    if (child < 0) {
+        int error = errno;
+        munmap(progress, sizeof(BackgroundSnapshot::Progress));
+        throw runtime_error(string("Cannot fork image writer: ") + strerror(error));
+    }
+    if (child == 0) {
+        // Child: only this thread exists, and exit must not run the parent's cleanup
+        try {
+            write(fd, *progress);
+        } catch (const exception& e) {
+            reportError(*progress, e);
+            _exit(1);
+        }
+        _exit(0);
+    }
+}
+
+ForkedWrite::~ForkedWrite() {
+    if (child) waitChild(child, *progress);
+    munmap(progress, sizeof(BackgroundSnapshot::Progress));
+}
+
+void ForkedWrite::wait() {
+    string error = waitChild(child, *progress);
+    child = 0;
+    if (!error.empty()) throw runtime_error("Cannot write image: " + error);
+}
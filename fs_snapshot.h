@@ -0,0 +1,73 @@
+#ifndef FS_SNAPSHOT_H
+#define FS_SNAPSHOT_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/* Point in time snapshots written by a forked child
+   The child gets a copy-on-write copy of the parent's memory as it was at fork(), so it can
+   write a consistent image at its own pace while the parent keeps serving. The parent only
+   pauses for the fork itself. Progress and errors come back through a shared mapping, and a
+   reaper thread collects the child's exit status.
+*/
+class BackgroundSnapshot {
+  public:
+    // Shared between the parent and the child
+    struct Progress {
+        atomic<uint64_t> done;
+        atomic<uint64_t> total;
+        char error[256];
+    };
+
+  private:
+    mutex lock;
+    // Shared mapping of the current or last snapshot
+    Progress* progress;
+    string path;
+    pid_t child = 0;
+    // Outcome of the last finished snapshot, empty while one runs
+    string result;
+    thread reaper;
+
+    void reap(pid_t pid);
+  public:
+    BackgroundSnapshot();
+    // Waits for a running child
+    ~BackgroundSnapshot();
+    BackgroundSnapshot(const BackgroundSnapshot&) = delete;
+    BackgroundSnapshot& operator=(const BackgroundSnapshot&) = delete;
+
+    // Fork a child calling write on a temporary file, which is renamed to path once written
+    // and synced. Callers make sure the state write reads is consistent during the fork.
+    // Throw invalid_argument if a snapshot is running already.
+    void start(const string& path, const function<void(int fd, Progress& progress)>& write);
+    // Describe the running or last snapshot
+    string status();
+};
+
+/* An image written to an open file by a forked child, for callers waiting for the image but
+   not wanting to hold others up while it's written (checkpoints, images sent to followers):
+   they keep the state consistent during the constructor's fork only, then wait().
+*/
+class ForkedWrite {
+    BackgroundSnapshot::Progress* progress;
+    pid_t child;
+  public:
+    // Fork a child calling write on fd
+    ForkedWrite(int fd, const function<void(int fd, BackgroundSnapshot::Progress& progress)>& write);
+    // Waits for the child, if wait() didn't
+    ~ForkedWrite();
+    ForkedWrite(const ForkedWrite&) = delete;
+    ForkedWrite& operator=(const ForkedWrite&) = delete;
+
+    // Wait for the child to exit. Throw runtime_error if it failed.
+    void wait();
+};
+#endif
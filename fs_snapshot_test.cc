@@ -0,0 +1,77 @@
+#include "fs_impl.h"
+
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+/* Test snapshots written by a forked child */
+namespace {
+
+// Wait for the running snapshot of fs to finish, and return its status
+string waitSnapshot(FileSystem& fs) {
+    string status;
+    while ((status = fs.snapshotStatus()).find(" running: ") != string::npos) {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    return status;
+}
+
+// Tests a snapshot holds the tree as of the command, while the FS keeps changing
+TEST(Snapshot, TestSnapshot) {
+    string path = "/tmp/fs_snapshot_test." + to_string(getpid());
+    FileSystem fs;
+    EXPECT_EQ("No snapshot", fs.snapshotStatus());
+    fs.mkdir("/a/b");
+    fs.touch("f");
+    fs.write("f", "before");
+    fs.snapshot(path);
+    fs.write("f", " after");
+    fs.mkdir("c");
+    EXPECT_EQ("Snapshot " + path + " done: 4 nodes", waitSnapshot(fs));
+
+    FileSystem copy;
+    EXPECT_EQ(0, copy.load(path));
+    EXPECT_EQ((vector<string>{"a", "f"}), copy.ls("/"));
+    EXPECT_EQ("before", copy.cat("f"));
+    EXPECT_EQ(vector<string>{"b"}, copy.ls("a"));
+
+    // Snapshot of a tree loaded from an image
+    copy.write("f", "!");
+    copy.snapshot(path);
+    EXPECT_EQ("Snapshot " + path + " done: 4 nodes", waitSnapshot(copy));
+    FileSystem again;
+    again.load(path);
+    EXPECT_EQ("before!", again.cat("f"));
+    unlink(path.c_str());
+}
+
+// Tests a failing snapshot reports its error, and the next one can run
+TEST(Snapshot, TestFailure) {
+    FileSystem fs;
+    fs.snapshot("/nonexistent/dir/image");
+    string status = waitSnapshot(fs);
+    EXPECT_EQ(0, status.find("Snapshot /nonexistent/dir/image failed: Cannot create")) << status;
+
+    string path = "/tmp/fs_snapshot_test." + to_string(getpid());
+    fs.snapshot(path);
+    EXPECT_EQ("Snapshot " + path + " done: 1 nodes", waitSnapshot(fs));
+    unlink(path.c_str());
+}
+
+// Tests only one snapshot runs at a time
+TEST(Snapshot, TestOneAtATime) {
+    string path = "/tmp/fs_snapshot_test." + to_string(getpid());
+    FileSystem fs;
+    for (int i = 0; i < 2000; i++) fs.mkdir("d" + to_string(i));
+    fs.snapshot(path);
+    try {
+        // The first one may be done already
+        fs.snapshot(path);
+    } catch (const invalid_argument& e) {
+        EXPECT_EQ("Snapshot already running: " + path, string(e.what()));
+    }
+    EXPECT_EQ("Snapshot " + path + " done: 2001 nodes", waitSnapshot(fs));
+    unlink(path.c_str());
+}
+
+}  // namespace
@@ -0,0 +1,206 @@
+#include "fs_spans.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+atomic<bool> spansOn{false};
+
+namespace {
+
+const char* const kPhaseNames[] = {"request", "parse", "resolve", "lock", "op", "respond"};
+static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) == size_t(SpanPhase::Count), "A phase without a name");
+
+// Rings of exited threads kept for dumps, newest first
+const size_t kRetiredRings = 64;
+
+// A span in a ring. Only the owning thread writes it, as a seqlock: seq is 0 while the
+// fields change, then the index of the span plus one, so readers tell a torn read.
+struct Slot {
+    atomic<uint64_t> seq{0};
+    atomic<uint8_t> phase{0};
+    atomic<const char*> label{nullptr};
+    atomic<uint64_t> request{0};
+    atomic<uint64_t> start{0};
+    atomic<uint64_t> end{0};
+};
+
+struct Ring {
+    // Thread id in dumps, from 1
+    uint64_t tid;
+    // Spans written so far, by the owning thread only
+    atomic<uint64_t> head{0};
+    Slot slots[kSpanRingSize];
+};
+
+struct Registry {
+    mutex lock;
+    vector<Ring*> rings;
+    vector<Ring*> retired;
+    uint64_t threadCount = 0;
+};
+
+// Never destroyed: threads may exit after static destructors ran
+Registry& registry() {
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+// Spans starting before this were cleared
+atomic<uint64_t> clearedAt{0};
+atomic<uint64_t> nextRequest{1};
+thread_local uint64_t currentRequest = 0;
+thread_local RequestSpan* currentSpan = nullptr;
+
+// The ring of the calling thread, made on its first span and retired when it exits
+class ThreadRing {
+    Ring* ring = nullptr;
+  public:
+    Ring& get() {
+        if (ring) return *ring;
+        ring = new Ring();
+        Registry& r = registry();
+        lock_guard<mutex> guard(r.lock);
+        ring->tid = ++r.threadCount;
+        r.rings.push_back(ring);
+        return *ring;
+    }
+    ~ThreadRing() {
+        if (!ring) return;
+        Registry& r = registry();
+        lock_guard<mutex> guard(r.lock);
+        r.rings.erase(find(r.rings.begin(), r.rings.end(), ring));
+        r.retired.insert(r.retired.begin(), ring);
+        if (r.retired.size() > kRetiredRings) {
+            delete r.retired.back();
+            r.retired.pop_back();
+        }
+    }
+};
+
+thread_local ThreadRing threadRing;
+
+struct SpanCopy {
+    uint64_t tid;
+    SpanPhase phase;
+    const char* label;
+    uint64_t request;
+    uint64_t start;
+    uint64_t end;
+};
+
+// Copy the spans of a ring not overwritten meanwhile, nor cleared. The owner may be writing.
+void readRing(const Ring& ring, vector<SpanCopy>& spans) {
+    uint64_t head = ring.head.load(memory_order_acquire);
+    uint64_t first = head > kSpanRingSize ? head - kSpanRingSize : 0;
+    uint64_t cleared = clearedAt.load(memory_order_relaxed);
+    for (uint64_t i = first; i < head; i++) {
+        const Slot& slot = ring.slots[i % kSpanRingSize];
+        uint64_t seq = slot.seq.load(memory_order_acquire);
+        SpanCopy span = {ring.tid, SpanPhase(slot.phase.load(memory_order_relaxed)),
+                         slot.label.load(memory_order_relaxed), slot.request.load(memory_order_relaxed),
+                         slot.start.load(memory_order_relaxed), slot.end.load(memory_order_relaxed)};
+        atomic_thread_fence(memory_order_acquire);
+        if (seq != i + 1 || slot.seq.load(memory_order_relaxed) != seq) continue;
+        if (span.start < cleared) continue;
+        spans.push_back(span);
+    }
+}
+
+vector<SpanCopy> readAll() {
+    vector<SpanCopy> spans;
+    Registry& r = registry();
+    lock_guard<mutex> guard(r.lock);
+    for (Ring* ring : r.retired) readRing(*ring, spans);
+    for (Ring* ring : r.rings) readRing(*ring, spans);
+    return spans;
+}
+
+}  // namespace
+
+/************************ recording *******************************/
+
+void enableSpans(bool on) {
+    spansOn.store(on, memory_order_relaxed);
+}
+
+const char* phaseName(SpanPhase phase) {
+    return kPhaseNames[size_t(phase)];
+}
+
+uint64_t spanClock() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void recordSpan(SpanPhase phase, uint64_t startNs, uint64_t endNs, const char* label) {
+    Ring& ring = threadRing.get();
+    uint64_t index = ring.head.load(memory_order_relaxed);
+    Slot& slot = ring.slots[index % kSpanRingSize];
+    slot.seq.store(0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot.phase.store(uint8_t(phase), memory_order_relaxed);
+    slot.label.store(label, memory_order_relaxed);
+    slot.request.store(currentRequest, memory_order_relaxed);
+    slot.start.store(startNs, memory_order_relaxed);
+    slot.end.store(endNs, memory_order_relaxed);
+    slot.seq.store(index + 1, memory_order_release);
+    ring.head.store(index + 1, memory_order_release);
+}
+
+RequestSpan::RequestSpan(const char* label)
+        : label(label), start(0), outerId(currentRequest), outer(currentSpan) {
+    if (!spansEnabled()) return;
+    start = spanClock();
+    currentRequest = nextRequest.fetch_add(1, memory_order_relaxed);
+    currentSpan = this;
+}
+
+RequestSpan::~RequestSpan() {
+    if (!start) return;
+    recordSpan(SpanPhase::Request, start, spanClock(), label);
+    currentRequest = outerId;
+    currentSpan = outer;
+}
+
+void RequestSpan::labelCurrent(const char* label) {
+    if (currentSpan) currentSpan->label = label;
+}
+
+/************************ dumps ***********************************/
+
+size_t dumpSpans(ostream& out) {
+    vector<SpanCopy> spans = readAll();
+    sort(spans.begin(), spans.end(), [](const SpanCopy& a, const SpanCopy& b) { return a.start < b.start; });
+    int pid = getpid();
+    out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    char number[64];
+    for (size_t i = 0; i < spans.size(); i++) {
+        const SpanCopy& span = spans[i];
+        out << (i ? ",\n" : "\n") << "{\"name\":\"" << phaseName(span.phase);
+        if (span.label) out << ' ' << span.label;
+        out << "\",\"cat\":\"fs\",\"ph\":\"X\"";
+        // Microseconds, to the nanosecond
+        snprintf(number, sizeof(number), "%.3f", span.start / 1000.0);
+        out << ",\"ts\":" << number;
+        snprintf(number, sizeof(number), "%.3f", (span.end - span.start) / 1000.0);
+        out << ",\"dur\":" << number << ",\"pid\":" << pid << ",\"tid\":" << span.tid;
+        if (span.request) out << ",\"args\":{\"request\":" << span.request << "}";
+        out << "}";
+    }
+    out << "\n]}\n";
+    return spans.size();
+}
+
+size_t spanCount() {
+    return readAll().size();
+}
+
+void clearSpans() {
+    clearedAt.store(spanClock(), memory_order_relaxed);
+}
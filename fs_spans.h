@@ -0,0 +1,85 @@
+#ifndef FS_SPANS_H
+#define FS_SPANS_H
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+using namespace std;
+
+/* Spans of the phases of every request, for chrome://tracing and ui.perfetto.dev
+   While spans are on, each thread records when the phases of the requests it runs start and
+   how long they take: the request as a whole, parsing it, resolving paths, waiting for the
+   tree lock, the FS op and writing the response. A thread writes its spans to a ring of its
+   own holding the last kRingSize, without locks; dumpSpans() reads all rings while they're
+   written and prints the spans as Chrome JSON trace events, e.g.
+   {"name":"lock","ph":"X","ts":1234.567,"dur":20.1,"pid":1,"tid":3,"args":{"request":17}}
+   Spans are off by default, which costs a relaxed load per phase.
+*/
+enum class SpanPhase : uint8_t {
+    Request,
+    Parse,
+    Resolve,
+    Lock,
+    Op,
+    Respond,
+    Count,
+};
+
+// Spans kept per thread: older ones are overwritten
+const uint64_t kSpanRingSize = 1 << 14;
+
+extern atomic<bool> spansOn;
+
+inline bool spansEnabled() { return spansOn.load(memory_order_relaxed); }
+void enableSpans(bool on);
+const char* phaseName(SpanPhase phase);
+
+// Nanoseconds of the steady clock, which OpTimer uses too
+uint64_t spanClock();
+
+// Record a span of the calling thread, belonging to its current request (see RequestSpan).
+// label names what ran (an op, a command), and must be a static string or null.
+void recordSpan(SpanPhase phase, uint64_t startNs, uint64_t endNs, const char* label = nullptr);
+
+// Print the spans of all threads as a Chrome JSON trace, oldest first. Return the number of spans.
+size_t dumpSpans(ostream& out);
+// Number of spans the rings hold
+size_t spanCount();
+// Forget the spans recorded so far
+void clearSpans();
+
+// Records a span from its construction to the end of its scope, if spans are on then
+class Span {
+    SpanPhase phase;
+    const char* label;
+    uint64_t start;
+  public:
+    explicit Span(SpanPhase phase, const char* label = nullptr)
+            : phase(phase), label(label), start(spansEnabled() ? spanClock() : 0) {}
+    ~Span() { end(); }
+    // End the span before its scope does
+    void end() {
+        if (start) recordSpan(phase, start, spanClock(), label);
+        start = 0;
+    }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+};
+
+// The span of a whole request: spans the thread records meanwhile belong to it, under an id
+// of its own
+class RequestSpan {
+    const char* label;
+    uint64_t start;
+    uint64_t outerId;
+    RequestSpan* outer;
+  public:
+    explicit RequestSpan(const char* label = nullptr);
+    ~RequestSpan();
+    // Name the request the calling thread runs, if any, e.g. by its command once parsed
+    static void labelCurrent(const char* label);
+    RequestSpan(const RequestSpan&) = delete;
+    RequestSpan& operator=(const RequestSpan&) = delete;
+};
+#endif
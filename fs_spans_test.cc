@@ -0,0 +1,115 @@
+#include "fs_spans.h"
+
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "fs_command.h"
+#include "gtest/gtest.h"
+
+/* Test recording the phases of requests. Spans are process wide: tests turn them on, clear
+   the ones recorded before, and turn them off when done. */
+namespace {
+
+// Number of times text occurs in s
+size_t occurrences(const string& s, const string& text) {
+    size_t count = 0;
+    for (size_t pos = s.find(text); pos != string::npos; pos = s.find(text, pos + 1)) count++;
+    return count;
+}
+
+// Tests the phases of a command are recorded under its request, and nothing while off
+TEST(Spans, TestPhases) {
+    FileSystem fs;
+    fs.mkdir("/a/b");
+    enableSpans(true);
+    clearSpans();
+    ostringstream out;
+    {
+        RequestSpan request;
+        EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "cat /a/b", out));
+    }
+    {
+        RequestSpan request;
+        EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "write /a/f x", out));
+    }
+    enableSpans(false);
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "ls /a", out));
+
+    ostringstream trace;
+    // Request, parse, lock, resolve and op
+    EXPECT_EQ(10, dumpSpans(trace));
+    string json = trace.str();
+    EXPECT_EQ(0, json.find("{\"displayTimeUnit\":\"ns\",\"traceEvents\":["));
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"request cat\""));
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"op write\""));
+    EXPECT_EQ(2, occurrences(json, "\"name\":\"parse\""));
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"lock shared\""));
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"lock exclusive\""));
+    EXPECT_EQ(0, occurrences(json, "\"name\":\"op ls\""));
+    // All spans of each request have its id
+    size_t id = json.find("\"request\":");
+    ASSERT_NE(string::npos, id);
+    string first = json.substr(id, json.find('}', id) - id);
+    EXPECT_EQ(5, occurrences(json, first + "}"));
+
+    clearSpans();
+    EXPECT_EQ(0, spanCount());
+}
+
+// Tests a ring keeps the last spans of its thread, and the spans of threads that exited
+TEST(Spans, TestRing) {
+    enableSpans(true);
+    clearSpans();
+    uint64_t start = spanClock();
+    thread writer([start]() {
+        for (uint64_t i = 0; i < kSpanRingSize + 100; i++) recordSpan(SpanPhase::Op, start + i, start + i + 1);
+    });
+    writer.join();
+    EXPECT_EQ(kSpanRingSize, spanCount());
+
+    // Dumps read the rings while their threads write
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([]() {
+            for (int i = 0; i < 50000; i++) Span span(SpanPhase::Resolve);
+        });
+    }
+    for (int i = 0; i < 3; i++) {
+        ostringstream trace;
+        dumpSpans(trace);
+        EXPECT_EQ("\n]}\n", trace.str().substr(trace.str().size() - 4));
+    }
+    for (thread& t : threads) t.join();
+    EXPECT_EQ(5 * kSpanRingSize, spanCount());
+    enableSpans(false);
+    clearSpans();
+}
+
+// Tests the spans command turns spans on and off, and dumps them to a host file
+TEST(Spans, TestCommand) {
+    FileSystem fs;
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "spans on", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "spans clear", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /a", out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "spans off", out));
+    string path = "/tmp/fs_spans_test." + to_string(getpid()) + ".json";
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "spans dump " + path, out));
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "spans", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "spans dump /missing/dir/trace.json", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "spans all", out));
+    string lines = out.str();
+    EXPECT_NE(string::npos, lines.find(" spans written to " + path + "\n"));
+    EXPECT_NE(string::npos, lines.find("off spans="));
+
+    ifstream file(path);
+    string json((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"op mkdir\""));
+    EXPECT_EQ(1, occurrences(json, "\"name\":\"lock exclusive\""));
+    unlink(path.c_str());
+    clearSpans();
+}
+}  // namespace
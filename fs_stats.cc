@@ -0,0 +1,209 @@
+#include "fs_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+const char* const kOpNames[] = {"cd", "pwd", "ls", "find", "cat", "mkdir", "rm", "touch", "write", "mv", "cp"};
+const char* const kCauseNames[] = {"not_found", "exists", "invalid_path", "not_a_directory", "not_a_file",
+                                   "read_only", "quota_exceeded", "other"};
+static_assert(sizeof(kOpNames) / sizeof(kOpNames[0]) == size_t(FsOp::Count), "An op without a name");
+static_assert(sizeof(kCauseNames) / sizeof(kCauseNames[0]) == size_t(ErrorCause::Count), "A cause without a name");
+
+const size_t kOpCount = size_t(FsOp::Count);
+const size_t kCauseCount = size_t(ErrorCause::Count);
+
+// Counters of one thread. Only that thread writes them, so a relaxed load and store is
+// enough to add: no locked instruction, no cache line shared with other writers.
+struct Shard {
+    struct Op {
+        atomic<uint64_t> calls{0};
+        atomic<uint64_t> errors[kCauseCount] = {};
+        atomic<uint64_t> totalNs{0};
+        atomic<uint64_t> maxNs{0};
+        atomic<uint64_t> buckets[LatencyHistogram::kBuckets] = {};
+    };
+    Op ops[kOpCount];
+};
+
+void add(atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Shards of the live threads, and the sum of the shards of the threads that exited
+struct Registry {
+    mutex lock;
+    vector<Shard*> shards;
+    StatsSnapshot retired;
+};
+
+// Never destroyed: threads may exit after static destructors ran
+Registry& registry() {
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+void addShard(StatsSnapshot& snapshot, const Shard& shard) {
+    for (size_t i = 0; i < kOpCount; i++) {
+        const Shard::Op& from = shard.ops[i];
+        OpStats& to = snapshot.ops[i];
+        to.calls += from.calls.load(memory_order_relaxed);
+        for (size_t cause = 0; cause < kCauseCount; cause++) {
+            to.errors[cause] += from.errors[cause].load(memory_order_relaxed);
+        }
+        to.totalNs += from.totalNs.load(memory_order_relaxed);
+        to.maxNs = max(to.maxNs, from.maxNs.load(memory_order_relaxed));
+        for (int bucket = 0; bucket < LatencyHistogram::kBuckets; bucket++) {
+            to.latency.counts[bucket] += from.buckets[bucket].load(memory_order_relaxed);
+        }
+    }
+}
+
+// The shard of the calling thread, registered on first use and folded into the retired
+// counters when the thread exits
+class ThreadShard {
+    Shard* shard;
+  public:
+    ThreadShard() : shard(new Shard()) {
+        Registry& r = registry();
+        lock_guard<mutex> guard(r.lock);
+        r.shards.push_back(shard);
+    }
+    ~ThreadShard() {
+        Registry& r = registry();
+        lock_guard<mutex> guard(r.lock);
+        addShard(r.retired, *shard);
+        r.shards.erase(find(r.shards.begin(), r.shards.end(), shard));
+        delete shard;
+    }
+    Shard& get() { return *shard; }
+};
+
+Shard& threadShard() {
+    thread_local ThreadShard shard;
+    return shard.get();
+}
+
+}  // namespace
+
+/************************ names ***********************************/
+
+const char* opName(FsOp op) {
+    return kOpNames[size_t(op)];
+}
+
+const char* causeName(ErrorCause cause) {
+    return kCauseNames[size_t(cause)];
+}
+
+ErrorCause errorCause(const string& message) {
+    auto startsWith = [&](const char* prefix) { return message.rfind(prefix, 0) == 0; };
+    if (startsWith("File not found") || startsWith("Directory not found") || startsWith("No such file or directory")) {
+        return ErrorCause::NotFound;
+    }
+    if (startsWith("File/Directory exists")) return ErrorCause::Exists;
+    if (startsWith("Invalid path")) return ErrorCause::InvalidPath;
+    if (startsWith("Not a directory")) return ErrorCause::NotADirectory;
+    if (startsWith("Not a file")) return ErrorCause::NotAFile;
+    if (startsWith("Read-only file system")) return ErrorCause::ReadOnly;
+    if (startsWith("Disk quota exceeded")) return ErrorCause::QuotaExceeded;
+    return ErrorCause::Other;
+}
+
+/************************ histograms ******************************/
+
+int LatencyHistogram::bucket(uint64_t value) {
+    if (value < kSubBuckets) return value;
+    int log = 63 - __builtin_clzll(value);
+    // The 3 bits below the highest one pick the bucket within its power of two
+    return (log - 2) * kSubBuckets + ((value >> (log - 3)) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::upperBound(int bucket) {
+    if (bucket < kSubBuckets) return bucket;
+    int log = bucket / kSubBuckets + 2;
+    uint64_t low = uint64_t(kSubBuckets + bucket % kSubBuckets) << (log - 3);
+    return low + (uint64_t(1) << (log - 3)) - 1;
+}
+
+uint64_t LatencyHistogram::count() const {
+    uint64_t total = 0;
+    for (uint64_t n : counts) total += n;
+    return total;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    uint64_t total = count();
+    if (total == 0) return 0;
+    // Rank of the value, from 1
+    uint64_t rank = max<uint64_t>(1, uint64_t(p * total + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+        seen += counts[i];
+        if (seen >= rank) return upperBound(i);
+    }
+    return upperBound(kBuckets - 1);
+}
+
+/************************ counting ********************************/
+
+uint64_t OpStats::errorCount() const {
+    uint64_t total = 0;
+    for (uint64_t n : errors) total += n;
+    return total;
+}
+
+vector<string> StatsSnapshot::format() const {
+    vector<string> lines;
+    for (size_t i = 0; i < kOpCount; i++) {
+        const OpStats& op = ops[i];
+        if (op.calls == 0) continue;
+        string line = string(kOpNames[i]) + " calls=" + to_string(op.calls) + " errors=" + to_string(op.errorCount());
+        for (size_t cause = 0; cause < kCauseCount; cause++) {
+            if (op.errors[cause]) line += " " + string(kCauseNames[cause]) + "=" + to_string(op.errors[cause]);
+        }
+        line += " mean_ns=" + to_string(op.totalNs / op.calls) + " p50_ns=" + to_string(op.latency.percentile(0.5))
+                + " p99_ns=" + to_string(op.latency.percentile(0.99))
+                + " p999_ns=" + to_string(op.latency.percentile(0.999)) + " max_ns=" + to_string(op.maxNs);
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+StatsSnapshot snapshotStats() {
+    Registry& r = registry();
+    lock_guard<mutex> guard(r.lock);
+    StatsSnapshot snapshot = r.retired;
+    for (Shard* shard : r.shards) addShard(snapshot, *shard);
+    return snapshot;
+}
+
+void countOp(FsOp op, uint64_t ns) {
+    Shard::Op& counters = threadShard().ops[size_t(op)];
+    add(counters.calls, 1);
+    add(counters.totalNs, ns);
+    if (ns > counters.maxNs.load(memory_order_relaxed)) counters.maxNs.store(ns, memory_order_relaxed);
+    add(counters.buckets[LatencyHistogram::bucket(ns)], 1);
+}
+
+void OpTimer::logSlow(uint64_t ns) {
+    SlowOp slow;
+    uint64_t nowUs = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+    slow.timestampUs = nowUs - ns / 1000;
+    slow.op = opName(op);
+    if (path) slow.path = *path;
+    if (to) slow.path += " " + *to;
+    slow.session = session;
+    slow.durationNs = ns;
+    slow.work = opWork;
+    logSlowOp(move(slow));
+}
+
+void countError(FsOp op, const invalid_argument& e) {
+    add(threadShard().ops[size_t(op)].errors[size_t(errorCause(e.what()))], 1);
+}
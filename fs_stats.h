@@ -0,0 +1,145 @@
+#ifndef FS_STATS_H
+#define FS_STATS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "fs_slowlog.h"
+#include "fs_spans.h"
+
+using namespace std;
+
+/* Built in instrumentation of the FS operations
+   Every FileSystem operation counts its calls, its errors by cause and its latency in a
+   histogram with log sized buckets (8 per power of two, so a bucket is within 12.5% of
+   the values in it, like HDR histograms). Counters are per thread: a thread only writes
+   its own, with plain relaxed stores, and a snapshot sums them all. The stats cover every
+   FileSystem of the process.
+*/
+enum class FsOp : uint8_t {
+    Cd,
+    Pwd,
+    Ls,
+    Find,
+    Cat,
+    Mkdir,
+    Rm,
+    Touch,
+    Write,
+    Mv,
+    Cp,
+    Count,
+};
+
+// Errors by the start of their message
+enum class ErrorCause : uint8_t {
+    NotFound,
+    Exists,
+    InvalidPath,
+    NotADirectory,
+    NotAFile,
+    ReadOnly,
+    QuotaExceeded,
+    Other,
+    Count,
+};
+
+const char* opName(FsOp op);
+const char* causeName(ErrorCause cause);
+ErrorCause errorCause(const string& message);
+
+// Counts of values in log sized buckets
+struct LatencyHistogram {
+    // Values below 8 have a bucket each, then every power of two has 8
+    static constexpr int kSubBuckets = 8;
+    static constexpr int kBuckets = (64 - 2) * kSubBuckets;
+    array<uint64_t, kBuckets> counts = {};
+
+    static int bucket(uint64_t value);
+    // Highest value of a bucket
+    static uint64_t upperBound(int bucket);
+
+    uint64_t count() const;
+    // Upper bound of the bucket holding the value at quantile p (e.g. 0.99), or 0 if empty
+    uint64_t percentile(double p) const;
+};
+
+struct OpStats {
+    uint64_t calls = 0;
+    array<uint64_t, size_t(ErrorCause::Count)> errors = {};
+    uint64_t totalNs = 0;
+    uint64_t maxNs = 0;
+    LatencyHistogram latency;
+
+    uint64_t errorCount() const;
+};
+
+struct StatsSnapshot {
+    array<OpStats, size_t(FsOp::Count)> ops;
+
+    const OpStats& operator[](FsOp op) const { return ops[size_t(op)]; }
+    // One line per op called so far, e.g.
+    // "mkdir calls=12 errors=1 exists=1 mean_ns=1200 p50_ns=1023 p99_ns=4095 p999_ns=4095 max_ns=3900"
+    vector<string> format() const;
+};
+
+// Sum of the counters of all threads, including the ones that exited
+StatsSnapshot snapshotStats();
+
+// Count a call of op and its latency, and errors by cause
+void countOp(FsOp op, uint64_t ns);
+void countError(FsOp op, const invalid_argument& e);
+
+// Counts a call of an op, with the time until the end of its scope, and records it as an op
+// span if spans are on (see fs_spans.h). Ops slower than the slow log threshold are logged
+// with their params and work (see fs_slowlog.h).
+class OpTimer {
+    FsOp op;
+    uint64_t session;
+    const string* path;
+    const string* to;
+    chrono::steady_clock::time_point start;
+    void logSlow(uint64_t ns);
+  public:
+    // path and to (for mv and cp) must outlive the timer
+    explicit OpTimer(FsOp op, uint64_t session = 0, const string* path = nullptr, const string* to = nullptr)
+            : op(op), session(session), path(path), to(to), start(chrono::steady_clock::now()) {
+        opWork = OpWork();
+    }
+    ~OpTimer() {
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+        countOp(op, ns);
+        if (spansEnabled()) {
+            recordSpan(SpanPhase::Op, chrono::duration_cast<chrono::nanoseconds>(start.time_since_epoch()).count(),
+                       chrono::duration_cast<chrono::nanoseconds>(end.time_since_epoch()).count(), opName(op));
+        }
+        uint64_t threshold = slowThreshold();
+        if (threshold && ns >= threshold) logSlow(ns);
+    }
+    OpTimer(const OpTimer&) = delete;
+    OpTimer& operator=(const OpTimer&) = delete;
+};
+
+// Times a wait for the tree lock, from its construction to the end of its scope, as a lock
+// span if spans are on and as lock wait of the op if the slow log is on
+class LockTimer {
+    const char* label;
+    uint64_t start;
+  public:
+    explicit LockTimer(const char* label)
+            : label(label), start(spansEnabled() || slowThreshold() ? spanClock() : 0) {}
+    ~LockTimer() {
+        if (!start) return;
+        uint64_t end = spanClock();
+        opWork.lockWaitNs += end - start;
+        if (spansEnabled()) recordSpan(SpanPhase::Lock, start, end, label);
+    }
+    LockTimer(const LockTimer&) = delete;
+    LockTimer& operator=(const LockTimer&) = delete;
+};
+#endif
@@ -0,0 +1,100 @@
+#include "fs_stats.h"
+
+#include <sstream>
+#include <thread>
+
+#include "fs_command.h"
+#include "fs_impl.h"
+#include "gtest/gtest.h"
+
+/* Test the instrumentation of the FS operations. Stats are process wide, and other tests
+   run ops too: tests compare snapshots taken before and after. */
+namespace {
+
+// Tests every value falls in a bucket whose bounds hold it, within 12.5%
+TEST(Stats, TestHistogramBuckets) {
+    for (uint64_t value : {0ull, 1ull, 7ull, 8ull, 15ull, 16ull, 17ull, 1000ull, 123456789ull, ~0ull}) {
+        int bucket = LatencyHistogram::bucket(value);
+        ASSERT_LT(bucket, LatencyHistogram::kBuckets);
+        EXPECT_LE(value, LatencyHistogram::upperBound(bucket)) << value;
+        if (bucket > 0) {
+            EXPECT_GT(value, LatencyHistogram::upperBound(bucket - 1)) << value;
+        }
+        EXPECT_LE(LatencyHistogram::upperBound(bucket) - value, value / 8) << value;
+    }
+
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++) histogram.counts[LatencyHistogram::bucket(value)]++;
+    EXPECT_EQ(1000, histogram.count());
+    EXPECT_NEAR(500, histogram.percentile(0.5), 500 / 8);
+    EXPECT_NEAR(990, histogram.percentile(0.99), 990 / 8);
+    EXPECT_EQ(LatencyHistogram::upperBound(LatencyHistogram::bucket(1000)), histogram.percentile(1));
+    EXPECT_EQ(0, LatencyHistogram().percentile(0.5));
+}
+
+// Tests ops count their calls, latencies and errors by cause
+TEST(Stats, TestCounters) {
+    StatsSnapshot before = snapshotStats();
+    FileSystem fs;
+    fs.mkdir("/a");
+    fs.mkdir("/b");
+    EXPECT_THROW(fs.mkdir("/a"), invalid_argument);
+    EXPECT_THROW(fs.cat("missing"), invalid_argument);
+    EXPECT_THROW(fs.cd("missing"), invalid_argument);
+    fs.touch("f");
+    EXPECT_THROW(fs.cd("f"), invalid_argument);
+    StatsSnapshot after = snapshotStats();
+
+    const OpStats& mkdirs = after[FsOp::Mkdir];
+    EXPECT_EQ(3, mkdirs.calls - before[FsOp::Mkdir].calls);
+    EXPECT_EQ(1, mkdirs.errorCount() - before[FsOp::Mkdir].errorCount());
+    EXPECT_EQ(1, mkdirs.errors[size_t(ErrorCause::Exists)] - before[FsOp::Mkdir].errors[size_t(ErrorCause::Exists)]);
+    EXPECT_EQ(mkdirs.calls, mkdirs.latency.count());
+    EXPECT_LT(0, mkdirs.totalNs);
+    EXPECT_LE(mkdirs.maxNs, mkdirs.latency.percentile(1));
+
+    const OpStats& cds = after[FsOp::Cd];
+    const OpStats& cdsBefore = before[FsOp::Cd];
+    EXPECT_EQ(2, cds.calls - cdsBefore.calls);
+    EXPECT_EQ(1, cds.errors[size_t(ErrorCause::NotFound)] - cdsBefore.errors[size_t(ErrorCause::NotFound)]);
+    EXPECT_EQ(1, cds.errors[size_t(ErrorCause::NotADirectory)] - cdsBefore.errors[size_t(ErrorCause::NotADirectory)]);
+    EXPECT_EQ(1, after[FsOp::Cat].errors[size_t(ErrorCause::NotFound)]
+                 - before[FsOp::Cat].errors[size_t(ErrorCause::NotFound)]);
+    EXPECT_EQ(ErrorCause::ReadOnly, errorCause("Read-only file system"));
+    EXPECT_EQ(ErrorCause::QuotaExceeded, errorCause("Disk quota exceeded: /a/"));
+    EXPECT_EQ(ErrorCause::Other, errorCause("Something else"));
+}
+
+// Tests counters of threads are summed, and kept after the threads exit
+TEST(Stats, TestThreads) {
+    StatsSnapshot before = snapshotStats();
+    FileSystem fs;
+    fs.touch("f");
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&fs]() {
+            FileSystem::Session session(fs);
+            for (int i = 0; i < 1000; i++) fs.cat(session, "f");
+        });
+    }
+    for (thread& t : threads) t.join();
+    EXPECT_EQ(4000, snapshotStats()[FsOp::Cat].calls - before[FsOp::Cat].calls);
+}
+
+// Tests the stats command prints a line per op called
+TEST(Stats, TestCommand) {
+    FileSystem fs;
+    ostringstream out;
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "mkdir /a", out));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "touch a", out));
+    out.str("");
+    EXPECT_TRUE(runCommand(fs, fs.defaultSession(), "stats", out));
+    string stats = out.str();
+    size_t line = stats.find("\ntouch calls=");
+    ASSERT_NE(string::npos, line);
+    EXPECT_NE(string::npos, stats.find(" exists=", line));
+    EXPECT_NE(string::npos, stats.find(" p99_ns=", line));
+    EXPECT_NE(string::npos, stats.find("mkdir calls="));
+    EXPECT_FALSE(runCommand(fs, fs.defaultSession(), "stats all", out));
+}
+}  // namespace
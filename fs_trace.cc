@@ -0,0 +1,290 @@
+#include "fs_trace.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <sstream>
+#include <thread>
+
+#include "fs_command.h"
+
+using namespace std;
+
+namespace {
+
+// Append s as a JSON string. Bytes other than printable ASCII are escaped one by one as
+// \u00XX, so any command round trips byte for byte.
+void appendJsonString(string& out, string_view s) {
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c >= 0x20 && c < 0x7f) {
+            out += c;
+        } else {
+            const char* hex = "0123456789abcdef";
+            out += "\\u00";
+            out += hex[uint8_t(c) >> 4];
+            out += hex[uint8_t(c) & 0xf];
+        }
+    }
+    out += '"';
+}
+
+// Reads the fields of one flat JSON object (numbers, booleans, strings and arrays of strings),
+// in the format appendJsonString writes
+class JsonFields {
+    const string& line;
+    size_t pos = 0;
+
+    invalid_argument error() const { return invalid_argument("Bad trace line: " + line); }
+    void skipSpaces() {
+        while (pos < line.size() && line[pos] == ' ') pos++;
+    }
+    void expect(char c) {
+        skipSpaces();
+        if (pos >= line.size() || line[pos] != c) throw error();
+        pos++;
+    }
+    int hexDigit(char c) const {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        throw error();
+    }
+
+  public:
+    explicit JsonFields(const string& line) : line(line) { expect('{'); }
+
+    // Read the next key, or return false at the end of the object
+    bool next(string& key) {
+        skipSpaces();
+        if (pos < line.size() && line[pos] == '}') return false;
+        if (pos < line.size() && line[pos] == ',') pos++;
+        key = readString();
+        expect(':');
+        skipSpaces();
+        return true;
+    }
+    string readString() {
+        expect('"');
+        string s;
+        while (pos < line.size() && line[pos] != '"') {
+            char c = line[pos++];
+            if (c != '\\') {
+                s += c;
+                continue;
+            }
+            if (pos >= line.size()) throw error();
+            c = line[pos++];
+            if (c == 'u') {
+                if (pos + 4 > line.size() || line[pos] != '0' || line[pos + 1] != '0') throw error();
+                s += char(hexDigit(line[pos + 2]) * 16 + hexDigit(line[pos + 3]));
+                pos += 4;
+            } else {
+                s += c;
+            }
+        }
+        expect('"');
+        return s;
+    }
+    uint64_t readNumber() {
+        if (pos >= line.size() || !isdigit(line[pos])) throw error();
+        uint64_t n = 0;
+        while (pos < line.size() && isdigit(line[pos])) n = n * 10 + (line[pos++] - '0');
+        return n;
+    }
+    vector<string> readStrings() {
+        vector<string> strings;
+        expect('[');
+        skipSpaces();
+        if (pos < line.size() && line[pos] == ']') {
+            pos++;
+            return strings;
+        }
+        while (true) {
+            strings.push_back(readString());
+            skipSpaces();
+            if (pos >= line.size() || line[pos] != ',') break;
+            pos++;
+        }
+        expect(']');
+        return strings;
+    }
+    bool readBool() {
+        if (line.compare(pos, 4, "true") == 0) {
+            pos += 4;
+            return true;
+        }
+        if (line.compare(pos, 5, "false") == 0) {
+            pos += 5;
+            return false;
+        }
+        throw error();
+    }
+};
+
+uint64_t percentile(const vector<uint64_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+void printLatencies(ostream& out, vector<uint64_t>& latencies) {
+    sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (uint64_t ns : latencies) total += ns;
+    out << "\"count\": " << latencies.size()
+        << ", \"ns_per_op\": " << (latencies.empty() ? 0 : total / latencies.size())
+        << ", \"p50_ns\": " << percentile(latencies, 0.5)
+        << ", \"p99_ns\": " << percentile(latencies, 0.99)
+        << ", \"p999_ns\": " << percentile(latencies, 0.999)
+        << ", \"max_ns\": " << (latencies.empty() ? 0 : latencies.back());
+}
+
+}  // namespace
+
+/************************ trace entries ***************************/
+
+uint64_t traceTimestamp() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+string formatTraceEntry(const TraceEntry& entry) {
+    string line = "{\"ts_us\":" + to_string(entry.timestampUs) + ",\"session\":" + to_string(entry.session)
+                  + ",\"command\":";
+    appendJsonString(line, entry.command);
+    if (entry.hasArgs) {
+        line += ",\"args\":[";
+        for (size_t i = 0; i < entry.args.size(); i++) {
+            if (i > 0) line += ',';
+            appendJsonString(line, entry.args[i]);
+        }
+        line += ']';
+    }
+    line += ",\"ok\":" + string(entry.ok ? "true" : "false") + ",\"latency_ns\":" + to_string(entry.latencyNs)
+            + ",\"result_bytes\":" + to_string(entry.resultBytes) + "}";
+    return line;
+}
+
+TraceEntry parseTraceEntry(const string& line) {
+    TraceEntry entry;
+    JsonFields fields(line);
+    bool hasCommand = false;
+    string key;
+    while (fields.next(key)) {
+        if (key == "command") {
+            entry.command = fields.readString();
+            hasCommand = true;
+        } else if (key == "args") {
+            entry.args = fields.readStrings();
+            entry.hasArgs = true;
+        } else if (key == "ok") {
+            entry.ok = fields.readBool();
+        } else {
+            uint64_t value = fields.readNumber();
+            if (key == "ts_us") entry.timestampUs = value;
+            else if (key == "session") entry.session = value;
+            else if (key == "latency_ns") entry.latencyNs = value;
+            else if (key == "result_bytes") entry.resultBytes = value;
+        }
+    }
+    if (!hasCommand) throw invalid_argument("Bad trace line: " + line);
+    return entry;
+}
+
+/************************ recording *******************************/
+
+TraceRecorder::TraceRecorder(const string& path) : out(path, ios::app) {
+    if (!out) throw runtime_error("Cannot open trace: " + path);
+}
+
+void TraceRecorder::record(const TraceEntry& entry) {
+    string line = formatTraceEntry(entry);
+    line += '\n';
+    lock_guard<mutex> guard(lock);
+    out << line;
+}
+
+// Without a recorder, the output goes straight to out. With one, it goes through a buffer
+// to measure its size.
+bool runRecorded(FileSystem& fs, FileSystem::Session& session, string_view input, ostream& out,
+                 TraceRecorder* recorder, uint64_t sessionId) {
+    if (!recorder) return runCommand(fs, session, input, out);
+    if (input.empty()) return true;
+    TraceEntry entry;
+    entry.timestampUs = traceTimestamp();
+    entry.session = sessionId;
+    entry.command = string(input);
+    ostringstream buffer;
+    auto start = chrono::steady_clock::now();
+    entry.ok = runCommand(fs, session, input, buffer);
+    entry.latencyNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    string output = buffer.str();
+    entry.resultBytes = output.size();
+    out << output;
+    recorder->record(entry);
+    return entry.ok;
+}
+
+/************************ replay **********************************/
+
+ReplayReport replayTrace(FileSystem& fs, istream& trace, bool originalTiming) {
+    vector<TraceEntry> entries;
+    string line;
+    while (getline(trace, line)) {
+        if (!line.empty()) entries.push_back(parseTraceEntry(line));
+    }
+    // The trace is in the order commands finished
+    stable_sort(entries.begin(), entries.end(),
+                [](const TraceEntry& a, const TraceEntry& b) { return a.timestampUs < b.timestampUs; });
+
+    ReplayReport report;
+    map<uint64_t, unique_ptr<FileSystem::Session>> sessions;
+    auto begin = chrono::steady_clock::now();
+    for (const TraceEntry& entry : entries) {
+        if (originalTiming) {
+            this_thread::sleep_until(begin + chrono::microseconds(entry.timestampUs - entries[0].timestampUs));
+        }
+        unique_ptr<FileSystem::Session>& session = sessions[entry.session];
+        if (!session) {
+            session.reset(new FileSystem::Session(fs, false, entry.session));
+            session->anyHostPath = false;
+        }
+        ostringstream output;
+        auto start = chrono::steady_clock::now();
+        bool ok = entry.hasArgs ? runCommand(fs, *session, entry.command, entry.args, output)
+                                : runCommand(fs, *session, entry.command, output);
+        uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+        string_view name = string_view(entry.command).substr(0, entry.command.find(' '));
+        report.latencies[string(name)].push_back(ns);
+        report.commands++;
+        if (!ok) report.failed++;
+        if (ok != entry.ok || output.tellp() != streampos(entry.resultBytes)) report.diverged++;
+    }
+    report.elapsedNs = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count();
+    return report;
+}
+
+void printReplayReport(ostream& out, ReplayReport& report) {
+    double seconds = report.elapsedNs / 1e9;
+    vector<uint64_t> all;
+    for (auto& command : report.latencies) all.insert(all.end(), command.second.begin(), command.second.end());
+    out << "{\n  \"commands\": " << report.commands << ", \"failed\": " << report.failed
+        << ", \"diverged\": " << report.diverged << ", \"elapsed_ns\": " << report.elapsedNs
+        << ", \"ops_per_sec\": " << uint64_t(seconds > 0 ? report.commands / seconds : 0) << ",\n  \"all\": {";
+    printLatencies(out, all);
+    out << "},\n  \"by_command\": [";
+    bool first = true;
+    for (auto& command : report.latencies) {
+        out << (first ? "\n" : ",\n") << "    {\"command\": ";
+        string name;
+        appendJsonString(name, command.first);
+        out << name << ", ";
+        printLatencies(out, command.second);
+        out << "}";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
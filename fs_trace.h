@@ -0,0 +1,82 @@
+#ifndef FS_TRACE_H
+#define FS_TRACE_H
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "fs_impl.h"
+
+using namespace std;
+
+/* Workload traces: record the commands run on a FS, and replay them on another one
+   A trace is a JSONL file with one command per line, in the order the commands finished:
+   {"ts_us":1700000000123456,"session":3,"command":"write f hello","ok":true,"latency_ns":5210,"result_bytes":0}
+   ts_us is when the command started, in microseconds since the epoch. session tells the
+   clients apart (0 for the prompt). result_bytes is the size of the output: every line (or
+   binary response item) plus one for its newline.
+   Binary protocol requests hold the command name, and their params as decoded in args:
+   {"ts_us":1700000000123456,"session":4,"command":"write","args":["f","two words\u000a"],...}
+   They replay with the same params, whatever bytes those hold.
+*/
+struct TraceEntry {
+    uint64_t timestampUs = 0;
+    uint64_t session = 0;
+    // Command line, or the command name when hasArgs
+    string command;
+    bool hasArgs = false;
+    vector<string> args;
+    bool ok = true;
+    uint64_t latencyNs = 0;
+    uint64_t resultBytes = 0;
+};
+
+// Microseconds since the epoch
+uint64_t traceTimestamp();
+
+// The JSON line of an entry, without the newline
+string formatTraceEntry(const TraceEntry& entry);
+// Parse a JSON line written by formatTraceEntry. Throws invalid_argument if it isn't one.
+TraceEntry parseTraceEntry(const string& line);
+
+// Appends entries to a trace file. Safe to call from many threads.
+class TraceRecorder {
+    mutex lock;
+    ofstream out;
+  public:
+    // Throws runtime_error if the file can't be opened
+    explicit TraceRecorder(const string& path);
+    TraceRecorder(const TraceRecorder&) = delete;
+    TraceRecorder& operator=(const TraceRecorder&) = delete;
+
+    void record(const TraceEntry& entry);
+};
+
+// Run one command line like runCommand, and record it to recorder (if any) on behalf of session
+bool runRecorded(FileSystem& fs, FileSystem::Session& session, string_view input, ostream& out,
+                 TraceRecorder* recorder, uint64_t sessionId);
+
+// Results of a replay: latencies in ns of every command, by command name
+struct ReplayReport {
+    map<string, vector<uint64_t>> latencies;
+    uint64_t commands = 0;
+    // Commands that failed in the replay
+    uint64_t failed = 0;
+    // Commands whose outcome or result size differ from the trace
+    uint64_t diverged = 0;
+    uint64_t elapsedNs = 0;
+};
+
+// Replay a trace on fs, in the order the commands started, one at a time, each on a session
+// of its own per traced session. With originalTiming, every command waits until as long after
+// the first one as in the trace; otherwise they run back to back. Throws invalid_argument on
+// a malformed line. Commands writing host files (snapshot, spans dump) fail: the trace
+// doesn't say where the recorded session was allowed to write.
+ReplayReport replayTrace(FileSystem& fs, istream& trace, bool originalTiming);
+
+// Print throughput and latency percentiles as JSON, overall and by command
+void printReplayReport(ostream& out, ReplayReport& report);
+#endif
@@ -0,0 +1,144 @@
+#include "fs_trace.h"
+
+#include <unistd.h>
+
+#include <sstream>
+
+#include "gtest/gtest.h"
+
+/* Test recording commands to traces and replaying them */
+namespace {
+
+// Tests entries survive the JSON line, whatever bytes the command holds
+TEST(Trace, TestFormat) {
+    TraceEntry entry;
+    entry.timestampUs = 1700000000123456;
+    entry.session = 3;
+    entry.command = "write f \"quoted\\\" \x01\xff";
+    entry.ok = false;
+    entry.latencyNs = 5210;
+    entry.resultBytes = 17;
+    string line = formatTraceEntry(entry);
+    EXPECT_EQ(string::npos, line.find('\n'));
+
+    TraceEntry parsed = parseTraceEntry(line);
+    EXPECT_EQ(entry.timestampUs, parsed.timestampUs);
+    EXPECT_EQ(entry.session, parsed.session);
+    EXPECT_EQ(entry.command, parsed.command);
+    EXPECT_EQ(entry.ok, parsed.ok);
+    EXPECT_EQ(entry.latencyNs, parsed.latencyNs);
+    EXPECT_EQ(entry.resultBytes, parsed.resultBytes);
+
+    // Params of binary requests are kept apart, empty ones included
+    entry.command = "write";
+    entry.hasArgs = true;
+    entry.args = {"f", "two words\nand a line", ""};
+    parsed = parseTraceEntry(formatTraceEntry(entry));
+    EXPECT_TRUE(parsed.hasArgs);
+    EXPECT_EQ(entry.args, parsed.args);
+    entry.args.clear();
+    parsed = parseTraceEntry(formatTraceEntry(entry));
+    EXPECT_TRUE(parsed.hasArgs);
+    EXPECT_TRUE(parsed.args.empty());
+    EXPECT_FALSE(parseTraceEntry("{\"command\":\"ls\"}").hasArgs);
+
+    EXPECT_THROW(parseTraceEntry("{\"ts_us\":1}"), invalid_argument);
+    EXPECT_THROW(parseTraceEntry("{\"command\":\"ls\",\"args\":[\"a\"}"), invalid_argument);
+    EXPECT_THROW(parseTraceEntry("{\"command\":\"ls"), invalid_argument);
+    EXPECT_THROW(parseTraceEntry("not json"), invalid_argument);
+}
+
+// Tests a recorded workload replays to the same tree, with the same results
+TEST(Trace, TestRecordReplay) {
+    string path = "/tmp/fs_trace_test." + to_string(getpid());
+    unlink(path.c_str());
+    FileSystem fs;
+    {
+        TraceRecorder recorder(path);
+        FileSystem::Session one(fs);
+        FileSystem::Session two(fs);
+        ostringstream out;
+        EXPECT_TRUE(runRecorded(fs, one, "mkdir /a/b", out, &recorder, 1));
+        EXPECT_TRUE(runRecorded(fs, two, "cd a", out, &recorder, 2));
+        EXPECT_TRUE(runRecorded(fs, two, "touch f", out, &recorder, 2));
+        EXPECT_TRUE(runRecorded(fs, two, "write f content", out, &recorder, 2));
+        EXPECT_TRUE(runRecorded(fs, one, "ls a", out, &recorder, 1));
+        EXPECT_FALSE(runRecorded(fs, one, "cat missing", out, &recorder, 1));
+        EXPECT_EQ("b\nf\nFile not found: missing\n", out.str());
+    }
+
+    ifstream trace(path);
+    vector<TraceEntry> entries;
+    string line;
+    while (getline(trace, line)) entries.push_back(parseTraceEntry(line));
+    ASSERT_EQ(6, entries.size());
+    EXPECT_EQ("ls a", entries[4].command);
+    EXPECT_EQ(1, entries[4].session);
+    EXPECT_EQ(4, entries[4].resultBytes);
+    EXPECT_FALSE(entries[5].ok);
+
+    FileSystem replica;
+    trace.clear();
+    trace.seekg(0);
+    ReplayReport report = replayTrace(replica, trace, false);
+    EXPECT_EQ(6, report.commands);
+    EXPECT_EQ(1, report.failed);
+    EXPECT_EQ(0, report.diverged);
+    EXPECT_EQ(1, report.latencies["write"].size());
+    EXPECT_TRUE(FileSystem::diff(fs, replica).empty());
+
+    // Replayed on a tree in another state, the results differ
+    FileSystem other;
+    other.mkdir("/a/b/c");
+    trace.clear();
+    trace.seekg(0);
+    EXPECT_LT(0, replayTrace(other, trace, false).diverged);
+
+    ostringstream json;
+    printReplayReport(json, report);
+    EXPECT_NE(string::npos, json.str().find("\"commands\": 6"));
+    unlink(path.c_str());
+}
+
+// Tests params of binary requests replay whole, and replays write no host files
+TEST(Trace, TestReplayArgs) {
+    TraceEntry touch;
+    touch.command = "touch";
+    touch.hasArgs = true;
+    touch.args = {"f"};
+    TraceEntry write = touch;
+    write.timestampUs = 1;
+    write.command = "write";
+    write.args = {"f", "two words\nand a line"};
+    string image = "/tmp/fs_trace_test.image." + to_string(getpid());
+    TraceEntry snapshot;
+    snapshot.timestampUs = 2;
+    snapshot.command = "snapshot " + image;
+    stringstream trace(formatTraceEntry(touch) + "\n" + formatTraceEntry(write) + "\n" + formatTraceEntry(snapshot) + "\n");
+
+    FileSystem fs;
+    ReplayReport report = replayTrace(fs, trace, false);
+    EXPECT_EQ(3, report.commands);
+    EXPECT_EQ(1, report.failed);
+    EXPECT_EQ("two words\nand a line", fs.cat("f"));
+    EXPECT_NE(0, access(image.c_str(), F_OK));
+}
+
+// Tests replaying at original timing keeps commands as far apart as in the trace
+TEST(Trace, TestOriginalTiming) {
+    TraceEntry first;
+    first.timestampUs = 1000000;
+    first.command = "mkdir /a";
+    TraceEntry second = first;
+    second.timestampUs += 50000;
+    second.command = "ls /";
+    second.resultBytes = 2;
+    // Listed in the order the commands finished
+    stringstream trace(formatTraceEntry(second) + "\n" + formatTraceEntry(first) + "\n");
+
+    FileSystem fs;
+    ReplayReport report = replayTrace(fs, trace, true);
+    EXPECT_EQ(0, report.diverged);
+    EXPECT_LE(50000000, report.elapsedNs);
+}
+}  // namespace
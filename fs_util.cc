@@ -0,0 +1,94 @@
+#include "fs_util.h"
+
+using namespace std;
+
+namespace {
+
+struct CrcTable {
+    uint32_t entries[256];
+    constexpr CrcTable() : entries() {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (crc & 1 ? 0xEDB88320u : 0);
+            entries[i] = crc;
+        }
+    }
+};
+constexpr CrcTable kCrcTable;
+
+}  // namespace
+
+void putU32(string& out, uint32_t value) {
+    char bytes[4] = {char(value), char(value >> 8), char(value >> 16), char(value >> 24)};
+    out.append(bytes, 4);
+}
+
+uint32_t getU32(const char* data) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+}
+
+void putU64(string& out, uint64_t value) {
+    putU32(out, uint32_t(value));
+    putU32(out, uint32_t(value >> 32));
+}
+
+uint64_t getU64(const char* data) {
+    return getU32(data) | (uint64_t(getU32(data + 4)) << 32);
+}
+
+void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += char(value | 0x80);
+        value >>= 7;
+    }
+    out += char(value);
+}
+
+bool getVarint(const char*& data, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && data < end; shift += 7) {
+        uint8_t byte = *data++;
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+bool readVarint(istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = in.get();
+        if (byte == EOF) return false;
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// CRC-32 (as in zlib). Pass the crc of the previous data to continue it.
+uint32_t crc32(const char* data, size_t size, uint32_t crc) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = kCrcTable.entries[(crc ^ uint8_t(data[i])) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint64_t contentHash(const char* data, size_t size, uint64_t hash) {
+    const uint64_t kPrime = (1ull << 61) - 1;
+    const uint64_t kBase = 0x1f3d5b79a2c4e687ull % kPrime;
+    for (size_t i = 0; i < size; i++) {
+        // Bytes count from 1, so leading zero bytes change the hash
+        unsigned __int128 product = (unsigned __int128) hash * kBase + uint8_t(data[i]) + 1;
+        uint64_t folded = uint64_t(product & kPrime) + uint64_t(product >> 61);
+        folded = (folded & kPrime) + (folded >> 61);
+        hash = folded >= kPrime ? folded - kPrime : folded;
+    }
+    return hash;
+}
+
+uint64_t mix64(uint64_t value) {
+    value += 0x9e3779b97f4a7c15ull;
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+    return value ^ (value >> 31);
+}
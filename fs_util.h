@@ -0,0 +1,32 @@
+#ifndef FS_UTIL_H
+#define FS_UTIL_H
+
+#include <cstdint>
+#include <istream>
+#include <string>
+
+using namespace std;
+
+/* Encoding helpers shared by the on-disk formats and the wire protocol
+   All integers are little endian.
+*/
+
+void putU32(string& out, uint32_t value);
+uint32_t getU32(const char* data);
+void putU64(string& out, uint64_t value);
+uint64_t getU64(const char* data);
+
+// 7 bits per byte, high bit set on all but the last byte
+void putVarint(string& out, uint64_t value);
+// Return false if data ends before the varint does; data is moved past it otherwise
+bool getVarint(const char*& data, const char* end, uint64_t& value);
+bool readVarint(istream& in, uint64_t& value);
+
+uint32_t crc32(const char* data, size_t size, uint32_t crc = 0);
+
+// Polynomial hash mod 2^61-1 of bytes (0 for none). Pass the hash of the previous data to
+// continue it: appending to data only hashes the appended bytes.
+uint64_t contentHash(const char* data, size_t size, uint64_t hash = 0);
+// Bijective 64 bit mix (splitmix64), spreading every input bit over the output
+uint64_t mix64(uint64_t value);
+#endif
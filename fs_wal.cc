@@ -0,0 +1,334 @@
+#include "fs_wal.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include "fs_util.h"
+
+using namespace std;
+
+namespace {
+
+const char kMagic[8] = {'F', 'S', 'W', 'A', 'L', '1', '\n', '\0'};
+// Record header: body length and crc
+const size_t kHeaderSize = 8;
+// Bigger bodies can only come from a corrupt length
+const uint32_t kMaxBodySize = 1u << 30;
+
+void putString(string& out, const string& s) {
+    putVarint(out, s.size());
+    out += s;
+}
+
+// Reads the fields of a record body. Return false if the body is malformed.
+class BodyReader {
+    const char* pos;
+    const char* end;
+  public:
+    BodyReader(const char* data, size_t size) : pos(data), end(data + size) {}
+    bool varint(uint64_t& value) { return getVarint(pos, end, value); }
+    bool u8(uint8_t& value) {
+        if (pos == end) return false;
+        value = *pos++;
+        return true;
+    }
+    bool str(string& s) {
+        uint64_t len;
+        if (!varint(len) || uint64_t(end - pos) < len) return false;
+        s.assign(pos, len);
+        pos += len;
+        return true;
+    }
+    bool done() { return pos == end; }
+};
+
+string segmentName(uint64_t firstLsn) {
+    char name[64];
+    snprintf(name, sizeof(name), "wal-%020llu.log", (unsigned long long) firstLsn);
+    return name;
+}
+
+// First lsns of the segments in dir, in order
+vector<uint64_t> listSegments(const string& dir) {
+    vector<uint64_t> segments;
+    DIR* d = opendir(dir.c_str());
+    if (!d) return segments;
+    while (dirent* entry = readdir(d)) {
+        unsigned long long firstLsn;
+        char suffix[8];
+        if (sscanf(entry->d_name, "wal-%20llu.%7s", &firstLsn, suffix) == 2 && string(suffix) == "log"
+                && entry->d_name == segmentName(firstLsn)) {
+            segments.push_back(firstLsn);
+        }
+    }
+    closedir(d);
+    sort(segments.begin(), segments.end());
+    return segments;
+}
+
+// Read the records of one segment into apply. Return false if the segment ends with bytes
+// that aren't a valid record, which are truncated away if truncateTorn.
+bool readSegment(const string& path, bool truncateTorn, const function<void(const WalRecord&)>& apply);
+
+[[noreturn]] void fatal(const string& what) {
+    // Mutations are applied already and can't be made durable: stop before acknowledging more
+    cerr << "Write-ahead log: " << what << ": " << strerror(errno) << endl;
+    abort();
+}
+
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(const string& dir, Durability durability, uint64_t lastLsn)
+        : dir(dir), durability(durability), lastLsn(lastLsn), writtenLsn(lastLsn), durableLsn(lastLsn) {
+    if (::mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+        throw runtime_error("Cannot create log directory " + dir + ": " + strerror(errno));
+    }
+    fd = -1;
+    openSegment(lastLsn + 1);
+    if (durability != Durability::PerOp) flusher = thread([this]() { flushLoop(); });
+}
+
+void WriteAheadLog::openSegment(uint64_t firstLsn) {
+    string path = dir + "/" + segmentName(firstLsn);
+    int newFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (newFd < 0) throw runtime_error("Cannot open write-ahead log " + path + ": " + strerror(errno));
+    if (fd >= 0) close(fd);
+    fd = newFd;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == 0) {
+        writeAll(string(kMagic, sizeof(kMagic)));
+        if (durability != Durability::None) fdatasync(fd);
+    }
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    if (flusher.joinable()) {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        flushNeeded.notify_one();
+        flusher.join();
+    }
+    close(fd);
+}
+
+uint64_t WriteAheadLog::append(WalOp op, const string& cwd, const string& arg1, const string& arg2) {
+    lock_guard<mutex> guard(lock);
+    WalRecord record = {++lastLsn, op, cwd, arg1, arg2};
+    size_t start = pending.size();
+    encode(record, pending);
+    if (tap) tap(lastLsn, pending.substr(start));
+    if (durability == Durability::PerOp) {
+        writeAll(pending);
+        if (fdatasync(fd) < 0) fatal("fdatasync");
+        pending.clear();
+        writtenLsn = durableLsn = lastLsn;
+    } else {
+        flushNeeded.notify_one();
+    }
+    return lastLsn;
+}
+
+void WriteAheadLog::commit(uint64_t lsn) {
+    if (durability != Durability::GroupCommit) return;
+    unique_lock<mutex> guard(lock);
+    flushed.wait(guard, [this, lsn]() { return durableLsn >= lsn; });
+}
+
+// Background thread writing pending records. All records appended while it writes (and
+// fsyncs) the previous batch go into the next batch, so the more concurrent writers, the
+// more records share one fsync.
+void WriteAheadLog::flushLoop() {
+    string batch;
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        flushNeeded.wait(guard, [this]() { return stopping || !pending.empty(); });
+        if (pending.empty()) return;
+        batch.swap(pending);
+        uint64_t batchLsn = lastLsn;
+        flushing = true;
+        guard.unlock();
+
+        writeAll(batch);
+        if (durability == Durability::GroupCommit && fdatasync(fd) < 0) fatal("fdatasync");
+        // Keep the capacity for the next batch
+        batch.clear();
+
+        guard.lock();
+        flushing = false;
+        writtenLsn = batchLsn;
+        if (durability == Durability::GroupCommit) durableLsn = batchLsn;
+        flushed.notify_all();
+    }
+}
+
+uint64_t WriteAheadLog::lsn() {
+    lock_guard<mutex> guard(lock);
+    return lastLsn;
+}
+
+uint64_t WriteAheadLog::rotate() {
+    unique_lock<mutex> guard(lock);
+    // No more appends: let the flusher write out what's pending
+    flushed.wait(guard, [this]() { return !flushing && writtenLsn == lastLsn; });
+    if (fdatasync(fd) < 0) fatal("fdatasync");
+    durableLsn = max(durableLsn, lastLsn);
+    openSegment(lastLsn + 1);
+    return lastLsn;
+}
+
+void WriteAheadLog::truncate(uint64_t lsn) {
+    vector<uint64_t> segments = listSegments(dir);
+    for (size_t i = 0; i + 1 < segments.size() && segments[i + 1] <= lsn + 1; i++) {
+        unlink((dir + "/" + segmentName(segments[i])).c_str());
+    }
+}
+
+void WriteAheadLog::setTap(function<void(uint64_t lsn, const string& record)> tap) {
+    lock_guard<mutex> guard(lock);
+    this->tap = move(tap);
+}
+
+void WriteAheadLog::writeAll(const string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fatal("write");
+        }
+        written += n;
+    }
+}
+
+void WriteAheadLog::encode(const WalRecord& record, string& out) {
+    size_t start = out.size();
+    out.append(kHeaderSize, '\0');
+    putVarint(out, record.lsn);
+    out += char(record.op);
+    putString(out, record.cwd);
+    putString(out, record.arg1);
+    putString(out, record.arg2);
+
+    string header;
+    size_t bodySize = out.size() - start - kHeaderSize;
+    putU32(header, bodySize);
+    putU32(header, crc32(out.data() + start + kHeaderSize, bodySize));
+    out.replace(start, kHeaderSize, header);
+}
+
+size_t WriteAheadLog::decode(const char* data, size_t size, WalRecord& record) {
+    if (size < kHeaderSize) return 0;
+    uint32_t bodySize = getU32(data);
+    if (bodySize > kMaxBodySize || size - kHeaderSize < bodySize) return 0;
+    const char* body = data + kHeaderSize;
+    if (crc32(body, bodySize) != getU32(data + 4)) return 0;
+
+    BodyReader reader(body, bodySize);
+    uint8_t op;
+    if (!reader.varint(record.lsn) || !reader.u8(op) || !reader.str(record.cwd)
+            || !reader.str(record.arg1) || !reader.str(record.arg2) || !reader.done()) {
+        return 0;
+    }
+    record.op = WalOp(op);
+    return kHeaderSize + bodySize;
+}
+
+uint64_t WriteAheadLog::read(const string& dir, uint64_t afterLsn, const function<void(const WalRecord&)>& apply) {
+    vector<uint64_t> segments = listSegments(dir);
+    uint64_t lastLsn = 0;
+    uint64_t firstApplied = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        string path = dir + "/" + segmentName(segments[i]);
+        bool last = i + 1 == segments.size();
+        bool valid = readSegment(path, last, [&](const WalRecord& record) {
+            if (lastLsn != 0 && record.lsn != lastLsn + 1) {
+                throw runtime_error("Records missing before lsn " + to_string(record.lsn) + " in " + path);
+            }
+            lastLsn = record.lsn;
+            if (record.lsn <= afterLsn) return;
+            if (firstApplied == 0) firstApplied = record.lsn;
+            apply(record);
+        });
+        // Only the last segment was being written at a crash
+        if (!valid && !last) throw runtime_error("Corrupt write-ahead log segment " + path);
+    }
+    if (firstApplied > afterLsn + 1) {
+        throw runtime_error("Records " + to_string(afterLsn + 1) + " to " + to_string(firstApplied - 1) + " missing in " + dir);
+    }
+    return max(lastLsn, afterLsn);
+}
+
+namespace {
+
+bool readSegment(const string& path, bool truncateTorn, const function<void(const WalRecord&)>& apply) {
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) throw runtime_error("Cannot open write-ahead log " + path + ": " + strerror(errno));
+
+    // Unparsed bytes read from the file, starting at file offset bufOffset
+    string buf;
+    off_t bufOffset = 0;
+    bool eof = false;
+    // Read until buf holds at least size bytes. Return false at the end of the file.
+    auto fill = [&](size_t size) {
+        char chunk[1 << 16];
+        while (buf.size() < size && !eof) {
+            ssize_t n = ::read(fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) eof = true;
+            else buf.append(chunk, n);
+        }
+        return buf.size() >= size;
+    };
+
+    off_t validEnd = 0;
+    try {
+        if (fill(sizeof(kMagic))) {
+            if (buf.compare(0, sizeof(kMagic), kMagic, sizeof(kMagic)) != 0) {
+                throw runtime_error("Not a write-ahead log: " + path);
+            }
+            validEnd = sizeof(kMagic);
+            size_t pos = sizeof(kMagic);
+            WalRecord record;
+            while (fill(pos + kHeaderSize)) {
+                uint32_t bodySize = getU32(buf.data() + pos);
+                if (bodySize > kMaxBodySize || !fill(pos + kHeaderSize + bodySize)) break;
+                size_t size = WriteAheadLog::decode(buf.data() + pos, buf.size() - pos, record);
+                if (size == 0) break;
+                apply(record);
+
+                pos += size;
+                validEnd = bufOffset + pos;
+                // Drop parsed bytes now and then
+                if (pos > (1 << 20)) {
+                    buf.erase(0, pos);
+                    bufOffset += pos;
+                    pos = 0;
+                }
+            }
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    struct stat st;
+    bool valid = fstat(fd, &st) == 0 && st.st_size == validEnd;
+    // Whatever follows the last valid record is a torn write
+    if (!valid && truncateTorn && ftruncate(fd, validEnd) < 0) {
+        close(fd);
+        throw runtime_error("Cannot truncate write-ahead log " + path + ": " + strerror(errno));
+    }
+    close(fd);
+    return valid;
+}
+
+}  // namespace
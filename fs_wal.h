@@ -0,0 +1,124 @@
+#ifndef FS_WAL_H
+#define FS_WAL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/* Write-ahead log of the mutations of a FileSystem
+   Every successful write function appends one record, in the order the mutations were
+   applied. Replaying the records on an empty FS (or on a checkpoint, see fs_checkpoint.h)
+   rebuilds the tree.
+
+   The log is a directory of segment files named after the lsn of their first record,
+   e.g. wal-00000000000000000001.log. A new segment starts at every checkpoint, so the
+   segments a checkpoint covers can simply be deleted.
+
+   Segment format: the 8 byte magic "FSWAL1\n\0", then records:
+   u32 body length | u32 crc32 of body | body
+   body: varint lsn | u8 op | string cwd | string arg1 | string arg2, strings are varint length | bytes
+   A crash can leave a torn record at the end of the last segment: it's dropped on recovery.
+*/
+
+enum class WalOp : uint8_t {
+    Mkdir = 1,
+    Rm = 2,
+    Touch = 3,
+    Write = 4,
+    Mv = 5,
+    Cp = 6,
+    CpRecursive = 7,
+};
+
+struct WalRecord {
+    // Log sequence number: 1 for the first record, +1 for every next one
+    uint64_t lsn;
+    WalOp op;
+    // Absolute path of the working directory of the session running the op
+    string cwd;
+    // Params of the write function
+    string arg1;
+    string arg2;
+};
+
+// When a mutation is on disk
+enum class Durability {
+    // Records are handed to the OS in batches by a background thread, never fsynced:
+    // they survive a process crash but not a machine crash.
+    None,
+    // Records of concurrent clients are written and fsynced together by a background
+    // thread. A write function returns once its record is durable.
+    GroupCommit,
+    // Every record is written and fsynced on its own before its write function returns.
+    PerOp,
+};
+
+class WriteAheadLog {
+    string dir;
+    // Current segment
+    int fd;
+    Durability durability;
+
+    mutex lock;
+    // Wakes the flusher up when records are pending, and waiters when records are written
+    condition_variable flushNeeded;
+    condition_variable flushed;
+    // Encoded records not written yet, and the lsn of the last one
+    string pending;
+    uint64_t lastLsn;
+    // Last record handed to the OS, and last record on disk
+    uint64_t writtenLsn;
+    uint64_t durableLsn;
+    // The flusher is writing a batch to fd without holding the lock
+    bool flushing = false;
+    bool stopping = false;
+    thread flusher;
+    // Sees every appended record (see setTap)
+    function<void(uint64_t lsn, const string& record)> tap;
+
+    void openSegment(uint64_t firstLsn);
+    void flushLoop();
+    void writeAll(const string& data);
+  public:
+    // Open the log in dir for appending, creating dir if needed. An existing log must have been
+    // recovered with read() first, so that lsns continue after lastLsn.
+    WriteAheadLog(const string& dir, Durability durability, uint64_t lastLsn = 0);
+    // Flush pending records
+    ~WriteAheadLog();
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Append a record and return its lsn. Callers hold the tree lock, so records are in
+    // apply order; they wait with commit() after releasing it, so that concurrent writers
+    // share one fsync.
+    uint64_t append(WalOp op, const string& cwd, const string& arg1, const string& arg2);
+    // Wait until the record is durable as the durability mode requires
+    void commit(uint64_t lsn);
+
+    // Lsn of the last appended record
+    uint64_t lsn();
+    // Close the current segment once all its records are on disk, and start a new one.
+    // Callers hold the tree lock so no record is appended meanwhile. Return the lsn of the
+    // last record in the closed segments.
+    uint64_t rotate();
+    // Delete the segments holding only records up to lsn
+    void truncate(uint64_t lsn);
+    // Call tap with every record appended from now on, encoded, in lsn order. It runs under
+    // the log's lock, so it must be quick and not call back into the log. Null removes it.
+    void setTap(function<void(uint64_t lsn, const string& record)> tap);
+
+    // Call apply for every record of the log in dir after lsn afterLsn, and drop a torn record
+    // at its end. Return the lsn of the last record, or afterLsn if there is none after it.
+    static uint64_t read(const string& dir, uint64_t afterLsn, const function<void(const WalRecord&)>& apply);
+
+    static void encode(const WalRecord& record, string& out);
+    // Decode the encoded record at the start of data into record. Return its size, or 0 if
+    // data doesn't start with a whole valid record.
+    static size_t decode(const char* data, size_t size, WalRecord& record);
+};
+#endif
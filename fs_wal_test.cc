@@ -0,0 +1,191 @@
+#include "fs_impl.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+/* Test the write-ahead log, and recovering a FS from it */
+namespace {
+
+// Files in dir, in order
+vector<string> listDir(const string& dir) {
+    vector<string> names;
+    DIR* d = opendir(dir.c_str());
+    while (dirent* entry = d ? readdir(d) : nullptr) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    if (d) closedir(d);
+    sort(names.begin(), names.end());
+    return names;
+}
+
+void removeDir(const string& dir) {
+    for (const string& name : listDir(dir)) unlink((dir + "/" + name).c_str());
+    rmdir(dir.c_str());
+}
+
+string tempLog() {
+    string path = "/tmp/fs_wal_test." + to_string(getpid());
+    removeDir(path);
+    return path;
+}
+
+// Rebuild a FS from the log at path
+uint64_t recover(FileSystem& fs, const string& path, uint64_t afterLsn = 0) {
+    FileSystem::Session replay(fs);
+    return WriteAheadLog::read(path, afterLsn, [&](const WalRecord& record) { fs.apply(replay, record); });
+}
+
+// Tests a recovered FS matches the logged one, including ops relative to other directories
+TEST(WriteAheadLog, TestRecover) {
+    string path = tempLog();
+    {
+        FileSystem fs;
+        WriteAheadLog wal(path, Durability::GroupCommit);
+        fs.attachLog(&wal);
+        fs.mkdir("/a/b/c");
+        fs.cd("a");
+        fs.touch("f");
+        fs.write("f", "hello ");
+        fs.write("/a/f", "world");
+        fs.mv("f", "g");
+        fs.rm("b");
+        fs.mkdir("x/../y");
+        fs.cp("g", "/a/x/h");
+        fs.cp("/a", "/copy", true);
+        // Failing ops aren't logged
+        EXPECT_THROW(fs.touch("g"), invalid_argument);
+        // Failing halfway creates nothing either
+        EXPECT_THROW(fs.mkdir("z/../../.."), invalid_argument);
+    }
+
+    FileSystem fs;
+    EXPECT_EQ(9, recover(fs, path));
+    EXPECT_EQ((vector<string>{"a", "copy"}), fs.ls("/"));
+    EXPECT_EQ(vector<string>{"h"}, fs.ls("/copy/x"));
+    EXPECT_EQ((vector<string>{"g", "x", "y"}), fs.ls("/a"));
+    EXPECT_EQ("hello world", fs.cat("/a/g"));
+    removeDir(path);
+}
+
+// Tests a mkdir -p stopped by a quota recovers to the same tree: quotas aren't logged, so the
+// op must create nothing rather than the directories before the one over the limit
+TEST(WriteAheadLog, TestRecoverQuotaMkdir) {
+    string path = tempLog();
+    WriteAheadLog wal(path, Durability::GroupCommit);
+    FileSystem fs;
+    fs.attachLog(&wal);
+    fs.mkdir("/q/a");
+    QuotaLimits limits;
+    limits.maxInodes = 3;
+    fs.setQuota("/q", limits);
+    EXPECT_THROW(fs.mkdir("/q/b/c/d"), invalid_argument);
+    EXPECT_THROW(fs.mkdir("/q/b/../c/../d"), invalid_argument);
+    EXPECT_EQ(vector<string>{"a"}, fs.ls("/q"));
+    fs.mkdir("/q/b/../c");
+
+    FileSystem recovered;
+    EXPECT_EQ(2, recover(recovered, path));
+    EXPECT_TRUE(FileSystem::diff(fs, recovered).empty());
+    EXPECT_EQ(fs.du("/").dirs, recovered.du("/").dirs);
+    EXPECT_EQ((vector<string>{"a", "b", "c"}), recovered.ls("/q"));
+    removeDir(path);
+}
+
+// Tests a torn record at the end of the log is dropped, and the log continues after the last good one
+TEST(WriteAheadLog, TestTornRecord) {
+    string path = tempLog();
+    {
+        FileSystem fs;
+        WriteAheadLog wal(path, Durability::PerOp);
+        fs.attachLog(&wal);
+        fs.touch("f");
+        fs.write("f", "kept");
+        fs.write("f", "torn");
+    }
+    string segment = path + "/" + listDir(path).back();
+    int fd = open(segment.c_str(), O_WRONLY);
+    off_t size = lseek(fd, 0, SEEK_END);
+    EXPECT_EQ(0, ftruncate(fd, size - 2));
+    close(fd);
+
+    {
+        FileSystem fs;
+        EXPECT_EQ(2, recover(fs, path));
+        EXPECT_EQ("kept", fs.cat("f"));
+        WriteAheadLog wal(path, Durability::None, 2);
+        fs.attachLog(&wal);
+        fs.write("f", "!");
+    }
+    FileSystem fs;
+    EXPECT_EQ(3, recover(fs, path));
+    EXPECT_EQ("kept!", fs.cat("f"));
+    removeDir(path);
+}
+
+// Tests concurrent writers sharing group commits all get their records logged
+TEST(WriteAheadLog, TestConcurrentWriters) {
+    string path = tempLog();
+    const int threads = 8;
+    const int writes = 200;
+    {
+        FileSystem fs;
+        WriteAheadLog wal(path, Durability::GroupCommit);
+        fs.attachLog(&wal);
+        fs.touch("f");
+        vector<thread> writers;
+        for (int t = 0; t < threads; t++) {
+            writers.emplace_back([&fs]() {
+                FileSystem::Session session(fs);
+                for (int i = 0; i < writes; i++) fs.write(session, "f", "x");
+            });
+        }
+        for (thread& writer : writers) writer.join();
+    }
+    FileSystem fs;
+    EXPECT_EQ(1 + threads * writes, recover(fs, path));
+    EXPECT_EQ(threads * writes, fs.cat("f").size());
+    removeDir(path);
+}
+
+// Tests rotating starts a new segment, and truncating deletes the segments before an lsn
+TEST(WriteAheadLog, TestRotateTruncate) {
+    string path = tempLog();
+    FileSystem fs;
+    WriteAheadLog wal(path, Durability::GroupCommit);
+    fs.attachLog(&wal);
+    fs.mkdir("a");
+    fs.mkdir("b");
+    EXPECT_EQ(2, wal.rotate());
+    fs.mkdir("c");
+    EXPECT_EQ(3, wal.rotate());
+    fs.mkdir("d");
+    EXPECT_EQ((vector<string>{"wal-00000000000000000001.log", "wal-00000000000000000003.log",
+                              "wal-00000000000000000004.log"}), listDir(path));
+    {
+        FileSystem copy;
+        EXPECT_EQ(4, recover(copy, path));
+        EXPECT_EQ((vector<string>{"a", "b", "c", "d"}), copy.ls("/"));
+    }
+
+    wal.truncate(2);
+    EXPECT_EQ((vector<string>{"wal-00000000000000000003.log", "wal-00000000000000000004.log"}), listDir(path));
+    {
+        // Replaying from the truncation point
+        FileSystem copy;
+        copy.mkdir("a");
+        copy.mkdir("b");
+        EXPECT_EQ(4, recover(copy, path, 2));
+        EXPECT_EQ((vector<string>{"a", "b", "c", "d"}), copy.ls("/"));
+    }
+    {
+        // Records between the given lsn and the first segment are gone
+        FileSystem copy;
+        EXPECT_THROW(recover(copy, path, 1), runtime_error);
+    }
+    removeDir(path);
+}
+
+}  // namespace
@@ -1,9 +1,23 @@
 #include "fs_impl.h"
 
+#include "fs_stats.h"
+#include "fs_util.h"
+
 using namespace std;
 
 /* Implementation of functions in this file adds/deletes nodes (mutate) */
 
+namespace {
+
+// Name of a node in its directory, from its absolute path
+string_view baseName(const string& path) {
+    size_t end = path.size() > 1 && path.back() == '/' ? path.size() - 1 : path.size();
+    size_t start = path.rfind('/', end - 1) + 1;
+    return string_view(path).substr(start, end - start);
+}
+
+}  // namespace
+
 // Create a new directory. The current working directory is the parent.
 // Return Error if a file or directory with the same name exists under the parent.
 // Extension:
@@ -12,66 +26,160 @@ using namespace std;
 // 2. if path param doesn't start with "/", traversal starts from the working directory
 // 3. automatically create any intermediate directories on the path that don’t exist yet.
 // 4. O(n) for n subdirs
-void FileSystem::mkdir(string path) {
-    bool created = false;
-    File* traverse = currDir;
+// 5. every directory is checked (names, quotas) before any is created: mkdir creates all the
+//    missing ones or none
+void FileSystem::mkdir(Session& session, string path) try {
+    OpTimer timer(FsOp::Mkdir, session.id, &path);
+    checkWritable(session);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    // Creating the missing directories on the way counts as resolving the path
+    Span resolve(SpanPhase::Resolve);
+    File* traverse = session.currDir;
     vector<string> subdirs = split(path, '/');
+    if (subdirs.empty()) throw invalid_argument("Invalid path: " + path);
     int i = 0;
     if (subdirs[0] == "") {
         traverse = root;
         i = 1;
     }
+    // Check every name before creating any directory, e.g. the empty one of "a//b"
+    for (int j = i; j < subdirs.size(); j++) {
+        if (subdirs[j] != ".." && !validName(subdirs[j])) throw invalid_argument("Invalid path: " + path);
+    }
+
+    // Directories to create, parents first: the existing directory they go under, and their
+    // parent among the ones to create (-1 if it's that existing directory)
+    struct NewDir {
+        File* under;
+        int parent;
+        string name;
+    };
+    vector<NewDir> newDirs;
+    // Walk the path, with the position in a directory to create once one is missing
+    int planned = -1;
     for (; i < subdirs.size(); i++) {
-        string subdir = subdirs[i];
+        const string& subdir = subdirs[i];
         if (subdir == "..") {
-            if (traverse->parent) {
+            if (planned >= 0) {
+                traverse = newDirs[planned].under;
+                planned = newDirs[planned].parent;
+            } else if (traverse->parent) {
                 traverse = traverse->parent;
-                continue;
             } else {
                 throw invalid_argument("Invalid path: " + path);
             }
-        }
-        if (traverse->children.find(subdir) != traverse->children.end()) {
-            if (!traverse->children[subdir]->isDir) throw invalid_argument("Invalid path: " + path);
-            traverse = traverse->children[subdir];
             continue;
         }
+        countNodes();
+        if (planned < 0) {
+            loadChildren(traverse);
+            auto child = traverse->children.find(subdir);
+            if (child != traverse->children.end()) {
+                if (!child->second->isDir) throw invalid_argument("Invalid path: " + path);
+                traverse = child->second;
+                continue;
+            }
+        }
+        // Going back down a directory to create, e.g. "a/b/../b"
+        int next = -1;
+        for (int j = 0; j < newDirs.size() && next < 0; j++) {
+            if (newDirs[j].under == traverse && newDirs[j].parent == planned && newDirs[j].name == subdir) next = j;
+        }
+        if (next < 0) {
+            newDirs.push_back({traverse, planned, subdir});
+            next = newDirs.size() - 1;
+        }
+        planned = next;
+    }
+    if (newDirs.empty()) throw invalid_argument("File/Directory exists: " + path);
+
+    // A new directory counts against the quotas of the existing directory it goes under
+    map<Quota*, int64_t> inodes;
+    for (const NewDir& newDir : newDirs) {
+        for (Quota* quota = newDir.under->quota; quota; quota = quota->up) inodes[quota]++;
+    }
+    for (auto iter = inodes.begin(); iter != inodes.end(); iter++) checkQuota(iter->first, 0, iter->second);
 
-        File* newDir = new File();
-        newDir->isDir = true;
-        newDir->name = traverse->name + subdir + "/";
-        traverse->children[subdir] = newDir;
-        newDir->parent = traverse;
-        traverse = newDir;
-        created = true;
+    vector<File*> created;
+    for (const NewDir& newDir : newDirs) {
+        File* parent = newDir.parent < 0 ? newDir.under : created[newDir.parent];
+        File* dir = new File();
+        dir->isDir = true;
+        dir->name = parent->name + newDir.name + "/";
+        dir->quota = parent->quota;
+        parent->children[newDir.name] = dir;
+        dir->parent = parent;
+        updateHash(parent, 0, entryHash(newDir.name, true, 0));
+        dir->usage.store(ownUsage(dir));
+        addUsage(parent, dir->usage.load());
+        dir->diskUsage.dirs = 1;
+        addDiskUsage(parent, dir->diskUsage);
+        created.push_back(dir);
     }
-    if (!created) throw invalid_argument("File/Directory exists: " + path);
+    resolve.end();
+    commit.lsn = log(WalOp::Mkdir, session, path);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Mkdir, e);
+    throw;
 }
 
 // Remove a directory or a file. The target must be among the current working directory’s children.
 // If the target directory is a parent, all subdirs of the target directory will be removed too.
 // TODO(mianl): Implement with absolute vs relative path extension
-void FileSystem::rm(string path) {
-    File* traverse = currDir;
+void FileSystem::rm(Session& session, string path) try {
+    OpTimer timer(FsOp::Rm, session.id, &path);
+    checkWritable(session);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    File* traverse = session.currDir;
+    countNodes();
 
+    loadChildren(traverse);
     if (traverse->children.find(path) == traverse->children.end()) {
         throw invalid_argument("No such file or directory: " + path);
     }
+    File* target = traverse->children[path];
     traverse->children.erase(path);
+    updateHash(traverse, entryHash(path, target->isDir, target->hash), 0);
+    addUsage(traverse, MemoryUsage() - target->usage.load());
+    addDiskUsage(traverse, DiskUsage() - target->diskUsage);
+    commit.lsn = log(WalOp::Rm, session, path);
+    removeNode(target);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Rm, e);
+    throw;
 }
 
 // Create a new file: Creates a new empty file in the current working directory.
 // Return Error if a file or directory with the same name already exists.
 // TODO(mianl): Implement with absolute vs relative path extension
-void FileSystem::touch(string path) {
+void FileSystem::touch(Session& session, string path) try {
+    OpTimer timer(FsOp::Touch, session.id, &path);
+    checkWritable(session);
+    if (!validName(path)) throw invalid_argument("Invalid path: " + path);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    File* currDir = session.currDir;
+    countNodes();
+    loadChildren(currDir);
     if (currDir->children.find(path) != currDir->children.end())
         throw invalid_argument("File/Directory exists: " + path);
+    checkQuota(currDir, 0, 1);
     File* newFile = new File();
     newFile->isDir = false;
     newFile->name = currDir->name + path;
     newFile->parent = currDir;
-    newFile->content = "";
     currDir->children[path] = newFile;
+    updateHash(currDir, 0, entryHash(path, false, 0));
+    newFile->usage.store(ownUsage(newFile));
+    addUsage(currDir, newFile->usage.load());
+    newFile->diskUsage.files = 1;
+    addDiskUsage(currDir, newFile->diskUsage);
+    commit.lsn = log(WalOp::Touch, session, path);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Touch, e);
+    throw;
 }
 
 // Write file contents: Appends the specified content to a file in the current working
@@ -80,10 +188,16 @@ void FileSystem::touch(string path) {
 // 1. if path param starts with "/", traversal starts from root
 // 2. if path param doesn't start with "/", traversal starts from the working directory
 // 3. O(n) for n subdirs
-void FileSystem::write(string path, string content) {
-    File* traverse = currDir;
+void FileSystem::write(Session& session, string path, string content) try {
+    OpTimer timer(FsOp::Write, session.id, &path);
+    checkWritable(session);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    Span resolve(SpanPhase::Resolve);
+    File* traverse = session.currDir;
     int i = 0;
     vector<string> subdirs = split(path, '/');
+    if (subdirs.empty()) throw invalid_argument("Invalid path: " + path);
     if (subdirs[0] == "") {
         traverse = root;
         i = 1;
@@ -99,32 +213,532 @@ void FileSystem::write(string path, string content) {
             }
         }
 
+        loadChildren(traverse);
         if (traverse->children.find(subdir) == traverse->children.end()) {
             throw invalid_argument("File not found: " + path);
         }
         traverse = traverse->children[subdir];
+        countNodes();
     }
+    resolve.end();
     if (!traverse->isDir) {
-        traverse->content += content;
+        checkQuota(traverse->parent, content.size(), 0);
+        MemoryUsage before = ownUsage(traverse);
+        ownContent(traverse);
+        *traverse->content += content;
+        countBytes(content.size());
+        addUsage(traverse, ownUsage(traverse) - before);
+        DiskUsage added;
+        added.bytes = content.size();
+        addDiskUsage(traverse, added);
+        uint64_t oldHash = traverse->hash;
+        traverse->hash = contentHash(content.data(), content.size(), oldHash);
+        string_view name = baseName(traverse->name);
+        updateHash(traverse->parent, entryHash(name, false, oldHash), entryHash(name, false, traverse->hash));
     } else {
         throw invalid_argument("Not a file: " + path);
     }
+    commit.lsn = log(WalOp::Write, session, path, content);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Write, e);
+    throw;
 }
 
 // Move a file: Move an existing file in the current working directory to a new location in
 // the same directory. Override the dest file if it already exists.
 // TODO(mianl): Implement with absolute vs relative path extension
-void FileSystem::mv(string from, string to) {
+void FileSystem::mv(Session& session, string from, string to) try {
+    OpTimer timer(FsOp::Mv, session.id, &from, &to);
+    checkWritable(session);
+    if (!validName(to)) throw invalid_argument("Invalid path: " + to);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    File* currDir = session.currDir;
+    countNodes();
+    loadChildren(currDir);
     if (currDir->children.find(from) == currDir->children.end()) throw invalid_argument("File not found: " + from);
     if (from == to) return;
 
     File* move = currDir->children[from];
     if (move->isDir) throw invalid_argument("Not a file: " + from);
+    MemoryUsage before = ownUsage(move);
     move->name = currDir->name + to;
     currDir->children.erase(from);
+    uint64_t removed = entryHash(from, false, move->hash);
+    if (currDir->children.find(to) != currDir->children.end()) {
+        File* existing = currDir->children[to];
+        removed += entryHash(to, existing->isDir, existing->hash);
+        addUsage(currDir, MemoryUsage() - existing->usage.load());
+        addDiskUsage(currDir, DiskUsage() - existing->diskUsage);
+        removeNode(existing);
+    }
     currDir->children[to] = move;
+    updateHash(currDir, removed, entryHash(to, false, move->hash));
+    addUsage(move, ownUsage(move) - before);
+    commit.lsn = log(WalOp::Mv, session, from, to);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Mv, e);
+    throw;
+}
+
+// Copy a file, or a directory with -r, to a new location. Both params are paths.
+// If the destination is a directory, the copy goes into it under the source's name; an
+// existing file is overwritten by a copied file.
+// Copies are O(nodes): file contents are shared until either side is written, and directories
+// still in the image the tree was loaded from share the image nodes.
+void FileSystem::cp(Session& session, string from, string to, bool recursive) try {
+    OpTimer timer(FsOp::Cp, session.id, &from, &to);
+    checkWritable(session);
+    LogCommit commit = {wal};
+    unique_lock<shared_mutex> lock = writeLock();
+    File* source = lookup(session, from);
+    if (!source) throw invalid_argument("No such file or directory: " + from);
+    if (source == root) throw invalid_argument("Invalid path: " + from);
+    if (source->isDir && !recursive) throw invalid_argument("Not a file: " + from);
+
+    File* parent;
+    string name;
+    File* dest = lookup(session, to);
+    if (dest && dest->isDir) {
+        parent = dest;
+        name = source->name.substr(0, source->name.size() - source->isDir);
+        name = name.substr(name.rfind('/') + 1);
+    } else {
+        size_t slash = to.rfind('/');
+        name = slash == string::npos ? to : to.substr(slash + 1);
+        if (!validName(name)) throw invalid_argument("Invalid path: " + to);
+        parent = slash == string::npos ? session.currDir.load() : lookup(session, slash == 0 ? "/" : to.substr(0, slash));
+        if (!parent || !parent->isDir) throw invalid_argument("No such file or directory: " + to);
+    }
+    loadChildren(parent);
+    auto existing = parent->children.find(name);
+    if (existing != parent->children.end() && (existing->second->isDir || source->isDir)) {
+        throw invalid_argument("File/Directory exists: " + to);
+    }
+    for (File* dir = parent; dir; dir = dir->parent) {
+        if (dir == source) throw invalid_argument("Invalid path: " + to);
+    }
+    // The copy takes the place of an existing file
+    DiskUsage added = source->diskUsage;
+    if (existing != parent->children.end()) {
+        if (existing->second == source) return;
+        added = added - existing->second->diskUsage;
+    }
+    checkQuota(parent, added.bytes, added.files + added.dirs);
+    uint64_t removed = 0;
+    if (existing != parent->children.end()) {
+        removed = entryHash(name, false, existing->second->hash);
+        addUsage(parent, MemoryUsage() - existing->second->usage.load());
+        addDiskUsage(parent, DiskUsage() - existing->second->diskUsage);
+        removeNode(existing->second);
+        parent->children.erase(existing);
+    }
+
+    // Copies to make: source node, and the directory and name of its copy
+    stack<tuple<File*, File*, string>> s;
+    s.push({source, parent, name});
+    // Copies made, parents before children
+    vector<File*> copies;
+    while (!s.empty()) {
+        File* node = get<0>(s.top());
+        File* copyParent = get<1>(s.top());
+        string copyName = get<2>(s.top());
+        s.pop();
+        File* copy = new File();
+        copy->isDir = node->isDir;
+        copy->parent = copyParent;
+        copy->name = copyParent->name + copyName + (node->isDir ? "/" : "");
+        copy->content = node->content;
+        copy->hash = node->hash;
+        copy->diskUsage = node->diskUsage;
+        if (copy->isDir) copy->quota = copyParent->quota;
+        copyParent->children[copyName] = copy;
+        copy->usage.store(ownUsage(copy));
+        copies.push_back(copy);
+        countNodes();
+        // A directory still in the image or the lower tree is copied with its whole subtree
+        const ImageNode* backing = node->backing;
+        copy->backing = backing;
+        if (node->isDir && !backing) {
+            File* listing = listingOf(node, backing);
+            if (backing) {
+                copy->backing = backing;
+            } else if (listing != node) {
+                copy->lower = listing;
+            } else {
+                for (auto iter = node->children.begin(); iter != node->children.end(); iter++) {
+                    s.push({iter->second, copy, iter->first});
+                }
+            }
+        }
+    }
+    updateHash(parent, removed, entryHash(name, source->isDir, source->hash));
+    // Sum the usage of the copies children first, then add the whole copy up from parent
+    for (size_t i = copies.size() - 1; i > 0; i--) copies[i]->parent->usage.add(copies[i]->usage.load());
+    addUsage(parent, copies[0]->usage.load());
+    addDiskUsage(parent, source->diskUsage);
+    commit.lsn = log(recursive ? WalOp::CpRecursive : WalOp::Cp, session, from, to);
+} catch (const invalid_argument& e) {
+    countError(FsOp::Cp, e);
+    throw;
+}
+
+// Set or remove the quota of a directory. Directories under it already on the heap are pointed
+// at the new closest quota: O(those directories), while later checks are O(quotas above).
+// Quotas are settings of the running FS: they aren't logged, nor saved in images.
+void FileSystem::setQuota(Session& session, string path, QuotaLimits limits) {
+    checkWritable(session);
+    unique_lock<shared_mutex> lock = writeLock();
+    File* dir = path == "." ? session.currDir.load() : lookup(session, path);
+    if (!dir) throw invalid_argument("No such file or directory: " + path);
+    if (!dir->isDir) throw invalid_argument("Not a directory: " + path);
+    if (limits.maxBytes < 0 || limits.maxInodes < 0) throw invalid_argument("Invalid quota: " + path);
+    bool unlimited = limits.maxBytes == 0 && limits.maxInodes == 0;
+    Quota* own = dir->quota && dir->quota->dir == dir ? dir->quota : nullptr;
+    if (own && !unlimited) {
+        own->limits = limits;
+    } else if (own) {
+        retargetQuota(dir, own, own->up);
+        dir->quota = own->up;
+        delete own;
+    } else if (!unlimited) {
+        Quota* quota = new Quota{dir, dir->quota, limits};
+        retargetQuota(dir, dir->quota, quota);
+        dir->quota = quota;
+    }
+}
+
+/************************ hash functions ************************/
+
+uint64_t FileSystem::entryHash(string_view name, bool isDir, uint64_t hash) {
+    return mix64(mix64(contentHash(name.data(), name.size()) * 2 + isDir) + hash);
+}
+
+void FileSystem::updateHash(File* dir, uint64_t removed, uint64_t added) {
+    while (true) {
+        uint64_t oldHash = dir->hash;
+        dir->hash += added - removed;
+        if (!dir->parent) return;
+        // The directory's own entry in its parent changes with it
+        string_view name = baseName(dir->name);
+        removed = entryHash(name, true, oldHash);
+        added = entryHash(name, true, dir->hash);
+        dir = dir->parent;
+    }
+}
+
+/************************ memory functions **********************/
+
+namespace {
+
+// Heap memory of a string beyond the string struct: none while short enough to be stored
+// in the struct
+const size_t kInlineCapacity = string().capacity();
+
+int64_t heapBytes(size_t capacity) {
+    return capacity > kInlineCapacity ? capacity + 1 : 0;
+}
+
+}  // namespace
+
+MemoryUsage FileSystem::ownUsage(const File* node) {
+    // A tree node of the parent's children map: color and 3 links, then the entry
+    const int64_t kMapNodeBytes = 4 * sizeof(void*) + sizeof(pair<const string, File*>);
+    // Block of make_shared: counts and vtable, then the string
+    const int64_t kSharedStringBytes = 2 * sizeof(int) + sizeof(void*) + sizeof(string);
+    MemoryUsage usage;
+    usage.nodes = sizeof(File);
+    usage.names = heapBytes(node->name.capacity());
+    // Keys are copies of the name in the directory, as long as needed
+    if (node->parent) usage.containers = kMapNodeBytes + heapBytes(baseName(node->name).size());
+    if (node->content) usage.contents = kSharedStringBytes + heapBytes(node->content->capacity());
+    return usage;
+}
+
+void FileSystem::addUsage(File* node, const MemoryUsage& delta) {
+    for (; node; node = node->parent) node->usage.add(delta);
+}
+
+void FileSystem::addDiskUsage(File* node, const DiskUsage& delta) {
+    for (; node; node = node->parent) node->diskUsage += delta;
+}
+
+/************************ quota functions ***********************/
+
+void FileSystem::checkQuota(File* dir, int64_t bytes, int64_t inodes) {
+    for (Quota* quota = dir->quota; quota; quota = quota->up) checkQuota(quota, bytes, inodes);
+}
+
+void FileSystem::checkQuota(Quota* quota, int64_t bytes, int64_t inodes) {
+    const DiskUsage& usage = quota->dir->diskUsage;
+    const QuotaLimits& limits = quota->limits;
+    // Like du, the directory doesn't count itself
+    int64_t usedInodes = usage.files + usage.dirs - 1;
+    if ((bytes > 0 && limits.maxBytes && usage.bytes + bytes > limits.maxBytes)
+            || (inodes > 0 && limits.maxInodes && usedInodes + inodes > limits.maxInodes)) {
+        throw invalid_argument("Disk quota exceeded: " + quota->dir->name);
+    }
 }
 
+void FileSystem::retargetQuota(File* dir, Quota* from, Quota* to) {
+    stack<File*> s;
+    s.push(dir);
+    while (!s.empty()) {
+        File* node = s.top();
+        s.pop();
+        for (auto iter = node->children.begin(); iter != node->children.end(); iter++) {
+            File* child = iter->second;
+            if (!child->isDir) continue;
+            if (child->quota == from) {
+                child->quota = to;
+                s.push(child);
+            } else {
+                // The child has a quota of its own, right under from
+                child->quota->up = to;
+            }
+        }
+    }
+}
+
+/************************ bulk build functions ******************/
+
+FileSystem::Builder::Dir FileSystem::Builder::addDir(Dir parent, const string& name) {
+    if (!validName(name)) throw invalid_argument("Invalid path: " + name);
+    fs.loadChildren(parent);
+    File* dir = new File();
+    dir->isDir = true;
+    dir->parent = parent;
+    if (!parent->children.emplace(name, dir).second) {
+        delete dir;
+        throw invalid_argument("File/Directory exists: " + parent->name + name);
+    }
+    dir->name = parent->name + name + "/";
+    dir->quota = parent->quota;
+    dir->usage.store(ownUsage(dir));
+    dir->diskUsage.dirs = 1;
+    return dir;
+}
+
+void FileSystem::Builder::addFile(Dir parent, const string& name, string content) {
+    uint64_t hash = contentHash(content.data(), content.size());
+    addFile(parent, name, content.empty() ? nullptr : make_shared<string>(move(content)), hash);
+}
+
+void FileSystem::Builder::addFile(Dir parent, const string& name, shared_ptr<string> content, uint64_t hash) {
+    if (!validName(name)) throw invalid_argument("Invalid path: " + name);
+    fs.loadChildren(parent);
+    File* file = new File();
+    file->isDir = false;
+    file->parent = parent;
+    if (!parent->children.emplace(name, file).second) {
+        delete file;
+        throw invalid_argument("File/Directory exists: " + parent->name + name);
+    }
+    file->name = parent->name + name;
+    file->hash = hash;
+    file->content = move(content);
+    file->usage.store(ownUsage(file));
+    file->diskUsage.files = 1;
+    file->diskUsage.bytes = file->content ? file->content->size() : 0;
+}
+
+// Hash every directory and sum its memory and disk usage from its children, children first.
+// Directories still in an image or a lower tree keep their hash and usage.
+void FileSystem::Builder::finish() {
+    if (!lock.owns_lock()) return;
+    stack<pair<File*, bool>> s;
+    s.push({fs.root, false});
+    while (!s.empty()) {
+        File* dir = s.top().first;
+        bool childrenDone = s.top().second;
+        s.pop();
+        if (childrenDone) {
+            dir->hash = 0;
+            MemoryUsage usage = ownUsage(dir);
+            DiskUsage diskUsage;
+            diskUsage.dirs = 1;
+            for (auto iter = dir->children.begin(); iter != dir->children.end(); iter++) {
+                dir->hash += entryHash(iter->first, iter->second->isDir, iter->second->hash);
+                usage += iter->second->usage.load();
+                diskUsage += iter->second->diskUsage;
+            }
+            dir->usage.store(usage);
+            dir->diskUsage = diskUsage;
+            continue;
+        }
+        if (dir->backing.load() || dir->lower.load()) continue;
+        s.push({dir, true});
+        for (auto iter = dir->children.begin(); iter != dir->children.end(); iter++) {
+            if (iter->second->isDir) s.push({iter->second, false});
+        }
+    }
+    lock.unlock();
+}
+
+/************************ log functions *************************/
+
+uint64_t FileSystem::log(WalOp op, Session& session, const string& arg1, const string& arg2) {
+    if (!wal) return 0;
+    return wal->append(op, session.currDir.load()->name, arg1, arg2);
+}
+
+// Replay a record of the write-ahead log: run its op from the directory it ran from.
+// Only ops that succeeded are logged, and they run the same way again: an error the replay
+// runs into anyway is ignored.
+void FileSystem::apply(Session& session, const WalRecord& record) {
+    {
+        shared_lock<shared_mutex> lock = readLock();
+        setCurrDir(session, findDir(record.cwd));
+    }
+    try {
+        switch (record.op) {
+            case WalOp::Mkdir: mkdir(session, record.arg1); break;
+            case WalOp::Rm: rm(session, record.arg1); break;
+            case WalOp::Touch: touch(session, record.arg1); break;
+            case WalOp::Write: write(session, record.arg1, record.arg2); break;
+            case WalOp::Mv: mv(session, record.arg1, record.arg2); break;
+            case WalOp::Cp: cp(session, record.arg1, record.arg2, false); break;
+            case WalOp::CpRecursive: cp(session, record.arg1, record.arg2, true); break;
+            default: throw runtime_error("Unknown op in log record " + to_string(record.lsn));
+        }
+    } catch (const invalid_argument&) {
+    }
+}
+
+/************************ checkpoint functions ******************/
+
+// Replace the tree with the image at path, written by save(), and return the lsn it was saved
+// at. The image is mapped, not read: its nodes are copied to the heap on their first visit.
+// Every session moves to root.
+uint64_t FileSystem::load(const string& path) {
+    shared_ptr<TreeImage> newImage = TreeImage::open(path);
+    File* newRoot = new File();
+    newRoot->isDir = true;
+    newRoot->parent = nullptr;
+    newRoot->name = "/";
+    newRoot->backing = newImage->root();
+    newRoot->hash = newImage->root()->hash;
+    newRoot->usage.store(ownUsage(newRoot));
+    newRoot->diskUsage.files = newImage->root()->files;
+    newRoot->diskUsage.dirs = newImage->root()->dirs;
+    newRoot->diskUsage.bytes = newImage->root()->bytes;
+
+    unique_lock<shared_mutex> lock = writeLock();
+    File* oldRoot = root;
+    root = newRoot;
+    {
+        lock_guard<mutex> guard(sessionsLock);
+        for (Session* session : sessions) setCurrDir(*session, root);
+    }
+    removeNode(oldRoot);
+    image = newImage;
+    sharedImage = false;
+    return image->getLsn();
+}
+
+// Make the content of a file its own before writing it: copy it from the image it was loaded
+// from, or from the copies of the file sharing it. Callers hold the tree lock exclusively,
+// so only nodes hold references to contents.
+void FileSystem::ownContent(File* file) {
+    const ImageNode* node = file->backing;
+    if (node) {
+        file->content = make_shared<string>(image->content(node));
+        file->backing = nullptr;
+        countBytes(file->content->size());
+    } else if (!file->content) {
+        file->content = make_shared<string>();
+    } else if (file->content.use_count() > 1) {
+        file->content = make_shared<string>(*file->content);
+        countBytes(file->content->size());
+    }
+}
+
+/************************ session functions *********************/
+
+FileSystem::Session::Session(FileSystem& fs, bool readOnly, uint64_t id)
+        : fs(fs), currDir(fs.root), readOnly(readOnly), id(id) {
+    lock_guard<mutex> lock(fs.sessionsLock);
+    fs.sessions.insert(this);
+    currDir.load()->sessionsHere++;
+}
+
+// Under the sessions lock, so rm sees either the session in the set or not in sessionsHere
+FileSystem::Session::~Session() {
+    lock_guard<mutex> lock(fs.sessionsLock);
+    fs.sessions.erase(this);
+    currDir.load()->sessionsHere--;
+}
+
+shared_lock<shared_mutex> FileSystem::readLock() {
+    LockTimer timer("shared");
+    return shared_lock<shared_mutex>(treeLock);
+}
+
+unique_lock<shared_mutex> FileSystem::writeLock() {
+    LockTimer timer("exclusive");
+    return unique_lock<shared_mutex>(treeLock);
+}
+
+void FileSystem::checkWritable(Session& session) {
+    if (session.readOnly) throw invalid_argument("Read-only file system");
+}
+
+FileSystem::FileSystem(FileSystem& lower) {
+    root = new File();
+    root->isDir = true;
+    root->parent = nullptr;
+    root->name = "/";
+    root->usage.store(ownUsage(root));
+    {
+        shared_lock<shared_mutex> lock(lower.treeLock);
+        image = lower.image;
+        sharedImage = true;
+        root->hash = lower.root->hash;
+        root->diskUsage = lower.root->diskUsage;
+        const ImageNode* node;
+        File* listing = lower.listingOf(lower.root, node);
+        if (node) root->backing = node;
+        else root->lower = listing;
+    }
+    ownSession.reset(new Session(*this));
+}
+
+FileSystem::~FileSystem() {
+    ownSession.reset();
+    removeNode(root);
+}
+
+// Free a node that is already detached from its parent, together with its subtree.
+// Sessions whose working directory is inside the subtree move up to the node's parent: the
+// sessions are only scanned for the directories some are in. Callers hold the tree lock
+// exclusively.
+void FileSystem::removeNode(File* node) {
+    File* up = node->parent;
+    stack<File*> s;
+    s.push(node);
+    while (!s.empty()) {
+        File* file = s.top();
+        s.pop();
+        for (auto iter = file->children.begin(); iter != file->children.end(); iter++) {
+            s.push(iter->second);
+        }
+        if (file->sessionsHere > 0) {
+            lock_guard<mutex> lock(sessionsLock);
+            for (Session* session : sessions) {
+                if (session->currDir == file && up) setCurrDir(*session, up);
+            }
+        }
+        if (file->quota && file->quota->dir == file) delete file->quota;
+        delete file;
+        countNodes();
+    }
+}
+
+void FileSystem::setCurrDir(Session& session, File* dir) {
+    session.currDir.load()->sessionsHere--;
+    dir->sessionsHere++;
+    session.currDir = dir;
+}
 
 /************************ util functions **************************
 TODO(mianl): move util functions to a separate file as this section grows larger